@@ -20,22 +20,33 @@ namespace CGL {
 
 Application::Application(AppConfig config, bool gl) {
   gl_window = gl;
-  renderer = new RaytracedRenderer (
-    config.pathtracer_ns_aa,
-    config.pathtracer_max_ray_depth,
-    config.pathtracer_ns_area_light,
-    config.pathtracer_ns_diff,
-    config.pathtracer_ns_glsy,
-    config.pathtracer_ns_refr,
-    config.pathtracer_num_threads,
-    config.pathtracer_samples_per_patch,
-    config.pathtracer_max_tolerance,
-    config.pathtracer_envmap,
-    config.pathtracer_direct_hemisphere_sample,
-    config.pathtracer_filename,
-    config.pathtracer_lensRadius,
-    config.pathtracer_focalDistance
-  );
+  RaytracedRendererOptions options;
+  options.ns_aa = config.pathtracer_ns_aa;
+  options.max_ray_depth = config.pathtracer_max_ray_depth;
+  options.ns_area_light = config.pathtracer_ns_area_light;
+  options.ns_diff = config.pathtracer_ns_diff;
+  options.ns_glsy = config.pathtracer_ns_glsy;
+  options.ns_refr = config.pathtracer_ns_refr;
+  options.num_threads = config.pathtracer_num_threads;
+  options.samples_per_batch = config.pathtracer_samples_per_patch;
+  options.max_tolerance = config.pathtracer_max_tolerance;
+  options.envmap = config.pathtracer_envmap;
+  options.direct_hemisphere_sample = config.pathtracer_direct_hemisphere_sample;
+  options.filename = config.pathtracer_filename;
+  options.lensRadius = config.pathtracer_lensRadius;
+  options.focalDistance = config.pathtracer_focalDistance;
+  options.bvh_width = config.pathtracer_bvh_width;
+  options.wavefront = config.pathtracer_wavefront;
+  options.bvh_cache = config.pathtracer_bvh_cache;
+  options.progressive_samples = config.pathtracer_progressive_samples;
+  options.time_budget = config.pathtracer_time_budget;
+  options.seed = config.pathtracer_seed;
+  options.sample_sequence = config.pathtracer_sample_sequence;
+  options.exact_lens = config.pathtracer_exact_lens;
+  options.lens_file = config.pathtracer_lens_file;
+  options.autofocus = config.pathtracer_autofocus;
+  options.sample_budget = config.pathtracer_sample_budget;
+  renderer = new RaytracedRenderer(options);
   filename = config.pathtracer_filename;
 }
 
@@ -456,7 +467,9 @@ void Application::keyboard_event(int key, int event, unsigned char mods) {
             renderer->key_press(key);
             break;
           case 'O':
+            renderer->stop();
             renderer->key_press(key);
+            renderer->start_raytracing();
             break;
           case 'Y':
             renderer->key_press(key);
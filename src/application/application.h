@@ -62,6 +62,18 @@ struct AppConfig {
     pathtracer_filename = "";
     pathtracer_lensRadius = 0.0;
     pathtracer_focalDistance = -3;
+
+    pathtracer_bvh_width = 4;
+    pathtracer_wavefront = false;
+    pathtracer_bvh_cache = "";
+    pathtracer_progressive_samples = 0;
+    pathtracer_time_budget = 0;
+    pathtracer_seed = 0;
+    pathtracer_sample_sequence = SEQUENCE_RANDOM;
+    pathtracer_exact_lens = false;
+    pathtracer_lens_file = "";
+    pathtracer_autofocus = false;
+    pathtracer_sample_budget = 0;
   }
 
   size_t pathtracer_ns_aa;
@@ -84,6 +96,18 @@ struct AppConfig {
 
   double pathtracer_lensRadius;
   double pathtracer_focalDistance;
+
+  size_t pathtracer_bvh_width;
+  bool pathtracer_wavefront;
+  string pathtracer_bvh_cache;
+  size_t pathtracer_progressive_samples;
+  double pathtracer_time_budget;
+  uint64_t pathtracer_seed;
+  SampleSequence pathtracer_sample_sequence;
+  bool pathtracer_exact_lens;
+  string pathtracer_lens_file;
+  bool pathtracer_autofocus;
+  size_t pathtracer_sample_budget;
 };
 
 class Application : public Renderer {
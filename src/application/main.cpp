@@ -33,6 +33,18 @@ void usage(const char* binaryName) {
   printf("  -d  <FLOAT>      The focal distance\n");
   printf("  -f  <FILENAME>   Image (.png) file to save output to in windowless mode\n");
   printf("  -r  <INT> <INT>  Width and height of output image (if windowless)\n");
+  printf("  -w  <INT>        BVH width used for rendering, 2 or 4 (default 4)\n");
+  printf("  -W               Use the wavefront (stream) integrator\n");
+  printf("  -K               Do not cache the BVH in <scenefile>.bvh\n");
+  printf("  -P  <INT>        Render progressively, adding INT samples per pixel per pass\n");
+  printf("  -T  <FLOAT>      Time budget of a progressive render in seconds\n");
+  printf("  -V  <INT>        With -P, spend INT samples per pixel on average, most where the noise is,\n");
+  printf("                   up to the -s samples of a pixel\n");
+  printf("  -S  <INT>        Random seed, the same seed gives the same image\n");
+  printf("  -q  <NAME>       Sample sequence: random, stratified, halton, sobol or bluenoise\n");
+  printf("  -E               Trace every camera ray through the lens elements instead of the baked lens table\n");
+  printf("  -L  <PATH>       Lens prescription file to use instead of the built-in zoom lens\n");
+  printf("  -A               Autofocus on the center of the image before rendering (with -f)\n");
   printf("  -h               Print this help message\n");
   printf("\n");
 }
@@ -80,10 +92,10 @@ int main( int argc, char** argv ) {
 
   // get the options
   AppConfig config; int opt;
-  bool write_to_file = false;
+  bool write_to_file = false, bvh_cache = true;
   size_t w = 0, h = 0, x = -1, y = 0, dx = 0, dy = 0;
   string filename, cam_settings = "";
-  while ( (opt = getopt(argc, argv, "s:l:t:m:e:h:H:f:r:c:b:d:a:p")) != -1 ) {  // for each option...
+  while ( (opt = getopt(argc, argv, "s:l:t:m:e:h:H:f:r:c:b:d:a:pw:WKP:T:V:S:q:EL:A")) != -1 ) {  // for each option...
     switch ( opt ) {
     case 'f':
       write_to_file = true;
@@ -137,6 +149,49 @@ int main( int argc, char** argv ) {
       config.pathtracer_max_tolerance = atof(argv[optind]);
       optind++;
       break;
+    case 'w':
+      config.pathtracer_bvh_width = atoi(optarg);
+      if (config.pathtracer_bvh_width != 2 && config.pathtracer_bvh_width != 4) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'W':
+      config.pathtracer_wavefront = true;
+      break;
+    case 'K':
+      bvh_cache = false;
+      break;
+    case 'P':
+      config.pathtracer_progressive_samples = atoi(optarg);
+      break;
+    case 'T':
+      config.pathtracer_time_budget = atof(optarg);
+      break;
+    case 'V':
+      config.pathtracer_sample_budget = atoi(optarg);
+      break;
+    case 'S':
+      config.pathtracer_seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'E':
+      config.pathtracer_exact_lens = true;
+      break;
+    case 'A':
+      config.pathtracer_autofocus = true;
+      break;
+    case 'L':
+      config.pathtracer_lens_file = string(optarg);
+      if (!LensPrescription::load(config.pathtracer_lens_file)) {
+        return 1;
+      }
+      break;
+    case 'q':
+      if (!parse_sample_sequence(optarg, &config.pathtracer_sample_sequence)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
     case 'H':
       config.pathtracer_direct_hemisphere_sample = true;
       optind--;
@@ -147,6 +202,12 @@ int main( int argc, char** argv ) {
     }
   }
 
+  // the sample budget is spent by progressive passes
+  if (config.pathtracer_sample_budget > 0 && config.pathtracer_progressive_samples == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
   // print usage if no argument given
   if (optind >= argc) {
     usage(argv[0]);
@@ -158,6 +219,7 @@ int main( int argc, char** argv ) {
   string sceneFile = sceneFilePath.substr(sceneFilePath.find_last_of('/')+1);
   sceneFile = sceneFile.substr(0,sceneFile.find(".dae"));
   config.pathtracer_filename = sceneFile;
+  if (bvh_cache) config.pathtracer_bvh_cache = sceneFilePath + ".bvh";
 
   // parse scene
   Collada::SceneInfo *sceneInfo = new Collada::SceneInfo();
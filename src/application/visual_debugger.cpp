@@ -173,6 +173,9 @@ namespace CGL
           DragDouble3("N2", &t.n2[0], 0.005);
           DragDouble3("N3", &t.n3[0], 0.005);
 
+          t.e1 = t.p2 - t.p1;
+          t.e2 = t.p3 - t.p1;
+
           static SceneObjects::Intersection isect;
 
           static bool success = false;
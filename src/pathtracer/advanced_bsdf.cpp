@@ -106,6 +106,16 @@ Vector3D MicrofacetBSDF::sample_f(const Vector3D wo, Vector3D* wi, double* pdf)
     return MicrofacetBSDF::f(wo, *wi);
 }
 
+double MicrofacetBSDF::pdf(const Vector3D wo, const Vector3D wi) {
+  // the half vector is drawn from D(h) cos(theta_h), reflecting wo about it
+  // changes the measure by 1 / (4 wi.h)
+  if (wi.z <= 0) return 0;
+  Vector3D h = (wo + wi).unit();
+  double wi_h = dot(wi, h);
+  if (wi_h <= 0) return 0;
+  return D(h) * h.z / 4.0 / wi_h;
+}
+
 void MicrofacetBSDF::render_debugger_node()
 {
   if (ImGui::TreeNode(this, "Micofacet BSDF"))
@@ -70,6 +70,11 @@ Vector3D DiffuseBSDF::sample_f(const Vector3D wo, Vector3D *wi, double *pdf) {
     return f(wo, *wi);
 }
 
+double DiffuseBSDF::pdf(const Vector3D wo, const Vector3D wi) {
+  // cosine weighted, as the sampler draws it
+  return wi.z > 0 ? wi.z / PI : 0;
+}
+
 void DiffuseBSDF::render_debugger_node()
 {
   if (ImGui::TreeNode(this, "Diffuse BSDF"))
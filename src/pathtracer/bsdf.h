@@ -83,6 +83,17 @@ class BSDF {
    */
   virtual Vector3D sample_f (const Vector3D wo, Vector3D* wi, double* pdf) = 0;
 
+  /**
+   * Evaluate the pdf of sampling.
+   * The density with which sample_f picks the incident direction wi given the
+   * outgoing direction wo, per unit solid angle. Delta distributions have no
+   * density to compare with and return 0.
+   * \param wo outgoing light direction in local space of point of intersection
+   * \param wi incident light direction in local space of point of intersection
+   * \return pdf of sampling wi from sample_f
+   */
+  virtual double pdf (const Vector3D wo, const Vector3D wi) { return 0; }
+
   /**
    * Get the emission value of the surface material. For non-emitting surfaces
    * this would be a zero energy Vector3D.
@@ -130,6 +141,7 @@ class DiffuseBSDF : public BSDF {
 
   Vector3D f(const Vector3D wo, const Vector3D wi);
   Vector3D sample_f(const Vector3D wo, Vector3D* wi, double* pdf);
+  double pdf(const Vector3D wo, const Vector3D wi);
   Vector3D get_emission() const { return Vector3D(); }
   bool is_delta() const { return false; }
 
@@ -180,6 +192,7 @@ public:
 
   Vector3D f(const Vector3D wo, const Vector3D wi);
   Vector3D sample_f(const Vector3D wo, Vector3D* wi, double* pdf);
+  double pdf(const Vector3D wo, const Vector3D wi);
   Vector3D get_emission() const { return Vector3D(); }
   bool is_delta() const { return false; }
 
@@ -1,11 +1,14 @@
 #ifndef CGL_CAMERA_H
 #define CGL_CAMERA_H
 
+#include <cstdint>
 #include <iostream>
+#include <string>
 #include <vector>
 
 #include "scene/collada/camera_info.h"
 #include "CGL/matrix3x3.h"
+#include "CGL/vector2D.h"
 
 #include "math.h"
 #include "ray.h"
@@ -27,6 +30,12 @@ struct Lens {
     double back_sphere_offset; ///offset in z dimension of the back surface's sphere's origin from pos
     double back_ior;  ///index of refraction of the back surface's sphere
     
+    // derived from the above by the constructor, for refract
+    double back_center;   ///z dimension of the back surface's sphere's origin
+    double front_center;  ///z dimension of the front surface's sphere's origin
+    double radius2;       ///squared radius of the element
+    double sag;           ///how far the element's surfaces reach along z from pos, within radius
+    
     Lens(){}
     
     /**
@@ -58,13 +67,146 @@ struct Lens {
     front_ior(front_ior),
     back_radius_of_curvature(back_radius_of_curvature),
     back_sphere_offset(back_sphere_offset),
-    back_ior(back_ior) {}
+    back_ior(back_ior) {
+        precompute();
+    }
     
     /**
      * Takes in a ray coming from the back, and an address to store the ray refracted to the front.
      * Return true iff the ray successfully passes through the lens without hitting the lens barrel or the aperture blades.
      */
     bool refract(Ray in_ray, Ray *out_ray) const;
+    
+    /**
+     * Update the derived members after the geometry changed.
+     */
+    void precompute();
+};
+
+/**
+ * Lens system described by a prescription: the elements from the one
+ * closest to the sensor to the front, each with its distance from the
+ * previous one. The spacings of the zoom groups differ between the wide
+ * and the tele end of the zoom range and are interpolated in between.
+ *
+ * A prescription file lists one entry per line, # starts a comment:
+ *   scale <FLOAT>            scene units per prescription unit
+ *   sensor_distance <FLOAT>  distance from the sensor to the first element
+ *   sensor_height <FLOAT>    height of the sensor
+ *   element <SPACING> <DIAMETER> <FRONT_R> <FRONT_OFFSET> <FRONT_IOR>
+ *           <BACK_R> <BACK_OFFSET> <BACK_IOR>
+ * The element columns are those of the Lens constructor, with the radius
+ * given as a diameter. A spacing is either a single value or wide:tele,
+ * an index of refraction may be written as 1/<FLOAT>. The scale, the
+ * sensor values, diameters and indices of refraction must be positive.
+ */
+struct LensPrescription {
+
+  struct Element {
+    double spacing[2];  ///< distance from the previous element at the wide and the tele end
+    Lens lens;          ///< the element in scene units, at pos 0
+  };
+
+  double scale = 1;
+  double sensor_distance = 0;   ///< in scene units
+  double sensor_height = 0;     ///< in scene units
+  std::vector<Element> elements;
+
+  /**
+   * Place the elements for a zoom setting.
+   * \param zoom_index between 0 and 1, where 0 is the wide and 1 the tele end
+   * \param lenses elements to update, in the order of the prescription
+   */
+  void build(double zoom_index, std::vector<Lens> *lenses) const;
+
+  /**
+   * Read a prescription file, or the built-in zoom lens for an empty path.
+   * Prescriptions are cached by path, so a lens is only read once.
+   * \return NULL, after printing the problem, if the file cannot be read
+   */
+  static const LensPrescription* load(const std::string& path);
+};
+
+/**
+ * Camera space rays leaving the zoom lens, baked on a regular 4D grid over
+ * the sensor (x, y in [0, 1]) and the aperture disk (u, v in [-1, 1]).
+ * A ray is interpolated quadrilinearly from the 16 nodes of its cell. Cells
+ * that lie on the edge of the lens's field, where some of their nodes are
+ * vignetted, are left to the exact tracer.
+ */
+struct LensRayTable {
+
+  enum CellState : uint8_t {
+    CELL_BLOCKED,  ///< no node of the cell gets through the lens
+    CELL_OPEN,     ///< every node of the cell gets through the lens
+    CELL_EDGE      ///< some nodes get through, trace exactly
+  };
+
+  static const size_t NODES_XY = 17;  ///< nodes along each sensor axis
+  static const size_t NODES_UV = 17;   ///< nodes along each aperture axis
+  static const size_t NODE_FLOATS = 5; ///< origin x, y and direction of a ray
+
+  bool empty() const { return cells.empty(); }
+
+  /**
+   * Look up the ray through sensor point (x, y) and aperture point (u, v).
+   * \param ray address to store the camera space ray in
+   * \return CELL_OPEN if the ray was interpolated into ray, CELL_BLOCKED if
+   *         it cannot get through the lens, CELL_EDGE if it has to be traced
+   */
+  CellState lookup(double x, double y, double u, double v, Ray *ray) const;
+
+  std::vector<float> nodes;     ///< NODE_FLOATS per node, v fastest, then u, y, x
+  std::vector<uint8_t> cells;   ///< CellState of every cell, in node order
+};
+
+/**
+ * Parts of the zoom lens's back element that transmit light to the scene,
+ * bounded per radial band of the sensor. The lens is symmetric about its
+ * axis, so the bounds are found for sensor points on the +x axis and
+ * rotated to the polar angle of the sensor point they are used for.
+ */
+struct ExitPupil {
+
+  static const size_t NUM_BANDS = 32;     ///< radial bands of the sensor
+  static const size_t BAND_SAMPLES = 4;   ///< sensor radii traced per band
+  static const size_t GRID = 32;          ///< aperture points traced along each axis
+
+  bool empty() const { return bounds.empty(); }
+
+  double max_radius;                  ///< distance of the sensor's corners from the axis
+  std::vector<Vector2D> bounds;       ///< min and max corner per band, in the unit disk
+  double settings[5];                 ///< lens settings the pupil and table were baked for
+};
+
+/**
+ * Focal distances of the zoom lens against the depths in front of the
+ * camera they focus at, for one lens, zoom and aperture. A focal distance
+ * focuses where the rays from the center of the sensor cross the axis
+ * after leaving the lens, averaged over rings of equal area of the
+ * aperture, so it is the best focus of the whole aperture rather than the
+ * paraxial one. Depths are kept in diopters, 1 / depth, which the focal
+ * distance is close to linear in.
+ */
+struct FocusCalibration {
+
+  static const size_t NUM_POINTS = 64;  ///< focal distances sampled over the focus range
+  static const size_t NUM_RINGS = 4;    ///< rings of the aperture traced per focal distance
+
+  bool empty() const { return focus.empty(); }
+
+  /**
+   * Focal distance that focuses at a depth, clamped to the focus range.
+   * \param depth distance in front of the camera along its view direction
+   */
+  double focus_for_depth(double depth) const;
+
+  double near_focus;              ///< focal distance of the closest focus
+  double far_focus;               ///< focal distance that focuses at infinity
+  std::vector<double> focus;      ///< sampled focal distances, from near_focus to far_focus
+  std::vector<double> diopters;   ///< 1 / depth each sampled focal distance focuses at
+  double settings[2];             ///< zoom and aperture the curve was made for
+  const LensPrescription* lens;   ///< lens the curve was made for
 };
 
 /**
@@ -145,27 +287,110 @@ class Camera {
 
   Ray generate_ray_for_thin_lens(double x, double y, double rndR, double rndTheta) const;
     
-    void initialize_zoom_lens() ;
+    /**
+     * Load the lens prescription, place its elements for zoom_index and
+     * bake the lens, see bake_zoom_lens.
+     */
+    void initialize_zoom_lens();
+
+    /**
+     * Load the lens prescription and place its elements for zoom_index,
+     * without baking.
+     */
+    void place_zoom_lens();
     
-    Ray generate_ray_for_zoom_lens(double x, double y, double rndR, double rndTheta) const;
+    /**
+     * Ray through the zoom lens from sensor point (x, y), sampled within the
+     * exit pupil bounds of the sensor point when they are baked.
+     * \param x x-coordinate of the ray sample in the view plane
+     * \param y y-coordinate of the ray sample in the view plane
+     * \param rndU uniform number selecting the point on the back element
+     * \param rndV uniform number selecting the point on the back element
+     * \return ray with zero direction if the sample is blocked by the lens
+     */
+    Ray generate_ray_for_zoom_lens(double x, double y, double rndU, double rndV) const;
+
+    /**
+     * Bake the zoom lens into exit_pupil and lens_table for the current
+     * zoom, aperture, focus and field of view, unless they already match.
+     * Must be called whenever those change before rendering, as it is not
+     * safe to call while other threads generate rays.
+     */
+    void bake_zoom_lens();
+
+    /**
+     * Forget what bake_zoom_lens baked, so that rays are sampled over the
+     * whole back element and traced exactly until the next bake. Cheaper
+     * than baking for settings that only a few rays are traced with.
+     */
+    void discard_zoom_lens_bake();
+
+    /**
+     * Trace a ray from the sensor through the zoom lens elements.
+     * \param x x-coordinate of the sensor point, in [0, 1]
+     * \param y y-coordinate of the sensor point, in [0, 1]
+     * \param u x-coordinate of the point on the back element, in the unit disk
+     * \param v y-coordinate of the point on the back element, in the unit disk
+     * \param ray address to store the ray leaving the lens in, in camera space
+     * \return false if the ray is blocked inside the lens
+     */
+    bool trace_zoom_lens(double x, double y, double u, double v, Ray *ray) const;
+
+    /**
+     * Point of the sensor, in camera space, that sensor coordinates (x, y) map to.
+     */
+    Vector3D zoom_lens_film_point(double x, double y) const;
+
+    /**
+     * Bound the transmitting part of the back element per sensor band into
+     * exit_pupil, see bake_zoom_lens.
+     */
+    void bake_exit_pupil();
+
+    /**
+     * Trace a ray from a camera space sensor point through the zoom lens,
+     * see trace_zoom_lens.
+     */
+    bool trace_zoom_lens_from(const Vector3D &pfilm, double u, double v, Ray *ray) const;
+
+    /**
+     * z dimension of the sensor, in camera space, at a focal distance.
+     */
+    double zoom_lens_film_z(double focal_distance) const;
+
+    /**
+     * Focus calibration of the zoom lens for the current zoom and aperture,
+     * made on first use after they change. The elements must have been
+     * placed, see place_zoom_lens.
+     */
+    const FocusCalibration& zoom_lens_focus_calibration();
 
   // Lens aperture and focal distance for depth of field effects.
   double lensRadius;
   double focalDistance;
   
+    // prescription file of the lens, empty for the built-in zoom lens
+    std::string lens_file;
+    
+    // prescription of the lens, loaded by initialize_zoom_lens
+    const LensPrescription* lens_prescription = NULL;
+    
     // Lens elements, where the first is closest to the sensor, and the last is closest to the object
-    Lens* lens_elem_one;
-    Lens* lens_elem_two;
-    Lens* lens_elem_three;
-    Lens* lens_elem_four;
-    Lens* lens_elem_five;
-    Lens* lens_elem_six;
-    Lens* lens_elem_seven;
-    Lens* lens_elem_eight;
+    std::vector<Lens> lens_elements;
     
     // between 0 and 1, where 0 is the wide end and 1 is the telephoto end
     double zoom_index = 0;
 
+    // rays of the zoom lens for the current settings, see bake_zoom_lens
+    LensRayTable lens_table;
+    ExitPupil exit_pupil;
+
+    // focus calibration for the current settings, see zoom_lens_focus_calibration
+    FocusCalibration focus_calibration;
+
+    // trace every camera ray through the lens elements instead of using lens_table
+    bool exact_lens = false;
+
  private:
   // Computes pos, screenXDir, screenYDir from target, r, phi, theta.
   void compute_position();
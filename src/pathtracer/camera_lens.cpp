@@ -8,6 +8,10 @@
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
 
 #include "CGL/misc.h"
 #include "CGL/vector2D.h"
@@ -53,225 +57,656 @@ Ray Camera::generate_ray_for_thin_lens(double x, double y, double rndR, double r
     return ray;
 }
 
-// Scale down the camera system to fit the scene, since original lens spec is in millimeters
-#define scale_camera_to_scene 0.03
+// The zoom lens the camera was designed around, in millimeters. It is
+// scaled down to fit the scenes.
+static const char *ZOOM_LENS_PRESCRIPTION =
+    "scale 0.03\n"
+    "sensor_distance 75.61\n"
+    "sensor_height 24\n"
+    "# spacing     diameter  front surface            back surface\n"
+    "element 0           45  200.00 -203.00 1/1.589  289.81 -289.81 1.589\n"
+    "element 7.54:41.63  29  111.55 -115.63 1/1.689  47.47  -47.47  1.689\n"
+    "element 15.26       32  199.02 -207.14 1/1.805  31.67  31.67   1/1.805\n"
+    "element 9.20        34  40.32  34.67   1.720    302.87 302.87  1/1.720\n"
+    "element 11.05       48  60.56  54.45   1.713    238.75 -238.75 1.713\n"
+    "element 76.14:9.11  68  53.35  44.42   1.805    114.94 114.94  1/1.805\n"
+    "element 14.27       68  78.96  75.90   1.773    53.77  53.77   1/1.773\n"
+    "element 7.58        80  231.88 228.58  1.834    52.68  52.68   1/1.834\n";
+
+/**
+ * Parse a number of a prescription, which may be written as 1/<FLOAT>.
+ */
+static bool parse_lens_value(const std::string& token, double *value) {
+    bool inverse = token.compare(0, 2, "1/") == 0;
+    const char *begin = token.c_str() + (inverse ? 2 : 0);
+    char *end;
+    *value = strtod(begin, &end);
+    if (end == begin || *end) return false;
+    if (inverse) *value = 1.0 / *value;
+    return std::isfinite(*value);
+}
+
+/**
+ * Parse a prescription, see LensPrescription.
+ * \param error set to the line of the problem if the prescription is invalid
+ */
+static bool parse_prescription(std::istream& in, LensPrescription *lens, std::string *error) {
+    
+    // read every number in prescription units, then scale to the scene
+    std::vector<std::vector<double> > elements;
+    double sensor_distance = 0, sensor_height = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line.substr(0, line.find('#')));
+        std::string key, token;
+        if (!(fields >> key)) continue;
+        std::vector<double> values;
+        bool valid = true;
+        while (valid && fields >> token) {
+            double value;
+            size_t colon = token.find(':');
+            if (key == "element" && values.empty() && colon != std::string::npos) {
+                valid = parse_lens_value(token.substr(0, colon), &value);
+                values.push_back(value);
+                valid = valid && parse_lens_value(token.substr(colon + 1), &value);
+            } else {
+                valid = parse_lens_value(token, &value);
+                if (key == "element" && values.empty()) values.push_back(value);
+            }
+            values.push_back(value);
+        }
+        // diameters, indices of refraction and sensor sizes are divided by
+        // or taken roots of later, so they have to be positive
+        if (valid && key == "element" && values.size() == 9 &&
+            values[2] > 0 && values[5] > 0 && values[8] > 0) {
+            elements.push_back(values);
+        } else if (valid && key == "scale" && values.size() == 1 && values[0] > 0) {
+            lens->scale = values[0];
+        } else if (valid && key == "sensor_distance" && values.size() == 1 && values[0] > 0) {
+            sensor_distance = values[0];
+        } else if (valid && key == "sensor_height" && values.size() == 1 && values[0] > 0) {
+            sensor_height = values[0];
+        } else {
+            *error = line;
+            return false;
+        }
+    }
+    if (elements.empty() || sensor_distance <= 0 || sensor_height <= 0) {
+        *error = "needs a sensor_distance, a sensor_height and an element";
+        return false;
+    }
+    
+    double x = lens->scale;
+    lens->sensor_distance = x * sensor_distance;
+    lens->sensor_height = x * sensor_height;
+    for (const std::vector<double>& e : elements) {
+        LensPrescription::Element element;
+        element.spacing[0] = e[0];
+        element.spacing[1] = e[1];
+        element.lens = Lens(0, x * e[2] / 2.0,
+                            x * e[3], x * e[4], e[5],
+                            x * e[6], x * e[7], e[8]);
+        lens->elements.push_back(element);
+    }
+    return true;
+}
+
+const LensPrescription* LensPrescription::load(const std::string& path) {
+    
+    static std::mutex lock;
+    static std::map<std::string, LensPrescription> cache;
+    std::lock_guard<std::mutex> guard(lock);
+    
+    auto cached = cache.find(path);
+    if (cached != cache.end()) return &cached->second;
+    
+    LensPrescription lens;
+    std::string error;
+    bool parsed;
+    if (path.empty()) {
+        std::istringstream in(ZOOM_LENS_PRESCRIPTION);
+        parsed = parse_prescription(in, &lens, &error);
+    } else {
+        ifstream in(path.c_str());
+        if (!in) {
+            fprintf(stderr, "[PathTracer] Cannot open lens prescription %s\n", path.c_str());
+            return NULL;
+        }
+        parsed = parse_prescription(in, &lens, &error);
+    }
+    if (!parsed) {
+        fprintf(stderr, "[PathTracer] Invalid lens prescription %s: %s\n", path.c_str(), error.c_str());
+        return NULL;
+    }
+    
+    return &(cache[path] = lens);
+}
+
+void LensPrescription::build(double zoom_index, std::vector<Lens> *lenses) const {
+    lenses->resize(elements.size());
+    double pos = 0;
+    for (size_t i = 0; i < elements.size(); i++) {
+        const Element& e = elements[i];
+        pos -= scale * (e.spacing[0] * (1.0 - zoom_index) + e.spacing[1] * zoom_index);
+        Lens& lens = (*lenses)[i] = e.lens;
+        lens.pos = pos;
+        lens.precompute();
+    }
+}
 
 void Camera::initialize_zoom_lens() {
+    place_zoom_lens();
+    bake_zoom_lens();
+}
+
+void Camera::place_zoom_lens() {
     
-    double x = scale_camera_to_scene;
-    
-    // Zoom parameters
-    double one_two_wide = 4.54;
-    double one_two_tele = 38.63;
-    
-    double five_six_wide = 70.03;
-    double five_six_tele = 3.00;
-    
-    // Set up the lens elements
-    // From the back-most element to the front-most element
-    lens_elem_one = new Lens(0.0,   //pos
-                             x * 45.0/2.0,   //radius
-                             x * 200.00,  //front_radius_of_curvature
-                             x * -203.00,  //front_sphere_offset
-                             1.0/1.589,  //front_ior
-                             x * 289.81,  //back_radius_of_curvature
-                             x * -289.81, //back_sphere_offset
-                             1.589); //back_ior
-    lens_elem_two = new Lens(lens_elem_one->pos - x * (3.0 + (one_two_wide * (1.0 - zoom_index) + one_two_wide * zoom_index)),  //pos
-                             x * 29.0/2.0,  //radius
-                             x * 111.55,  //front_radius_of_curvature
-                             x * -115.63,  //front_sphere_offset
-                             1.0/1.689,  //front_ior
-                             x * 47.47,  //back_radius_of_curvature
-                             x * -47.47,  //back_sphere_offset
-                             1.689); //back_ior
-    lens_elem_three = new Lens(lens_elem_two->pos - x * 15.26,  //pos
-                               x * 32.0/2.0,  //radius
-                               x * 199.02,  //front_radius_of_curvature
-                               x * -207.14,  //front_sphere_offset
-                               1.0/1.805,  //front_ior
-                               x * 31.67,  //back_radius_of_curvature
-                               x * 31.67,  //back_sphere_offset
-                               1.0/1.805); //back_ior
-    lens_elem_four = new Lens(lens_elem_three->pos - x * 9.20,    //pos
-                              x * 34.0/2.0,    //radius
-                              x * 40.32,   //front_radius_of_curvature
-                              x * 34.67,   //front_sphere_offset
-                              1.720,   //front_ior
-                              x * 302.87,   //back_radius_of_curvature
-                              x * 302.87,  //back_sphere_offset
-                              1.0/1.720);  //back_ior
-    lens_elem_five = new Lens(lens_elem_four->pos - x * 11.05,  //pos
-                              x * 48.0/2.0,    //radius
-                              x * 60.56,   //front_radius_of_curvature
-                              x * 54.45,   //front_sphere_offset
-                              1.713,   //front_ior
-                              x * 238.75,   //back_radius_of_curvature
-                              x * -238.75,   //back_sphere_offset
-                              1.713);  //back_ior
-    lens_elem_six = new Lens(lens_elem_five->pos - x * (6.11 + (five_six_wide * (1.0 - zoom_index) + five_six_tele * zoom_index)), //pos
-                             x * 68.0/2.0,    //radius
-                             x * 53.35,    //front_radius_of_curvature
-                             x * 44.42, //front_sphere_offset
-                             1.805,   //front_ior
-                             x * 114.94,   //back_radius_of_curvature
-                             x * 114.94,      //back_sphere_offset
-                             1.0/1.805);  //back_ior
-    lens_elem_seven = new Lens(lens_elem_six->pos - x * 14.27,    //pos
-                               x * 68.0/2.0,    //radius
-                               x * 78.96,    //front_radius_of_curvature
-                               x * 75.90, //front_sphere_offset
-                               1.773,   //front_ior
-                               x * 53.77,   //back_radius_of_curvature
-                               x * 53.77,      //back_sphere_offset
-                               1.0/1.773);  //back_ior
-    lens_elem_eight = new Lens(lens_elem_seven->pos - x * 7.58,    //pos
-                               x * 80.0/2.0,    //radius
-                               x * 231.88,    //front_radius_of_curvature
-                               x * 228.58, //front_sphere_offset
-                               1.834,   //front_ior
-                               x * 52.68,   //back_radius_of_curvature
-                               x * 52.68,      //back_sphere_offset
-                               1.0/1.834);  //back_ior
+    const LensPrescription *prescription = LensPrescription::load(lens_file);
+    if (!prescription) {
+        prescription = LensPrescription::load("");
+    }
+    if (prescription != lens_prescription) {
+        // a different lens, nothing baked for the last one applies
+        lens_prescription = prescription;
+        exit_pupil = ExitPupil();
+    }
+    lens_prescription->build(zoom_index, &lens_elements);
+}
+
+/**
+ * Integral of y clamped into the unit disk's column at t, clamp(y, -s, s)
+ * with s = sqrt(1 - t^2), over t from -1 to u.
+ */
+static double disk_column_integral(double u, double y) {
+    auto S = [](double t) {  // area under the upper half circle from -1 to t
+        t = clamp(t, -1.0, 1.0);
+        return 0.5 * (t * sqrt(1 - t * t) + asin(t)) + PI / 4;
+    };
+    double w = sqrt(max(0.0, 1 - y * y)), sign = y > 0 ? 1 : y < 0 ? -1 : 0;
+    return sign * S(min(u, -w)) + y * (clamp(u, -w, w) + w) +
+           sign * (S(max(u, w)) - S(w));
+}
+
+/**
+ * Area of the part of the box [lo, hi] inside the unit disk left of u.
+ */
+static double disk_box_area(double u, const Vector2D &lo, const Vector2D &hi) {
+    u = clamp(u, lo.x, hi.x);
+    return disk_column_integral(u, hi.y) - disk_column_integral(u, lo.y) -
+           disk_column_integral(lo.x, hi.y) + disk_column_integral(lo.x, lo.y);
+}
+
+/**
+ * Point uniformly distributed over the part of the box [lo, hi] inside the
+ * unit disk: u by inverting the area left of it, v uniform within the column.
+ * \return false if the box misses the disk
+ */
+static bool sample_disk_box(const Vector2D &lo, const Vector2D &hi,
+                            double rndU, double rndV, double *u, double *v) {
+    double a = max(lo.x, -1.0), b = min(hi.x, 1.0);
+    double total = disk_box_area(b, lo, hi);
+    if (!(total > 0)) return false;
+    
+    // Newton steps on the area, kept inside a bisection bracket
+    double target = rndU * total, t = a + rndU * (b - a);
+    for (int i = 0; i < 50; i++) {
+        double f = disk_box_area(t, lo, hi) - target;
+        if (fabs(f) <= 1e-12 * total) break;
+        if (f > 0) b = t; else a = t;
+        double s = sqrt(max(0.0, 1 - t * t));
+        double height = min(hi.y, s) - max(lo.y, -s);
+        double next = height > 0 ? t - f / height : a - 1;
+        t = next > a && next < b ? next : 0.5 * (a + b);
+    }
+    
+    double s = sqrt(max(0.0, 1 - t * t));
+    double bottom = max(lo.y, -s), top = min(hi.y, s);
+    *u = t;
+    *v = bottom + max(0.0, top - bottom) * rndV;
+    return true;
 }
 
-Ray Camera::generate_ray_for_zoom_lens(double x, double y, double rndR, double rndTheta) const {
+Ray Camera::generate_ray_for_zoom_lens(double x, double y, double rndU, double rndV) const {
+    
+    // point on the back-most lens element, in the unit disk: uniform over
+    // the exit pupil bounds of the sensor point's band clipped to the disk,
+    // rotated to its angle. Every point of the part that transmits stays
+    // equally likely, so the samples need no weight
+    const Vector2D *lo = NULL, *hi = NULL;
+    double c = 1, s = 0;
+    if (!exit_pupil.empty()) {
+        Vector3D pfilm = zoom_lens_film_point(x, y);
+        double rho = sqrt(pfilm.x * pfilm.x + pfilm.y * pfilm.y);
+        size_t band = min((size_t) (rho / exit_pupil.max_radius * ExitPupil::NUM_BANDS),
+                          ExitPupil::NUM_BANDS - 1);
+        lo = &exit_pupil.bounds[2 * band];
+        hi = &exit_pupil.bounds[2 * band + 1];
+        if (rho > 0) {
+            c = pfilm.x / rho;
+            s = pfilm.y / rho;
+        }
+    }
     
-    // distance from sensor to the closest lens element
-    double dist = scale_camera_to_scene * 75.61;
+    double u, v;
+    if (!lo || (lo->x <= -1 && lo->y <= -1 && hi->x >= 1 && hi->y >= 1)) {
+        // the whole disk may transmit, map the square onto it (concentric map)
+        double a = 2 * rndU - 1, b = 2 * rndV - 1;
+        if (a == 0 && b == 0) {
+            u = v = 0;
+        } else if (fabs(a) > fabs(b)) {
+            u = a * cos(PI / 4 * b / a);
+            v = a * sin(PI / 4 * b / a);
+        } else {
+            u = b * sin(PI / 4 * a / b);
+            v = b * cos(PI / 4 * a / b);
+        }
+    } else {
+        double bu, bv;
+        if (!sample_disk_box(*lo, *hi, rndU, rndV, &bu, &bv)) {
+            return Ray();
+        }
+        u = c * bu - s * bv;
+        v = s * bu + c * bv;
+    }
     
-    // radius of the back-most lens element
-    double r = lens_elem_one->radius * max(lensRadius, 0.000000000001);
+    Ray ray;
+    LensRayTable::CellState cell = LensRayTable::CELL_EDGE;
+    if (!exact_lens && !lens_table.empty()) {
+        cell = lens_table.lookup(x, y, u, v, &ray);
+    }
+    if (cell == LensRayTable::CELL_BLOCKED) {
+        return Ray();
+    }
+    if (cell == LensRayTable::CELL_EDGE && !trace_zoom_lens(x, y, u, v, &ray)) {
+        return Ray();
+    }
+    
+    ray = Ray((c2w * ray.o) + pos, c2w * ray.d);
+    ray.min_t = nClip;
+    ray.max_t = fClip;
+    
+    return ray;
+}
+
+bool Camera::trace_zoom_lens(double x, double y, double u, double v, Ray *out_ray) const {
+    return trace_zoom_lens_from(zoom_lens_film_point(x, y), u, v, out_ray);
+}
+
+Vector3D Camera::zoom_lens_film_point(double x, double y) const {
     
     // find point on the image plane, pFilm
-    double bl_corner_x = -tan(0.5 * hFov * ( M_PI / 180.0 ));
-    double bl_corner_y = -tan(0.5 * vFov * ( M_PI / 180.0 ));
     double tr_corner_x = tan(0.5 * hFov * ( M_PI / 180.0 ));
     double tr_corner_y = tan(0.5 * vFov * ( M_PI / 180.0 ));
     
-    double camera_x = bl_corner_x + (tr_corner_x - bl_corner_x) * x;
-    double camera_y = bl_corner_y + (tr_corner_y - bl_corner_y) * y;
+    double camera_x = tr_corner_x * (2 * x - 1);
+    double camera_y = tr_corner_y * (2 * y - 1);
     
-    // scale the image plane to the size of a full frame sensor (24mm tall), so that size relative to the lens is correct
-    double sensor_scale_factor = 24.0 / (tr_corner_y - bl_corner_y);
+    // scale the image plane to the size of the lens's sensor, so that size relative to the lens is correct
+    double sensor_scale_factor = 0.5 * lens_prescription->sensor_height / tr_corner_y;
     
-    Vector3D pfilm = Vector3D(-camera_x * sensor_scale_factor * scale_camera_to_scene,
-                              -camera_y * sensor_scale_factor * scale_camera_to_scene,
-                              dist - 10 * scale_camera_to_scene * focalDistance);
+    Vector3D pfilm = Vector3D(-camera_x * sensor_scale_factor,
+                              -camera_y * sensor_scale_factor,
+                              zoom_lens_film_z(focalDistance));
+    return pfilm;
+}
+
+double Camera::zoom_lens_film_z(double focal_distance) const {
+    // the focal distance moves the sensor from its distance to the closest lens element
+    return lens_prescription->sensor_distance - 10 * lens_prescription->scale * focal_distance;
+}
+
+/**
+ * Diopters that the zoom lens focuses at, 1 / the depth where rays from
+ * the center of the sensor cross the axis, see FocusCalibration.
+ * \return NaN if no ring of the aperture gets through the lens
+ */
+static double zoom_lens_diopters(const Camera& camera, double focal_distance) {
+    Vector3D pfilm = Vector3D(0, 0, camera.zoom_lens_film_z(focal_distance));
+    double sum = 0;
+    size_t n = 0;
+    for (size_t k = 0; k < FocusCalibration::NUM_RINGS; k++) {
+        Ray ray;
+        double u = sqrt((k + 0.5) / FocusCalibration::NUM_RINGS);
+        if (!camera.trace_zoom_lens_from(pfilm, u, 0, &ray) || ray.o.x == 0 || ray.d.z == 0) continue;
+        // the ray leaves at z = 0 and crosses the axis at depth o.x / d.x * d.z
+        sum += ray.d.x / (ray.o.x * ray.d.z);
+        n++;
+    }
+    return n ? sum / n : NAN;
+}
+
+bool Camera::trace_zoom_lens_from(const Vector3D &pfilm, double u, double v, Ray *out_ray) const {
+    
+    // radius of the back-most lens element
+    double r = lens_elements[0].radius * max(lensRadius, 0.000000000001);
     
     // find sample point on the closest lens element, pLens
-    Vector3D plens = Vector3D(r * sqrt(rndR) * cos(rndTheta), r * sqrt(rndR) * sin(rndTheta), 0);
+    Vector3D plens = Vector3D(r * u, r * v, 0);
     
     Ray ray = Ray(pfilm, (plens - pfilm).unit());
     ray.max_t = INF_D;
     ray.min_t = EPS_F;
     
-    if (!lens_elem_one->refract(ray, &ray)) {
-        return Ray();
+    for (const Lens& lens : lens_elements) {
+        if (!lens.refract(ray, &ray)) {
+            return false;
+        }
     }
-    if (!lens_elem_two->refract(ray, &ray)) {
-        return Ray();
+
+    // Offset the ray to reduce the impact of lens length
+    ray.o.z = 0;
+    
+    *out_ray = ray;
+    return true;
+}
+
+void Camera::bake_zoom_lens() {
+    
+    double settings[5] = {zoom_index, lensRadius, focalDistance, hFov, vFov};
+    if (!exit_pupil.empty() &&
+        std::equal(settings, settings + 5, exit_pupil.settings)) {
+        return;
     }
-    if (!lens_elem_three->refract(ray, &ray)) {
-        return Ray();
+    
+    bake_exit_pupil();
+    std::copy(settings, settings + 5, exit_pupil.settings);
+    
+    if (exact_lens) {
+        lens_table = LensRayTable();
+        return;
     }
-    if (!lens_elem_four->refract(ray, &ray)) {
-        return Ray();
+    
+    const size_t nxy = LensRayTable::NODES_XY, nuv = LensRayTable::NODES_UV;
+    const size_t num_nodes = nxy * nxy * nuv * nuv;
+    std::vector<float> nodes(num_nodes * LensRayTable::NODE_FLOATS);
+    std::vector<uint8_t> through(num_nodes);
+    
+    // trace the nodes, the aperture grid covers the square around the unit
+    // disk so that every sample of the disk falls into a cell
+    size_t n = 0;
+    for (size_t ix = 0; ix < nxy; ix++) {
+        for (size_t iy = 0; iy < nxy; iy++) {
+            for (size_t iu = 0; iu < nuv; iu++) {
+                for (size_t iv = 0; iv < nuv; iv++, n++) {
+                    Ray ray;
+                    through[n] = trace_zoom_lens((double) ix / (nxy - 1), (double) iy / (nxy - 1),
+                                                 2.0 * iu / (nuv - 1) - 1, 2.0 * iv / (nuv - 1) - 1,
+                                                 &ray);
+                    if (!through[n]) continue;
+                    float *node = &nodes[n * LensRayTable::NODE_FLOATS];
+                    node[0] = ray.o.x;
+                    node[1] = ray.o.y;
+                    node[2] = ray.d.x;
+                    node[3] = ray.d.y;
+                    node[4] = ray.d.z;
+                }
+            }
+        }
     }
-    if (!lens_elem_five->refract(ray, &ray)) {
-        return Ray();
+    
+    // classify the cells by their 16 corner nodes; cells are indexed like
+    // their lowest node, the ones past the last node on an axis stay unused
+    std::vector<uint8_t> cells(num_nodes, LensRayTable::CELL_BLOCKED);
+    for (size_t ix = 0; ix + 1 < nxy; ix++) {
+        for (size_t iy = 0; iy + 1 < nxy; iy++) {
+            for (size_t iu = 0; iu + 1 < nuv; iu++) {
+                for (size_t iv = 0; iv + 1 < nuv; iv++) {
+                    size_t cell = ((ix * nxy + iy) * nuv + iu) * nuv + iv;
+                    int open = 0;
+                    for (int corner = 0; corner < 16; corner++) {
+                        open += through[cell + (corner >> 3 & 1) * nxy * nuv * nuv +
+                                        (corner >> 2 & 1) * nuv * nuv +
+                                        (corner >> 1 & 1) * nuv + (corner & 1)];
+                    }
+                    cells[cell] = open == 16 ? LensRayTable::CELL_OPEN :
+                                  open == 0 ? LensRayTable::CELL_BLOCKED : LensRayTable::CELL_EDGE;
+                }
+            }
+        }
     }
-    if (!lens_elem_six->refract(ray, &ray)) {
-        return Ray();
+    
+    lens_table.nodes.swap(nodes);
+    lens_table.cells.swap(cells);
+}
+
+const FocusCalibration& Camera::zoom_lens_focus_calibration() {
+    
+    FocusCalibration &cal = focus_calibration;
+    double settings[2] = {zoom_index, lensRadius};
+    if (!cal.empty() && cal.lens == lens_prescription &&
+        std::equal(settings, settings + 2, cal.settings)) {
+        return cal;
     }
-    if (!lens_elem_seven->refract(ray, &ray)) {
-        return Ray();
+    
+    // the sensor may move from just behind the back element back to where
+    // it is four times as far from the element as at infinity focus; the
+    // further back, the closer the focus
+    const Lens &back = lens_elements[0];
+    double scale = 10 * lens_prescription->scale;
+    double rear = back.pos + back.sag;
+    double behind = (lens_prescription->sensor_distance - rear) / scale;
+    
+    // infinity focus, where the diopters cross zero, by bisection
+    double lo = behind, hi = behind, step = rear > 0 ? rear / scale : 1;
+    while (!(zoom_lens_diopters(*this, lo) > 0) && step < 1e6) {
+        lo = behind - step;
+        step *= 2;
     }
-    if (!lens_elem_eight->refract(ray, &ray)) {
-        return Ray();
+    for (int i = 0; i < 60; i++) {
+        double mid = 0.5 * (lo + hi);
+        if (zoom_lens_diopters(*this, mid) > 0) lo = mid; else hi = mid;
+    }
+    cal.far_focus = lo;
+    cal.near_focus = cal.far_focus - 3 * (zoom_lens_film_z(cal.far_focus) - rear) / scale;
+    
+    cal.focus.clear();
+    cal.diopters.clear();
+    for (size_t i = 0; i < FocusCalibration::NUM_POINTS; i++) {
+        double focus = cal.near_focus + (cal.far_focus - cal.near_focus) * i / (FocusCalibration::NUM_POINTS - 1);
+        double diopters = i + 1 < FocusCalibration::NUM_POINTS ? zoom_lens_diopters(*this, focus) : 0;
+        if (std::isnan(diopters)) continue;
+        cal.focus.push_back(focus);
+        cal.diopters.push_back(diopters);
     }
+    std::copy(settings, settings + 2, cal.settings);
+    cal.lens = lens_prescription;
+    return cal;
+}
 
-    // Configure the final generated ray
-    // Offset the ray to reduce the impact of lens length
-    ray.o.z = 0;
-    
-    ray = Ray((c2w * ray.o) + pos, c2w * ray.d);
-    ray.min_t = nClip;
-    ray.max_t = fClip;
-    
-    return ray;
+double FocusCalibration::focus_for_depth(double depth) const {
+    
+    // diopters fall as the focal distance grows
+    double d = depth > 0 ? 1 / depth : 0;
+    if (d >= diopters.front()) return focus.front();
+    if (d <= diopters.back()) return focus.back();
+    size_t i = 1;
+    while (diopters[i] > d) i++;
+    double t = (diopters[i - 1] - d) / (diopters[i - 1] - diopters[i]);
+    return focus[i - 1] + t * (focus[i] - focus[i - 1]);
 }
 
-bool Lens::refract(Ray in_ray, Ray *out_ray) const {
-    
-    Ray temp_ray;
+void Camera::discard_zoom_lens_bake() {
+    exit_pupil = ExitPupil();
+    lens_table = LensRayTable();
+}
+
+void Camera::bake_exit_pupil() {
+    
+    const size_t num_bands = ExitPupil::NUM_BANDS, grid = ExitPupil::GRID;
+    Vector3D corner = zoom_lens_film_point(0, 0);
+    exit_pupil.max_radius = sqrt(corner.x * corner.x + corner.y * corner.y);
+    exit_pupil.bounds.assign(2 * num_bands, Vector2D());
+    
+    for (size_t band = 0; band < num_bands; band++) {
+        // trace a grid over the unit disk from a few sensor points across
+        // the band, all on the +x axis
+        Vector2D lo(INF_D, INF_D), hi(-INF_D, -INF_D);
+        for (size_t i = 0; i < ExitPupil::BAND_SAMPLES; i++) {
+            double rho = exit_pupil.max_radius / num_bands *
+                         (band + (double) i / (ExitPupil::BAND_SAMPLES - 1));
+            Vector3D pfilm = Vector3D(rho, 0, corner.z);
+            for (size_t iu = 0; iu < grid; iu++) {
+                for (size_t iv = 0; iv < grid; iv++) {
+                    double u = 2.0 * (iu + 0.5) / grid - 1, v = 2.0 * (iv + 0.5) / grid - 1;
+                    Ray ray;
+                    if (u * u + v * v > 1 || !trace_zoom_lens_from(pfilm, u, v, &ray)) continue;
+                    lo = Vector2D(min(lo.x, u), min(lo.y, v));
+                    hi = Vector2D(max(hi.x, u), max(hi.y, v));
+                }
+            }
+        }
+        
+        if (lo.x > hi.x) {
+            // nothing found, fall back to the whole disk
+            lo = Vector2D(-1, -1);
+            hi = Vector2D(1, 1);
+        } else {
+            // grow by a grid cell to cover the parts between the traced points
+            double cell = 2.0 / grid;
+            lo = Vector2D(max(lo.x - cell, -1.0), max(lo.y - cell, -1.0));
+            hi = Vector2D(min(hi.x + cell, 1.0), min(hi.y + cell, 1.0));
+        }
+        exit_pupil.bounds[2 * band] = lo;
+        exit_pupil.bounds[2 * band + 1] = hi;
+    }
+}
+
+LensRayTable::CellState LensRayTable::lookup(double x, double y, double u, double v,
+                                             Ray *ray) const {
+    
+    const size_t nxy = NODES_XY, nuv = NODES_UV;
+    
+    // cell of the point and the position of the point within it
+    double g[4] = {x * (nxy - 1), y * (nxy - 1), (u + 1) * 0.5 * (nuv - 1), (v + 1) * 0.5 * (nuv - 1)};
+    size_t last[4] = {nxy - 2, nxy - 2, nuv - 2, nuv - 2};
+    size_t c[4];
+    double f[4];
+    for (int a = 0; a < 4; a++) {
+        double cell = std::floor(g[a]);
+        c[a] = (size_t) std::min(std::max(cell, 0.0), (double) last[a]);
+        f[a] = std::min(std::max(g[a] - c[a], 0.0), 1.0);
+    }
     
-    //********************************************
-    //* Step 1: refract through the back surface *
-    //********************************************
+    size_t base = ((c[0] * nxy + c[1]) * nuv + c[2]) * nuv + c[3];
+    CellState state = (CellState) cells[base];
+    if (state != CELL_OPEN) return state;
+    
+    size_t stride[4] = {nxy * nuv * nuv, nuv * nuv, nuv, 1};
+    double r[NODE_FLOATS] = {0, 0, 0, 0, 0};
+    for (int corner = 0; corner < 16; corner++) {
+        double w = 1;
+        size_t node = base;
+        for (int a = 0; a < 4; a++) {
+            bool high = corner >> (3 - a) & 1;
+            w *= high ? f[a] : 1 - f[a];
+            node += high * stride[a];
+        }
+        const float *values = &nodes[node * NODE_FLOATS];
+        for (size_t i = 0; i < NODE_FLOATS; i++) r[i] += w * values[i];
+    }
     
-    // Step 1.a: construct sphere of back surface and intersect ray with it
-    SphereObject back_surface_obj = SphereObject(Vector3D(0.0, 0.0, pos + back_sphere_offset),
-                                                 back_radius_of_curvature,
-                                                 new RefractionBSDF(Vector3D(), 0, back_ior));
-    Sphere back_surface = Sphere(&back_surface_obj, back_surface_obj.o, back_surface_obj.r);
-    Intersection back_isect;
-    if (!back_surface.intersect(in_ray, &back_isect)) {
+    *ray = Ray(Vector3D(r[0], r[1], 0), Vector3D(r[2], r[3], r[4]).unit());
+    return CELL_OPEN;
+}
+
+void Lens::precompute() {
+    back_center = pos + back_sphere_offset;
+    front_center = pos + front_sphere_offset;
+    radius2 = radius * radius;
+    
+    // the surfaces are the caps of their spheres that face pos; within the
+    // element's radius a cap lies between its vertex and its rim
+    sag = 0;
+    double centers[2] = {back_center, front_center};
+    double radii[2] = {back_radius_of_curvature, front_radius_of_curvature};
+    for (int i = 0; i < 2; i++) {
+        double side = pos >= centers[i] ? 1 : -1;
+        double rim = radii[i] * radii[i] - radius2;
+        sag = max(sag, fabs(centers[i] + side * radii[i] - pos));
+        if (rim > 0) sag = max(sag, fabs(centers[i] + side * sqrt(rim) - pos));
+    }
+}
+
+/**
+ * Move a ray onto a surface of a lens element and refract it there, like
+ * a RefractionBSDF at a Sphere would (see BSDF::refract), but in camera
+ * space and without building either.
+ * \param center z dimension of the surface's sphere's origin
+ * \param radius radius of curvature of the surface
+ * \param ior index of refraction of the surface
+ * \param radius2 squared radius of the element
+ * \param o origin of the ray, moved to the hit point
+ * \param d unit direction of the ray, replaced by the refracted one
+ * \return false if the ray misses the element or is totally reflected
+ */
+static inline bool refract_surface(double center, double radius, double ior, double radius2,
+                                   Vector3D &o, Vector3D &d) {
+    
+    // nearest intersection past EPS_F with the sphere, as in Sphere::intersect
+    Vector3D oc = Vector3D(o.x, o.y, o.z - center);
+    double b = dot(oc, d);
+    double delta = b * b - (dot(oc, oc) - radius * radius);
+    if (delta < 0) {
         return false;
     }
+    double root = sqrt(delta);
+    double t = -b - root;
+    if (t < EPS_F) {
+        t = -b + root;
+        if (t < EPS_F) {
+            return false;
+        }
+    }
+    Vector3D p = o + t * d;
     
     // check if the ray misses the lens element
-    if (Vector3D(in_ray.at_time(back_isect.t).x, in_ray.at_time(back_isect.t).y, 0).norm() >= radius) {
+    if (p.x * p.x + p.y * p.y >= radius2) {
         return false;
     }
     
-    // Step 1.b: obtain transition matrices for local refraction calculation
-    Matrix3x3 o2w;
-    make_coord_space(o2w, back_isect.n);
-    Matrix3x3 w2o = o2w.T();
-    
-    // Step 1.c: calculate refracted ray in local space
-    Vector3D w_in;
-    if (!back_isect.bsdf->refract(w2o * (-in_ray.d), &w_in, back_ior)) {
+    // Snell's law in the plane of the ray and the normal: keep the tangential
+    // part of the direction scaled by eta, recompute the normal part
+    Vector3D n = Vector3D(p.x, p.y, p.z - center) / fabs(radius);
+    double cos_o = -dot(d, n);
+    double eta = cos_o > 0 ? 1.0 / ior : ior;
+    double cos2_i = 1.0 - eta * eta * (1.0 - cos_o * cos_o);
+    if (cos2_i < 0) {
         return false;
     }
+    double cos_i = cos_o > 0 ? -sqrt(cos2_i) : sqrt(cos2_i);
     
-    // Step 1.d: transform the refracted ray back to world space (camera space)
-    temp_ray = Ray(in_ray.at_time(back_isect.t), (o2w * w_in).unit());
-    temp_ray.max_t = INF_D;
-    temp_ray.min_t = EPS_F;
-    
-    
-    //*********************************************
-    //* Step 2: refract through the front surface *
-    //*********************************************
+    o = p;
+    d = (eta * (d + cos_o * n) + cos_i * n).unit();
+    return true;
+}
+
+bool Lens::refract(Ray in_ray, Ray *out_ray) const {
     
-    // Step 2.a: construct sphere of front surface and intersect ray with it
-    SphereObject front_surface_obj = SphereObject(Vector3D(0.0, 0.0, pos + front_sphere_offset),
-                                                 front_radius_of_curvature,
-                                                 new RefractionBSDF(Vector3D(), 0, front_ior));
-    Sphere front_surface = Sphere(&front_surface_obj, front_surface_obj.o, front_surface_obj.r);
-    Intersection front_isect;
-    if (!front_surface.intersect(temp_ray, &front_isect)) {
-        return false;
+    Vector3D o = in_ray.o;
+    Vector3D d = in_ray.d;
+    
+    // conservative aperture test before any refraction: within the element
+    // the ray reaches a surface at most sag away from pos along z, so where
+    // it crosses z = pos it is at most sag * tan(angle to the axis) away
+    // from where it hits the surface, which must be inside the radius
+    if (d.z != 0) {
+        double s = (pos - o.z) / d.z;
+        double x = o.x + s * d.x, y = o.y + s * d.y;
+        double slack = sag * sqrt(d.x * d.x + d.y * d.y) / fabs(d.z);
+        double reach = radius + slack;
+        if (x * x + y * y >= reach * reach) {
+            return false;
+        }
     }
     
-    // check if the ray misses the lens element
-    if (Vector3D(temp_ray.at_time(front_isect.t).x, temp_ray.at_time(front_isect.t).y, 0).norm() >= radius) {
+    if (!refract_surface(back_center, back_radius_of_curvature, back_ior, radius2, o, d)) {
         return false;
     }
-    
-    // Step 2.b: obtain transition matrices for local refraction calculation
-    make_coord_space(o2w, front_isect.n);
-    w2o = o2w.T();
-    
-    // Step 2.c: calculate refracted ray in local space
-    if (!front_isect.bsdf->refract(w2o * (-temp_ray.d), &w_in, front_ior)) {
+    if (!refract_surface(front_center, front_radius_of_curvature, front_ior, radius2, o, d)) {
         return false;
     }
     
-    // Step 2.d: transform the refracted ray back to world space (camera space)
-    *out_ray = Ray(temp_ray.at_time(front_isect.t), (o2w * w_in).unit());
+    *out_ray = Ray(o, d);
     out_ray->max_t = INF_D;
     out_ray->min_t = EPS_F;
     
@@ -0,0 +1,297 @@
+#include "light_sampler.h"
+
+#include "pathtracer/sampler.h"
+
+#include <algorithm>
+
+namespace CGL {
+
+// scenes with up to this many bounded lights choose them by power alone,
+// the BVH only pays off once there are enough lights to tell apart
+static const size_t LIGHT_BVH_MIN_LIGHTS = 8;
+
+// AliasTable //
+
+AliasTable::AliasTable(const std::vector<double>& weights) {
+  size_t n = weights.size();
+  bins.resize(n);
+  double sum = 0;
+  for (double w : weights) sum += w;
+  for (size_t i = 0; i < n; i++) {
+    bins[i].p = sum > 0 ? weights[i] / sum : 1.0 / n;
+  }
+
+  // every bin gets the average probability, bins short of it are topped up
+  // from one that has more
+  std::vector<std::pair<size_t, double> > under, over;
+  for (size_t i = 0; i < n; i++) {
+    double q = bins[i].p * n;
+    if (q < 1) {
+      under.push_back(std::make_pair(i, q));
+    } else {
+      over.push_back(std::make_pair(i, q));
+    }
+  }
+  while (!under.empty() && !over.empty()) {
+    std::pair<size_t, double> u = under.back(), o = over.back();
+    under.pop_back();
+    over.pop_back();
+    bins[u.first].q = u.second;
+    bins[u.first].alias = o.first;
+    o.second -= 1 - u.second;
+    if (o.second < 1) {
+      under.push_back(o);
+    } else {
+      over.push_back(o);
+    }
+  }
+  // what is left is 1 up to rounding
+  for (auto& u : under) bins[u.first].q = 1;
+  for (auto& o : over) bins[o.first].q = 1;
+}
+
+size_t AliasTable::sample(double u, double* pmf, double* u_remapped) const {
+  size_t n = bins.size();
+  size_t i = std::min((size_t) (u * n), n - 1);
+  double up = std::min(u * n - i, 1 - 1e-12);
+  if (up < bins[i].q) {
+    if (u_remapped) *u_remapped = up / bins[i].q;
+  } else {
+    if (u_remapped) *u_remapped = std::min((up - bins[i].q) / (1 - bins[i].q), 1 - 1e-12);
+    i = bins[i].alias;
+  }
+  *pmf = bins[i].p;
+  return i;
+}
+
+// Light bounds //
+
+/**
+ * Cosine of the difference of two angles given by their sines and cosines,
+ * 1 if the difference is negative.
+ */
+static double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+  if (cos_a > cos_b) return 1;
+  return cos_a * cos_b + sin_a * sin_b;
+}
+
+/**
+ * Sine of the difference of two angles, 0 if the difference is negative.
+ */
+static double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+  if (cos_a > cos_b) return 0;
+  return sin_a * cos_b - cos_a * sin_b;
+}
+
+static double safe_sqrt(double x) { return sqrt(std::max(0.0, x)); }
+
+/**
+ * Upper bound on the light that the lights of b bring to point p with
+ * surface normal n, up to a common factor. The directions from the lights
+ * to p are bounded by the cone that the box subtends, the emission by the
+ * angle between that cone and the emission cone.
+ */
+static double importance(const LightBounds& b, const Vector3D& p, const Vector3D& n) {
+  Vector3D pc = 0.5 * (b.bounds.min + b.bounds.max);
+  double radius = 0.5 * b.bounds.extent.norm();
+  double d2 = std::max((p - pc).norm2(), 0.5 * b.bounds.extent.norm());
+
+  Vector3D wi = p - pc;
+  double d = wi.norm();
+  wi = d > 0 ? wi / d : Vector3D(0, 0, 1);
+  double cos_w = dot(b.axis, wi);
+  if (b.two_sided) cos_w = fabs(cos_w);
+  double sin_w = safe_sqrt(1 - cos_w * cos_w);
+
+  // the box as seen from p, all directions if p is inside its sphere
+  double cos_b = -1;
+  if (d > radius) cos_b = safe_sqrt(1 - radius * radius / (d * d));
+  double sin_b = safe_sqrt(1 - cos_b * cos_b);
+
+  double sin_o = safe_sqrt(1 - b.cos_theta_o * b.cos_theta_o);
+  double cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, b.cos_theta_o);
+  double sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, b.cos_theta_o);
+  double cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+  if (cos_p <= b.cos_theta_e) return 0;
+
+  double result = b.phi * cos_p / d2;
+  if (n.norm2() > 0) {
+    double cos_i = fabs(dot(wi, n));
+    double sin_i = safe_sqrt(1 - cos_i * cos_i);
+    result *= cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+  }
+  return std::max(result, 0.0);
+}
+
+/**
+ * Bounds of the lights of a and b together. The emission cone is the
+ * smallest cone holding both cones.
+ */
+static LightBounds bounds_union(const LightBounds& a, const LightBounds& b) {
+  if (a.phi == 0) return b;
+  if (b.phi == 0) return a;
+  LightBounds u;
+  u.bounds = a.bounds;
+  u.bounds.expand(b.bounds);
+  u.phi = a.phi + b.phi;
+  u.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+  u.two_sided = a.two_sided || b.two_sided;
+
+  double theta_a = acos(clamp(a.cos_theta_o, -1.0, 1.0));
+  double theta_b = acos(clamp(b.cos_theta_o, -1.0, 1.0));
+  double theta_d = acos(clamp(dot(a.axis, b.axis), -1.0, 1.0));
+  if (std::min(theta_d + theta_b, PI) <= theta_a) {
+    u.axis = a.axis;
+    u.cos_theta_o = a.cos_theta_o;
+    return u;
+  }
+  if (std::min(theta_d + theta_a, PI) <= theta_b) {
+    u.axis = b.axis;
+    u.cos_theta_o = b.cos_theta_o;
+    return u;
+  }
+
+  double theta_o = 0.5 * (theta_a + theta_d + theta_b);
+  Vector3D wr = cross(a.axis, b.axis);
+  if (theta_o >= PI || wr.norm2() == 0) {
+    u.axis = a.axis;
+    u.cos_theta_o = -1;
+    return u;
+  }
+  // turn the axis of a towards b so that the cone just holds a
+  double theta_r = theta_o - theta_a;
+  wr.normalize();
+  u.axis = (a.axis * cos(theta_r) + cross(wr, a.axis) * sin(theta_r)).unit();
+  u.cos_theta_o = cos(theta_o);
+  return u;
+}
+
+// LightSampler //
+
+LightSampler::LightSampler(const std::vector<SceneLight*>& scene_lights, double sceneRadius)
+  : lights(scene_lights.begin(), scene_lights.end()), bvh_index(0) {
+  std::vector<std::pair<size_t, LightBounds> > bounded;
+  for (size_t i = 0; i < lights.size(); i++) {
+    LightBounds b;
+    if (lights[i]->bounds(&b) && b.phi > 0) bounded.push_back(std::make_pair(i, b));
+  }
+  bool use_bvh = bounded.size() > LIGHT_BVH_MIN_LIGHTS;
+
+  std::vector<double> power;
+  for (size_t i = 0; i < lights.size(); i++) {
+    LightBounds b;
+    if (use_bvh && lights[i]->bounds(&b) && b.phi > 0) continue;
+    table_index[lights[i]] = table_lights.size();
+    table_lights.push_back(lights[i]);
+    power.push_back(std::max(lights[i]->power(sceneRadius), 0.0));
+  }
+  if (use_bvh) {
+    build(bounded, 0, bounded.size(), 0, 0);
+    bvh_index = table_lights.size();
+    table_lights.push_back(NULL);
+    power.push_back(nodes[0].bounds.phi);
+  }
+  table = AliasTable(power);
+}
+
+size_t LightSampler::build(std::vector<std::pair<size_t, LightBounds> >& bounded,
+                           size_t begin, size_t end, uint64_t trail, int depth) {
+  size_t index = nodes.size();
+  nodes.push_back(Node());
+  if (end - begin == 1) {
+    nodes[index].bounds = bounded[begin].second;
+    nodes[index].child = bounded[begin].first;
+    nodes[index].leaf = true;
+    bvh_trail[lights[bounded[begin].first]] = trail;
+    return index;
+  }
+
+  // median split along the longest axis of the centroids
+  BBox centroids;
+  for (size_t i = begin; i < end; i++) {
+    const BBox& bb = bounded[i].second.bounds;
+    centroids.expand(0.5 * (bb.min + bb.max));
+  }
+  int axis = 0;
+  if (centroids.extent.y > centroids.extent[axis]) axis = 1;
+  if (centroids.extent.z > centroids.extent[axis]) axis = 2;
+  size_t mid = (begin + end) / 2;
+  std::nth_element(bounded.begin() + begin, bounded.begin() + mid, bounded.begin() + end,
+                   [axis](const std::pair<size_t, LightBounds>& a,
+                          const std::pair<size_t, LightBounds>& b) {
+    return a.second.bounds.min[axis] + a.second.bounds.max[axis] <
+           b.second.bounds.min[axis] + b.second.bounds.max[axis];
+  });
+
+  build(bounded, begin, mid, trail, depth + 1);
+  size_t second = build(bounded, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+  nodes[index].bounds = bounds_union(nodes[index + 1].bounds, nodes[second].bounds);
+  nodes[index].child = second;
+  nodes[index].leaf = false;
+  return index;
+}
+
+const SceneLight* LightSampler::sample(const Vector3D& p, const Vector3D& n,
+                                       double* pmf) const {
+  *pmf = 0;
+  if (table_lights.empty()) return NULL;
+  double u = lights.size() > 1 ? sample_1d() : 0.5;
+
+  double table_pmf;
+  size_t entry = table.sample(u, &table_pmf, &u);
+  if (table_pmf <= 0) return NULL;
+  if (table_lights[entry]) {
+    *pmf = table_pmf;
+    return table_lights[entry];
+  }
+
+  // walk down the BVH, choosing children by their importance
+  double node_pmf = 1;
+  size_t index = 0;
+  while (!nodes[index].leaf) {
+    double c0 = importance(nodes[index + 1].bounds, p, n);
+    double c1 = importance(nodes[nodes[index].child].bounds, p, n);
+    if (c0 + c1 <= 0) return NULL;
+    double p0 = c0 / (c0 + c1);
+    if (u < p0) {
+      u = std::min(u / p0, 1 - 1e-12);
+      node_pmf *= p0;
+      index = index + 1;
+    } else {
+      u = std::min((u - p0) / (1 - p0), 1 - 1e-12);
+      node_pmf *= 1 - p0;
+      index = nodes[index].child;
+    }
+  }
+  *pmf = table_pmf * node_pmf;
+  return lights[nodes[index].child];
+}
+
+double LightSampler::pmf(const Vector3D& p, const Vector3D& n,
+                         const SceneLight* light) const {
+  auto t = table_index.find(light);
+  if (t != table_index.end()) return table.pmf(t->second);
+  auto b = bvh_trail.find(light);
+  if (b == bvh_trail.end()) return 0;
+
+  // follow the trail of the light down from the root
+  double result = table.pmf(bvh_index);
+  uint64_t trail = b->second;
+  size_t index = 0;
+  while (!nodes[index].leaf) {
+    double c0 = importance(nodes[index + 1].bounds, p, n);
+    double c1 = importance(nodes[nodes[index].child].bounds, p, n);
+    if (c0 + c1 <= 0) return 0;
+    if (trail & 1) {
+      result *= c1 / (c0 + c1);
+      index = nodes[index].child;
+    } else {
+      result *= c0 / (c0 + c1);
+      index = index + 1;
+    }
+    trail >>= 1;
+  }
+  return result;
+}
+
+} // namespace CGL
@@ -0,0 +1,156 @@
+#ifndef CGL_LIGHT_SAMPLER_H
+#define CGL_LIGHT_SAMPLER_H
+
+#include "scene/scene.h"
+#include "pathtracer/ray.h"
+
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+namespace CGL {
+
+using SceneObjects::SceneLight;
+using SceneObjects::LightBounds;
+
+/**
+ * Samples one of n entries with probability proportional to its weight in
+ * constant time (Vose's alias method).
+ */
+class AliasTable {
+ public:
+  AliasTable() { }
+
+  /**
+   * Build the table. If all weights are 0 the entries are equally likely.
+   * \param weights nonnegative weight of every entry
+   */
+  AliasTable(const std::vector<double>& weights);
+
+  /**
+   * Choose an entry.
+   * \param u uniform number in [0, 1)
+   * \param pmf probability of the chosen entry
+   * \param u_remapped if not NULL, u turned into a fresh uniform number
+   */
+  size_t sample(double u, double* pmf, double* u_remapped = NULL) const;
+
+  /**
+   * Probability of choosing entry i.
+   */
+  double pmf(size_t i) const { return bins[i].p; }
+
+  size_t size() const { return bins.size(); }
+
+ private:
+  struct Bin {
+    double q;      ///< probability of keeping the entry of the bin
+    double p;      ///< probability of the entry of the bin
+    size_t alias;  ///< entry chosen otherwise
+  };
+  std::vector<Bin> bins;
+};
+
+/**
+ * Chooses the light that a light sample of a shading point goes to, with
+ * probability proportional to the light it can bring there, so that every
+ * shading point takes a few samples no matter how many lights there are.
+ *
+ * Lights are first chosen by their power. Once a scene has more than
+ * LIGHT_BVH_MIN_LIGHTS lights with bounds, those are kept in a light BVH
+ * instead, whose nodes bound the power, position and emission directions
+ * of their lights; sampling walks down the tree choosing a child by how
+ * much light it may bring to the shading point. The BVH then counts as one
+ * light next to the lights without bounds (the infinite ones).
+ */
+class LightSampler {
+ public:
+
+  /**
+   * Build the sampler.
+   * \param lights lights of the scene
+   * \param sceneRadius radius of a sphere around the scene, for the power
+   *                    of infinite lights
+   */
+  LightSampler(const std::vector<SceneLight*>& lights, double sceneRadius);
+
+  /**
+   * Choose a light for a sample at point p with surface normal n. Draws a
+   * number from the sample sequence if there is more than one light.
+   * \param pmf probability of the light chosen
+   * \return the light, NULL if no light can light p
+   */
+  const SceneLight* sample(const Vector3D& p, const Vector3D& n, double* pmf) const;
+
+  /**
+   * Probability that sample(p, n, pmf) chooses light.
+   */
+  double pmf(const Vector3D& p, const Vector3D& n, const SceneLight* light) const;
+
+  /**
+   * Call f on every light that ray r may hit before distance t: all lights
+   * without bounds and the lights of the BVH leaves that r goes through, up
+   * to EPS_F past t.
+   */
+  template <typename F>
+  void for_each_light_along(const Ray& r, double t, F f) const;
+
+  /**
+   * If the sampler keeps its lights in a light BVH.
+   */
+  bool uses_bvh() const { return !nodes.empty(); }
+
+ private:
+
+  /**
+   * A node of the light BVH. The second child of an inner node is stored
+   * at child, the first right after the node.
+   */
+  struct Node {
+    LightBounds bounds;
+    size_t child;        ///< second child, or light of a leaf
+    bool leaf;
+  };
+
+  size_t build(std::vector<std::pair<size_t, LightBounds> >& lights,
+               size_t begin, size_t end, uint64_t trail, int depth);
+
+  std::vector<const SceneLight*> lights;
+  std::vector<const SceneLight*> table_lights;  ///< lights of the table, NULL for the BVH
+  AliasTable table;
+  std::vector<Node> nodes;
+  std::unordered_map<const SceneLight*, size_t> table_index;
+  std::unordered_map<const SceneLight*, uint64_t> bvh_trail;  ///< path from the root, bit i is the child taken at depth i
+  size_t bvh_index;  ///< entry of the BVH in the table
+};
+
+template <typename F>
+void LightSampler::for_each_light_along(const Ray& r, double t, F f) const {
+  for (const SceneLight* light : table_lights) {
+    if (light) f(light);
+  }
+  if (nodes.empty()) return;
+
+  // a leaf box of a flat light can start a few ulps past the hit on the
+  // light itself, callers reject lights beyond t with the same tolerance
+  Ray ray = r;
+  ray.max_t = t + EPS_F;
+  size_t stack[64];
+  size_t top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const Node& node = nodes[stack[--top]];
+    double t0 = ray.min_t, t1 = ray.max_t;
+    if (!node.bounds.bounds.intersect(ray, t0, t1)) continue;
+    if (node.leaf) {
+      f(lights[node.child]);
+    } else {
+      stack[top++] = node.child;
+      stack[top++] = &node - &nodes[0] + 1;
+    }
+  }
+}
+
+} // namespace CGL
+
+#endif // CGL_LIGHT_SAMPLER_H
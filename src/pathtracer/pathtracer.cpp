@@ -9,10 +9,33 @@ using namespace CGL::SceneObjects;
 
 namespace CGL {
 
+// lens samples drawn for a camera ray before it is given up as blocked; the
+// exit pupil bounds only rule out what the lens certainly blocks, so rays
+// inside them can still hit a barrel or the aperture blades
+static const size_t CAMERA_RAY_ATTEMPTS = 16;
+
+// vertices of a path before russian roulette may end it, and the highest
+// probability of going on after that, which still ends paths that keep
+// all of their throughput
+static const size_t ROULETTE_MIN_VERTICES = 3;
+static const double ROULETTE_MAX_P = 0.95;
+
+// power heuristic weight of a sample drawn by a strategy with density f
+// against another one with density g, each already scaled by its number of
+// samples; beta = 2 (Veach)
+static double power_heuristic(double f, double g) {
+  if (f <= 0) return 0;
+  return f * f / (f * f + g * g);
+}
+
 PathTracer::PathTracer() {
   gridSampler = new UniformGridSampler2D();
   hemisphereSampler = new UniformHemisphereSampler3D();
 
+  wavefront = false;
+  seed = 0;
+  sequence = SEQUENCE_RANDOM;
+
   tm_gamma = 2.2f;
   tm_level = 1.0f;
   tm_key = 0.18;
@@ -27,16 +50,23 @@ PathTracer::~PathTracer() {
 void PathTracer::set_frame_size(size_t width, size_t height) {
   sampleBuffer.resize(width, height);
   sampleCountBuffer.resize(width * height);
+  reset_accumulation();
 }
 
 void PathTracer::clear() {
   bvh = NULL;
+  lightSampler = NULL;
   scene = NULL;
   camera = NULL;
   sampleBuffer.clear();
   sampleCountBuffer.clear();
   sampleBuffer.resize(0, 0);
   sampleCountBuffer.resize(0, 0);
+  accumBuffer.clear();
+}
+
+void PathTracer::reset_accumulation() {
+  accumBuffer.assign(sampleBuffer.w * sampleBuffer.h, PixelAccumulator());
 }
 
 void PathTracer::write_to_framebuffer(ImageBuffer &framebuffer, size_t x0,
@@ -47,16 +77,23 @@ void PathTracer::write_to_framebuffer(ImageBuffer &framebuffer, size_t x0,
 Vector3D
 PathTracer::estimate_direct_lighting_hemisphere(const Ray &r,
                                                 const Intersection &isect) {
+  // make a coordinate system for a hit point
+  // with N aligned with the Z direction.
+  Matrix3x3 o2w;
+  make_coord_space(o2w, isect.n);
+  return estimate_direct_lighting_hemisphere(r, isect, o2w);
+}
+
+Vector3D
+PathTracer::estimate_direct_lighting_hemisphere(const Ray &r,
+                                                const Intersection &isect,
+                                                const Matrix3x3 &o2w) {
   // Estimate the lighting from this intersection coming directly from a light.
   // For this function, sample uniformly in a hemisphere.
 
   // Note: When comparing Cornel Box (CBxxx.dae) results to importance sampling, you may find the "glow" around the light source is gone.
   // This is totally fine: the area lights in importance sampling has directionality, however in hemisphere sampling we don't model this behaviour.
 
-  // make a coordinate system for a hit point
-  // with N aligned with the Z direction.
-  Matrix3x3 o2w;
-  make_coord_space(o2w, isect.n);
   Matrix3x3 w2o = o2w.T();
 
   // w_out points towards the source of the ray (e.g.,
@@ -67,13 +104,14 @@ PathTracer::estimate_direct_lighting_hemisphere(const Ray &r,
   // This is the same number of total samples as
   // estimate_direct_lighting_importance (outside of delta lights). We keep the
   // same number of samples for clarity of comparison.
-  double num_samples = scene->lights.size() * ns_area_light;
+  double num_samples = ns_area_light;
     Vector3D L_out;
 
   // TODO (Part 3): Write your sampling loop here
   // TODO BEFORE YOU BEGIN
   // UPDATE `est_radiance_global_illumination` to return direct lighting instead of normal shading
     for (int i = 0; i < num_samples; i++) {
+        set_sample_domain(path_vertex(r), SAMPLE_LIGHT, i, num_samples);
         Vector3D w_in = hemisphereSampler->get_sample().unit();
         Ray sample_ray = Ray(hit_p, (o2w * w_in).unit());
         sample_ray.min_t = EPS_D;
@@ -93,14 +131,22 @@ PathTracer::estimate_direct_lighting_hemisphere(const Ray &r,
 Vector3D
 PathTracer::estimate_direct_lighting_importance(const Ray &r,
                                                 const Intersection &isect) {
-  // Estimate the lighting from this intersection coming directly from a light.
-  // To implement importance sampling, sample only from lights, not uniformly in
-  // a hemisphere.
-
   // make a coordinate system for a hit point
   // with N aligned with the Z direction.
   Matrix3x3 o2w;
   make_coord_space(o2w, isect.n);
+  return estimate_direct_lighting_importance(r, isect, o2w, false);
+}
+
+Vector3D
+PathTracer::estimate_direct_lighting_importance(const Ray &r,
+                                                const Intersection &isect,
+                                                const Matrix3x3 &o2w,
+                                                bool mis) {
+  // Estimate the lighting from this intersection coming directly from a light.
+  // To implement importance sampling, sample only from lights, not uniformly in
+  // a hemisphere.
+
   Matrix3x3 w2o = o2w.T();
 
   // w_out points towards the source of the ray (e.g.,
@@ -108,36 +154,54 @@ PathTracer::estimate_direct_lighting_importance(const Ray &r,
   const Vector3D hit_p = r.o + r.d * isect.t;
   const Vector3D w_out = w2o * (-r.d);
   Vector3D L_out;
-    int num_samples = scene->lights.size() * ns_area_light;
-    
-    for (auto p = scene->lights.begin(); p != scene->lights.end(); p++) {
-        for (int i = 0; i < ns_area_light; i++) {
+    // every sample goes to one light that the light sampler chooses; all
+    // samples of a single delta light are the same, trace one
+    size_t num_samples = ns_area_light;
+    if (scene->lights.size() == 1 && scene->lights[0]->is_delta_light()) {
+        num_samples = 1;
+    }
+
+    // the shadow rays start at the same point and are coherent, trace
+    // them as packets
+    for (size_t first = 0; first < num_samples; first += RAY_PACKET_SIZE) {
+        RayPacket packet;
+        Vector3D w_ins[RAY_PACKET_SIZE], emissions[RAY_PACKET_SIZE];
+        double pdfs[RAY_PACKET_SIZE];
+        for (size_t i = first; i < num_samples && !packet.full(); i++) {
             // sample at the direction of the light
             Vector3D w_in;
             double disToLight;
-            double pdf;
-            Vector3D emission = (*p)->sample_L(hit_p, &w_in, &disToLight, &pdf);
-            
+            double pdf, pmf;
+            set_sample_domain(path_vertex(r), SAMPLE_LIGHT, i, num_samples);
+            const SceneLight *light = lightSampler->sample(hit_p, isect.n, &pmf);
+            if (!light) continue;
+            Vector3D emission = light->sample_L(hit_p, &w_in, &disToLight, &pdf);
+
             // light behind the surface at the hit point
-            if (dot(w_in, isect.n) < 0) {
+            if (pdf <= 0 || dot(w_in, isect.n) < 0) {
                 continue;
             }
-            
+            double weight = 1.0 / (num_samples * pmf);
+            if (mis) {
+                weight *= light_mis_weight(light, pmf, hit_p, w_in, isect.bsdf->pdf(w_out, w2o * w_in));
+            }
+
             // cast a ray in the sampled direction
             Ray sample_ray = Ray(hit_p, w_in);
             sample_ray.min_t = EPS_F;
             sample_ray.max_t = disToLight - EPS_F;
-            // if no object between the hit point and the light
-            if (!bvh->has_intersection(sample_ray)) {
-                Vector3D f = isect.bsdf->f(w_out, w2o * w_in);
-                L_out += f * emission * cos_theta(w2o * w_in) / pdf / num_samples;
-                
-                // optimize for point light source
-                if ((*p)->is_delta_light()) {
-                    L_out += (f * emission * cos_theta(w2o * w_in) / pdf / num_samples) * (ns_area_light - 1);
-                    break;
-                }
-            }
+            size_t lane = packet.add(sample_ray);
+            w_ins[lane] = w2o * w_in;
+            emissions[lane] = emission * weight;
+            pdfs[lane] = pdf;
+        }
+
+        // add the lanes with no object between the hit point and the light
+        uint32_t occluded = bvh->has_intersection(packet);
+        for (size_t l = 0; l < packet.size; l++) {
+            if (occluded & (1u << l)) continue;
+            Vector3D f = isect.bsdf->f(w_out, w_ins[l]);
+            L_out += f * emissions[l] * cos_theta(w_ins[l]) / pdfs[l];
         }
     }
     return L_out;
@@ -165,54 +229,100 @@ Vector3D PathTracer::one_bounce_radiance(const Ray &r,
 
 Vector3D PathTracer::at_least_one_bounce_radiance(const Ray &r,
                                                   const Intersection &isect) {
-  Matrix3x3 o2w;
-  make_coord_space(o2w, isect.n);
-  Matrix3x3 w2o = o2w.T();
-
-  Vector3D hit_p = r.o + r.d * isect.t;
-  Vector3D w_out = w2o * (-r.d);
+  // TODO: Part 4, Task 2
+  // Returns the one bounce radiance + radiance from extra bounces at this point.
 
+  // the path is followed vertex by vertex in place, beta is its throughput
+  // from the first hit to the current one
   Vector3D L_out(0, 0, 0);
+  Vector3D beta(1, 1, 1);
+  Ray ray = r;
+  Intersection hit = isect;
+  Matrix3x3 o2w;
+  while (true) {
+    make_coord_space(o2w, hit.n);
+    Vector3D hit_p = ray.o + ray.d * hit.t;
+    Vector3D w_out = o2w.T() * (-ray.d);
+
+    // with light sampling the bounce below is the second strategy for
+    // direct light, the two are combined by multiple importance sampling
+    bool mis = !direct_hemisphere_sample && ray.depth > 1;
+    if (!hit.bsdf->is_delta()) {
+      L_out += beta * (direct_hemisphere_sample ? estimate_direct_lighting_hemisphere(ray, hit, o2w)
+                                                : estimate_direct_lighting_importance(ray, hit, o2w, mis));
+    }
 
-  // TODO: Part 4, Task 2
-  // Returns the one bounce radiance + radiance from extra bounces at this point.
-  // Should be called recursively to simulate extra bounces.
-    
-    // russian roulette continuation probability
-    double p = 0.7;
-    if (!isect.bsdf->is_delta()) {
-        L_out += one_bounce_radiance(r, isect);
+    // keep tracing if there is depth left and the path survives the roulette
+    if (ray.depth <= 1) break;
+    double p = continue_probability(ray, beta);
+    if (p < 1 && !coin_flip(p)) break;
+
+    // sample a incoming direction
+    Vector3D w_in;
+    double pdf;
+    set_sample_domain(path_vertex(ray), SAMPLE_BSDF);
+    Vector3D f = hit.bsdf->sample_f(w_out, &w_in, &pdf);
+    if (pdf <= 0) break;
+    beta = beta * f * (abs_cos_theta(w_in) / pdf / p);
+    bool delta = hit.bsdf->is_delta();
+    Vector3D n = hit.n;
+
+    // cast a ray, the path ends if it leaves the scene
+    ray = Ray(hit_p, (o2w * w_in).unit(), INF_D, ray.depth - 1);
+    ray.min_t = EPS_F;
+
+    // light sampling at a delta vertex cannot see lights, its bounce does;
+    // elsewhere the bounce adds its share of the lights it finds
+    bool found = bvh->intersect(ray, &hit);
+    if (mis && !delta) {
+      L_out += beta * estimate_direct_lighting_bsdf(ray, found ? hit.t : INF_D, pdf, n);
     }
-    
-    // keep tracing with probability p and if there is depth left
-    if (r.depth > 1 && coin_flip(p)) {
-        // sample a incoming direction
-        Vector3D w_in;
-        double pdf;
-        Vector3D f = isect.bsdf->sample_f(w_out, &w_in, &pdf);
-            
-        // cast a ray
-        Ray sample_ray = Ray(hit_p, (o2w * w_in).unit(), INF_D, r.depth - 1);
-        sample_ray.min_t = EPS_F;
-            
-        // recurse if the sampled ray intersects the scene
-        Intersection sample_i;
-        if (bvh->intersect(sample_ray, &sample_i)) {
-            Vector3D l = at_least_one_bounce_radiance(sample_ray, sample_i);
-            //Vector3D f_l = Vector3D(f[0] * l[0], f[1] * l[1], f[2] * l[2]);
-            if (isect.bsdf->is_delta()) {
-                l += zero_bounce_radiance(sample_ray, sample_i);
-            }
-            Vector3D f_l = f * l;
-            L_out += f_l * abs_cos_theta(w_in) / pdf / p;
-        }
+    if (!found) break;
+    if (delta) {
+      L_out += beta * zero_bounce_radiance(ray, hit);
     }
+  }
+
+  return L_out;
+}
+
+double PathTracer::light_mis_weight(const SceneLight *light, double pmf, const Vector3D &p,
+                                    const Vector3D &wi, double pdf) const {
+  // lights that bounces cannot find keep their samples in full
+  double distToLight, pdf_L;
+  light->eval_L(p, wi, &distToLight, &pdf_L);
+  return pdf_L > 0 ? power_heuristic(ns_area_light * pmf * pdf_L, pdf) : 1;
+}
 
+Vector3D PathTracer::estimate_direct_lighting_bsdf(const Ray &r, double t, double pdf,
+                                                   const Vector3D &n) {
+  // the lights themselves are looked up rather than the emissive surfaces the
+  // ray hits, so both strategies see exactly the same lights
+  Vector3D L_out;
+  lightSampler->for_each_light_along(r, t, [&](const SceneLight *light) {
+    double distToLight, pdf_L;
+    Vector3D radiance = light->eval_L(r.o, r.d, &distToLight, &pdf_L);
+    if (pdf_L <= 0 || t < distToLight - EPS_F) return;
+    double pmf = lightSampler->pmf(r.o, n, light);
+    L_out += radiance * power_heuristic(pdf, ns_area_light * pmf * pdf_L);
+  });
   return L_out;
 }
 
+double PathTracer::continue_probability(const Ray &r, const Vector3D &beta) const {
+  if (path_vertex(r) + 1 < ROULETTE_MIN_VERTICES) return 1;
+  return std::min(std::max(beta.x, std::max(beta.y, beta.z)), ROULETTE_MAX_P);
+}
+
 Vector3D PathTracer::est_radiance_global_illumination(const Ray &r) {
   Intersection isect;
+  bool hit = bvh->intersect(r, &isect);
+  return est_radiance_global_illumination(r, isect, hit);
+}
+
+Vector3D PathTracer::est_radiance_global_illumination(const Ray &r,
+                                                      const Intersection &isect,
+                                                      bool hit) {
   Vector3D L_out;
 
   // You will extend this in assignment 3-2.
@@ -225,7 +335,7 @@ Vector3D PathTracer::est_radiance_global_illumination(const Ray &r) {
   //
   // REMOVE THIS LINE when you are ready to begin Part 3.
   
-  if (!bvh->intersect(r, &isect))
+  if (!hit)
     return envLight ? envLight->sample_dir(r) : L_out;
 
 
@@ -247,6 +357,36 @@ Vector3D PathTracer::est_radiance_global_illumination(const Ray &r) {
   return L_out;
 }
 
+Ray PathTracer::generate_camera_ray(size_t x, size_t y) {
+  Vector2D origin = Vector2D(x, y); // bottom left corner of the pixel
+  for (size_t attempt = 0; attempt < CAMERA_RAY_ATTEMPTS; attempt++) {
+    Vector2D sample = gridSampler->get_sample() + origin;
+    Vector2D samplesForLens = gridSampler->get_sample();
+    Ray ray = camera->generate_ray_for_zoom_lens(sample[0] / sampleBuffer.w, sample[1] / sampleBuffer.h, samplesForLens.x, samplesForLens.y);
+
+    // re-sample if the sampled ray did not go through the aperture, which
+    // keeps the rays uniform over the part of the pupil that transmits
+    if (ray.d.norm() == 0) {
+      continue;
+    }
+
+    double min_t = ray.min_t;
+    ray = Ray(ray.o, ray.d, ray.max_t, max_ray_depth);
+    ray.min_t = min_t;
+    return ray;
+  }
+  return Ray();
+}
+
+void PathTracer::seed_pixel(size_t x, size_t y, size_t first_sample) {
+  uint64_t pixel = (uint64_t)x + (uint64_t)y * sampleBuffer.w;
+  thread_rng().seed(mix_bits(seed ^ mix_bits(first_sample)), pixel);
+}
+
+void PathTracer::start_sample(size_t x, size_t y, size_t index) {
+  start_pixel_sample(sequence, seed, x, y, index, ns_aa);
+}
+
 void PathTracer::raytrace_pixel(size_t x, size_t y) {
   // TODO (Part 1.2):
   // Make a loop that generates num_samples camera rays and traces them
@@ -257,55 +397,76 @@ void PathTracer::raytrace_pixel(size_t x, size_t y) {
   // Modify your implementation to include adaptive sampling.
   // Use the command line parameters "samplesPerBatch" and "maxTolerance"
 
-  int num_samples = ns_aa;          // total samples to evaluate
-  Vector2D origin = Vector2D(x, y); // bottom left corner of the pixel
-    
-    Vector3D radiance = Vector3D(0, 0, 0);
-    
-    double s1 = 0;
-    double s2 = 0;
-    double mean, sd, I;
-    int i;
-    for (i = 0; i < num_samples; i++) {
-        Vector2D sample = gridSampler->get_sample() + origin;
-        Vector2D samplesForLens = gridSampler->get_sample();
-        Ray ray = camera->generate_ray_for_zoom_lens(sample[0] / sampleBuffer.w, sample[1] / sampleBuffer.h, samplesForLens.x, samplesForLens.y * 2.0 * PI);
-        
-        // re-sample if the sampled ray did not go through the aperture
-        if (ray.d.norm() == 0) {
-            i--;
-            continue;
-        }
-        
-        double min_t = ray.min_t;
-        ray = Ray(ray.o, ray.d, ray.max_t, max_ray_depth);
-        ray.min_t = min_t;
-        Vector3D sample_radiance = est_radiance_global_illumination(ray);
-        radiance += sample_radiance;
-        
-        s1 += sample_radiance.illum();
-        s2 += pow(sample_radiance.illum(), 2);
-        if ((i + 1) % samplesPerBatch == 0) {
-            mean = s1 / (double) (i + 1);
-            sd = sqrt( (1.0 / (double) i) * (s2 - (pow(s1, 2) / (double) (i + 1))) );
-            I = 1.96 * sd / sqrt((double)(i + 1));
-            if (I <= maxTolerance * mean) {
-                i++;
-                break;
+  PixelAccumulator acc;
+  add_pixel_samples(acc, x, y, ns_aa);
+  sampleBuffer.update_pixel(acc.mean(), x, y);
+  sampleCountBuffer[x + y * sampleBuffer.w] = acc.count;
+}
+
+void PathTracer::add_pixel_samples(PixelAccumulator& acc, size_t x, size_t y,
+                                   size_t num_samples) {
+    size_t i = acc.count;
+    size_t end = std::min(i + num_samples, ns_aa);
+    seed_pixel(x, y, i);
+    while (i < end && !acc.converged) {
+        // the camera rays of a pixel are coherent, trace them as packets;
+        // a packet never crosses a batch boundary so the adaptive sampling
+        // test still runs after every samplesPerBatch samples
+        size_t lanes = std::min(RAY_PACKET_SIZE, samplesPerBatch - i % samplesPerBatch);
+        lanes = std::min(lanes, end - i);
+
+        // samples that find no way through the lens take no lane and are
+        // left out of the pixel's mean, the samples that get through stand
+        // for the whole pupil
+        RayPacket packet;
+        size_t lane_samples[RAY_PACKET_SIZE];
+        for (size_t s = i; s < i + lanes; s++) {
+            start_sample(x, y, s);
+            Ray ray = generate_camera_ray(x, y);
+            if (ray.d.norm() == 0) {
+                acc.blocked++;
+                continue;
             }
+            lane_samples[packet.add(ray)] = s;
         }
-    }
-  sampleBuffer.update_pixel(radiance / i, x, y);
-  sampleCountBuffer[x + y * sampleBuffer.w] = i;
-}
 
-void PathTracer::autofocus(Vector2D loc) {
-  Ray r = camera->generate_ray(loc.x / sampleBuffer.w, loc.y / sampleBuffer.h);
-  Intersection isect;
+        Intersection isects[RAY_PACKET_SIZE];
+        uint32_t hits = bvh->intersect(packet, isects);
+        for (size_t l = 0; l < packet.size; l++) {
+            start_sample(x, y, lane_samples[l]);
+            Vector3D sample_radiance = est_radiance_global_illumination(packet.rays[l], isects[l], hits & (1u << l));
+            acc.radiance += sample_radiance;
 
-  bvh->intersect(r, &isect);
+            acc.s1 += sample_radiance.illum();
+            acc.s2 += pow(sample_radiance.illum(), 2);
+        }
+        i += lanes;
+
+        size_t n = i - acc.blocked;
+        if (i % samplesPerBatch == 0 && n >= 2) {
+            double mean = acc.s1 / (double) n;
+            double sd = sqrt( (1.0 / (double) (n - 1)) * (acc.s2 - (pow(acc.s1, 2) / (double) n)) );
+            double I = 1.96 * sd / sqrt((double) n);
+            acc.converged = I <= maxTolerance * mean;
+        }
+    }
+    acc.count = i;
+}
 
-  camera->focalDistance = isect.t;
+bool PathTracer::raytrace_tile_progressive(size_t x0, size_t y0, size_t x1, size_t y1,
+                                           size_t num_samples) {
+  bool active = false;
+  for (size_t y = y0; y < y1; y++) {
+    for (size_t x = x0; x < x1; x++) {
+      PixelAccumulator &acc = accumBuffer[x + y * sampleBuffer.w];
+      if (acc.converged || acc.count >= ns_aa) continue;
+      add_pixel_samples(acc, x, y, num_samples);
+      sampleBuffer.update_pixel(acc.mean(), x, y);
+      sampleCountBuffer[x + y * sampleBuffer.w] = acc.count;
+      active = active || (!acc.converged && acc.count < ns_aa);
+    }
+  }
+  return active;
 }
 
 } // namespace CGL
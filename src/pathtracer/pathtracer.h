@@ -6,6 +6,7 @@
 #include "scene/bvh.h"
 #include "pathtracer/sampler.h"
 #include "pathtracer/intersection.h"
+#include "pathtracer/light_sampler.h"
 
 #include "application/renderer.h"
 
@@ -20,6 +21,26 @@ using CGL::SceneObjects::BVHAccel;
 
 namespace CGL {
 
+    /**
+     * Running sums of the samples of a pixel, kept across the passes of a
+     * progressive render.
+     */
+    struct PixelAccumulator {
+        PixelAccumulator() : s1(0), s2(0), count(0), blocked(0), converged(false) { }
+
+        /**
+         * Mean radiance of the samples that found a way through the lens.
+         */
+        Vector3D mean() const { return count > blocked ? radiance / (count - blocked) : Vector3D(); }
+
+        Vector3D radiance;    ///< sum of the sample radiance
+        double s1, s2;        ///< sums of the sample illuminance and its square
+        size_t count;         ///< number of samples taken
+        size_t blocked;       ///< samples of count that found no way through the
+                              ///< lens, which the sums leave out
+        bool converged;       ///< the adaptive sampling test passed
+    };
+
     class PathTracer {
     public:
         PathTracer();
@@ -42,15 +63,46 @@ namespace CGL {
          */
         void clear();
 
-        void autofocus(Vector2D loc);
-
         /**
          * Trace an ray in the scene.
          */
         Vector3D estimate_direct_lighting_hemisphere(const Ray& r, const SceneObjects::Intersection& isect);
         Vector3D estimate_direct_lighting_importance(const Ray& r, const SceneObjects::Intersection& isect);
 
+        /**
+         * The direct lighting estimates above, in the shading frame o2w of
+         * the hit, see make_coord_space, for callers that already made it.
+         * \param mis the caller also samples the BSDF at the hit and adds
+         *            estimate_direct_lighting_bsdf of that sample, the light
+         *            samples are weighted by multiple importance sampling
+         */
+        Vector3D estimate_direct_lighting_hemisphere(const Ray& r, const SceneObjects::Intersection& isect,
+                                                     const Matrix3x3& o2w);
+        Vector3D estimate_direct_lighting_importance(const Ray& r, const SceneObjects::Intersection& isect,
+                                                     const Matrix3x3& o2w, bool mis);
+
+        /**
+         * Multiple importance sampling weight of a light sample in direction
+         * wi from p, against a BSDF that samples wi with density pdf.
+         * \param pmf probability that the light sampler chose light
+         */
+        double light_mis_weight(const SceneObjects::SceneLight* light, double pmf,
+                                const Vector3D& p, const Vector3D& wi, double pdf) const;
+
+        /**
+         * The second strategy next to the light samples of
+         * estimate_direct_lighting_importance with mis set: the light that
+         * a ray r sampled from the BSDF finds, weighted to match.
+         * \param t distance to the first hit of r, INF_D if it misses
+         * \param pdf density of the BSDF sample, per unit solid angle
+         * \param n surface normal at the origin of r, which the light
+         *          sampler chose the lights of its light samples by
+         */
+        Vector3D estimate_direct_lighting_bsdf(const Ray& r, double t, double pdf,
+                                               const Vector3D& n);
+
         Vector3D est_radiance_global_illumination(const Ray& r);
+        Vector3D est_radiance_global_illumination(const Ray& r, const SceneObjects::Intersection& isect, bool hit);
         Vector3D zero_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
         Vector3D one_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
         Vector3D at_least_one_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
@@ -63,17 +115,89 @@ namespace CGL {
             return n * .5 + Vector3D(.5);
         }
 
+        /**
+         * Generate a camera ray through a random point of the given pixel,
+         * re-sampling until the ray makes it through the lens.
+         */
+        Ray generate_camera_ray(size_t x, size_t y);
+
+        /**
+         * Reseed the random number generator of the calling thread for the
+         * samples of a pixel from first_sample on. The stream only depends
+         * on seed, the pixel and first_sample, so a pixel gets the same
+         * samples no matter which thread renders it.
+         */
+        void seed_pixel(size_t x, size_t y, size_t first_sample);
+
+        /**
+         * Start drawing the numbers of sample index of a pixel from the
+         * sample sequence, see start_pixel_sample.
+         */
+        void start_sample(size_t x, size_t y, size_t index);
+
+        /**
+         * Vertex of a path that the hit of ray r is, 0 for camera rays.
+         */
+        size_t path_vertex(const Ray& r) const { return max_ray_depth - r.depth; }
+
+        /**
+         * Russian roulette: probability that a path goes on past the hit of
+         * ray r. Paths always go on for the first few vertices, after that
+         * with the largest component of their throughput beta, so paths
+         * that carry little light are cut short while the weight of the
+         * survivors stays around one.
+         * \param beta throughput of the path up to the hit, including the
+         *             weights of earlier roulette
+         */
+        double continue_probability(const Ray& r, const Vector3D& beta) const;
+
         /**
          * Trace a camera ray given by the pixel coordinate.
          */
         void raytrace_pixel(size_t x, size_t y);
+
+        /**
+         * Add up to num_samples samples to the estimate of a pixel, stopping
+         * early once the pixel has ns_aa samples or passes the adaptive
+         * sampling test, which runs after every samplesPerBatch samples.
+         * \param acc running sums of the pixel
+         * \param x column of the pixel
+         * \param y row of the pixel
+         * \param num_samples maximum number of samples to add
+         */
+        void add_pixel_samples(PixelAccumulator& acc, size_t x, size_t y, size_t num_samples);
+
+        /**
+         * Run one progressive pass over the pixels [x0, x1) x [y0, y1): add
+         * up to num_samples samples to every pixel that still needs some,
+         * accumulating in accumBuffer, and update the sample buffer with
+         * the new estimates.
+         * \return true if a pixel of the tile still needs samples
+         */
+        bool raytrace_tile_progressive(size_t x0, size_t y0, size_t x1, size_t y1,
+                                       size_t num_samples);
+
+        /**
+         * Forget the samples of a progressive render.
+         */
+        void reset_accumulation();
+
+        /**
+         * Render the pixels [x0, x1) x [y0, y1) with the wavefront integrator
+         * (wavefront.cpp). Instead of following one path at a time, it keeps
+         * the paths of all samples of a batch in a queue and advances them
+         * together one stage at a time: intersect, shade, trace shadow rays.
+         * The estimate is the same as raytrace_pixel's, including adaptive
+         * sampling.
+         */
+        void raytrace_tile_wavefront(size_t x0, size_t y0, size_t x1, size_t y1);
         
 
         // Integrator sampling settings //
 
         size_t max_ray_depth; ///< maximum allowed ray depth (applies to all rays)
         size_t ns_aa;         ///< number of camera rays in one pixel (along one axis)
-        size_t ns_area_light; ///< number samples per area light source
+        size_t ns_area_light; ///< number of light samples per shading point
         size_t ns_diff;       ///< number of samples - diffuse surfaces
         size_t ns_glsy;       ///< number of samples - glossy surfaces
         size_t ns_refr;       ///< number of samples - refractive surfaces
@@ -81,10 +205,14 @@ namespace CGL {
         size_t samplesPerBatch;
         double maxTolerance;
         bool direct_hemisphere_sample; ///< true if sampling uniformly from hemisphere for direct lighting. Otherwise, light sample
+        bool wavefront;                ///< render tiles with raytrace_tile_wavefront
+        uint64_t seed;                 ///< seed of the random numbers of a render
+        SampleSequence sequence;       ///< sequence the samplers draw from
 
         // Components //
 
         BVHAccel* bvh;                 ///< BVH accelerator aggregate
+        LightSampler* lightSampler;    ///< chooses the lights of light samples
         EnvironmentLight* envLight;    ///< environment map
         Sampler2D* gridSampler;        ///< samples unit grid
         Sampler3D* hemisphereSampler;  ///< samples unit hemisphere
@@ -92,6 +220,7 @@ namespace CGL {
         Timer timer;                   ///< performance test timer
 
         std::vector<int> sampleCountBuffer;   ///< sample count buffer
+        std::vector<PixelAccumulator> accumBuffer; ///< running sums of progressive passes
 
         Scene* scene;         ///< current scene
         Camera* camera;       ///< current camera
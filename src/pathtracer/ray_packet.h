@@ -0,0 +1,48 @@
+#ifndef CGL_RAY_PACKET_H
+#define CGL_RAY_PACKET_H
+
+#include "pathtracer/ray.h"
+
+#include <cstdint>
+
+namespace CGL {
+
+// maximum number of lanes of a ray packet, lane masks are 32 bit
+static const size_t RAY_PACKET_SIZE = 16;
+
+/**
+ * A small group of coherent rays that are traced together.
+ * All lanes share one traversal of the BVH and are tested against a node or
+ * a triangle at once, so the packet should only hold rays that take similar
+ * paths through the scene, e.g. the camera rays of one pixel or the shadow
+ * rays from one point towards one light. Lane l is rays[l]; the lanes in use
+ * are always 0 .. size - 1.
+ */
+struct RayPacket {
+
+  RayPacket() : size(0) { }
+
+  /**
+   * Append a ray to the packet.
+   * \param r ray to append, the packet must not be full
+   * \return lane of the ray
+   */
+  size_t add(const Ray& r) {
+    rays[size] = r;
+    return size++;
+  }
+
+  bool full() const { return size == RAY_PACKET_SIZE; }
+
+  /**
+   * Mask with one bit set for every lane in use.
+   */
+  uint32_t lanes() const { return (1u << size) - 1; }
+
+  size_t size;                  ///< number of lanes in use
+  Ray rays[RAY_PACKET_SIZE];    ///< rays of the lanes
+};
+
+} // namespace CGL
+
+#endif // CGL_RAY_PACKET_H
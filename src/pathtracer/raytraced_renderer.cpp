@@ -25,6 +25,20 @@ using std::max;
 
 namespace CGL {
 
+// Autofocus search. Focal distances move the sensor of the zoom lens over
+// the focus range that the focus calibration of the lens gives, and the
+// sharpness of a depth changes about linearly with them, so a search
+// without depths to start from covers the range uniformly.
+static const size_t AF_COARSE_PROBES = 9;   // evenly spaced probes of the first scan
+static const int AF_APERTURE_STEPS = 3;     // the first scan stops the lens down by 2^AF_APERTURE_STEPS
+static const size_t AF_MAX_PROBES = 28;     // probes of a whole search
+static const size_t AF_REFINE_PROBES = 8;   // probes of a search bracketed by the focus map
+static const double AF_DEPTH_MARGIN = 0.25; // focal distance the bracket extends past the depths
+static const double AF_TOLERANCE = 0.05;    // width of the bracket the search stops at
+static const size_t AF_PATCH_SIZE = 48;     // pixels along a side of the probed patch
+static const size_t AF_SAMPLES = 4;         // samples per pixel of a probe
+static const size_t AF_RAY_DEPTH = 1;       // maximum ray depth of a probe
+
 /**
  * Raytraced Renderer is a render controller that in this case.
  * It controls a path tracer to produce an rendered image from the input parameters.
@@ -37,51 +51,60 @@ namespace CGL {
  * -> RENDERING: rendering a scene.
  * -> DONE: completed rendering a scene.
  */
-RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
-                       size_t max_ray_depth, size_t ns_area_light,
-                       size_t ns_diff, size_t ns_glsy, size_t ns_refr,
-                       size_t num_threads,
-                       size_t samples_per_batch,
-                       float max_tolerance,
-                       HDRImageBuffer* envmap,
-                       bool direct_hemisphere_sample,
-                       string filename,
-                       double lensRadius,
-                       double focalDistance) {
+RaytracedRenderer::RaytracedRenderer(const RaytracedRendererOptions& options) {
   state = INIT;
 
   pt = new PathTracer();
 
-  pt->ns_aa = ns_aa;                                        // Number of samples per pixel
-  pt->max_ray_depth = max_ray_depth;                        // Maximum recursion ray depth
-  pt->ns_area_light = ns_area_light;                        // Number of samples for area light
-  pt->ns_diff = ns_diff;                                    // Number of samples for diffuse surface
-  pt->ns_glsy = ns_diff;                                    // Number of samples for glossy surface
-  pt->ns_refr = ns_refr;                                    // Number of samples for refraction
-  pt->samplesPerBatch = samples_per_batch;                  // Number of samples per batch
-  pt->maxTolerance = max_tolerance;                         // Maximum tolerance for early termination
-  pt->direct_hemisphere_sample = direct_hemisphere_sample;  // Whether to use direct hemisphere sampling vs. Importance Sampling
-
-  this->lensRadius = lensRadius;
-  this->focalDistance = focalDistance;
-
-  this->filename = filename;
-
-  if (envmap) {
-    pt->envLight = new EnvironmentLight(envmap);
+  pt->ns_aa = options.ns_aa;                                        // Number of samples per pixel
+  pt->max_ray_depth = options.max_ray_depth;                        // Maximum recursion ray depth
+  pt->ns_area_light = options.ns_area_light;                        // Number of samples for area light
+  pt->ns_diff = options.ns_diff;                                    // Number of samples for diffuse surface
+  pt->ns_glsy = options.ns_glsy;                                    // Number of samples for glossy surface
+  pt->ns_refr = options.ns_refr;                                    // Number of samples for refraction
+  pt->samplesPerBatch = options.samples_per_batch;                  // Number of samples per batch
+  pt->maxTolerance = options.max_tolerance;                         // Maximum tolerance for early termination
+  pt->direct_hemisphere_sample = options.direct_hemisphere_sample;  // Whether to use direct hemisphere sampling vs. Importance Sampling
+  pt->wavefront = options.wavefront;                                // Whether to render tiles with the wavefront integrator
+  pt->seed = options.seed;                                          // Seed of the random numbers
+  pt->sequence = options.sample_sequence;                           // Sequence the samplers draw from
+
+  lensRadius = options.lensRadius;
+  focalDistance = options.focalDistance;
+  exactLens = options.exact_lens;
+  lensFile = options.lens_file;
+  autoFocus = options.autofocus;
+
+  bvhWidth = options.bvh_width == 4 ? SceneObjects::BVH4 : SceneObjects::BVH2;
+  bvhCache = options.bvh_cache;
+  progressiveSamples = options.progressive_samples;
+  timeBudget = options.time_budget;
+  sampleBudget = options.sample_budget;
+  budgetSamples = 0;
+  passesDone = 0;
+  workersWaiting = 0;
+
+  filename = options.filename;
+
+  if (options.envmap) {
+    pt->envLight = new EnvironmentLight(options.envmap);
   } else {
     pt->envLight = NULL;
   }
 
   bvh = NULL;
+  lightSampler = NULL;
   scene = NULL;
   camera = NULL;
 
   show_rays = true;
 
   imageTileSize = 32;                     // Size of the rendering tile.
-  numWorkerThreads = num_threads;         // Number of threads
-  workerThreads.resize(numWorkerThreads);
+  tileSize = imageTileSize;
+  numWorkerThreads = options.num_threads; // Number of threads
+  // the thread that starts a render only waits, the pool adds one worker
+  // per render thread on top of it
+  workerPool = new ThreadPool(numWorkerThreads + 1);
 }
 
 /**
@@ -90,7 +113,13 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
  */
 RaytracedRenderer::~RaytracedRenderer() {
 
+  continueRaytracing = false;
+  wait_for_workers();
+  delete workerPool;
+
   delete bvh;
+  delete lightSampler;
+  delete scene;
   delete pt;
 
 }
@@ -109,11 +138,14 @@ void RaytracedRenderer::set_scene(Scene *scene) {
   }
 
   if (this->scene != nullptr) {
-    delete scene;
+    delete this->scene;
     delete bvh;
+    delete lightSampler;
     selectionHistory.pop();
   }
 
+  // emissive surfaces are lights too, the environment comes last
+  scene->add_emissive_lights();
   if (pt->envLight != nullptr) {
     scene->lights.push_back(pt->envLight);
   }
@@ -140,6 +172,8 @@ void RaytracedRenderer::set_camera(Camera *camera) {
 
   camera->focalDistance = focalDistance;
   camera->lensRadius = lensRadius;
+  camera->exact_lens = exactLens;
+  camera->lens_file = lensFile;
   this->camera = camera;
 
   if (has_valid_configuration()) {
@@ -235,10 +269,7 @@ void RaytracedRenderer::stop() {
     case RENDERING:
       continueRaytracing = false;
     case DONE:
-      for (int i=0; i<numWorkerThreads; i++) {
-            workerThreads[i]->join();
-            delete workerThreads[i];
-        }
+      wait_for_workers();
       state = READY;
       break;
   }
@@ -251,6 +282,10 @@ void RaytracedRenderer::clear() {
   if (state != READY) return;
   delete bvh;
   bvh = NULL;
+  delete lightSampler;
+  lightSampler = NULL;
+  focusMap = FocusMap();
+  delete scene;
   scene = NULL;
   camera = NULL;
   selectionHistory.pop();
@@ -298,28 +333,35 @@ void RaytracedRenderer::start_raytracing() {
   pt->set_frame_size(width, height);
 
   pt->bvh = bvh;
+  pt->lightSampler = lightSampler;
   pt->camera = camera;
   pt->scene = scene;
 
+  vector<WorkItem> tiles;
   if (!render_cell) { // entrie pic
-    num_tiles_w = width / imageTileSize + 1;
-    num_tiles_h = height / imageTileSize + 1;
-    tilesTotal = num_tiles_w * num_tiles_h;
+    // a sample budget goes where the noise is, which smaller tiles follow
+    // more closely
+    tileSize = sampleBudget > 0 && progressiveSamples > 0 ? imageTileSize / 4 : imageTileSize;
+    num_tiles_w = width / tileSize + 1;
+    num_tiles_h = height / tileSize + 1;
     tilesDone = 0;
     tile_samples.resize(num_tiles_w * num_tiles_h);
     memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
 
     // populate the tile work queue
-    for (size_t y = 0; y < height; y += imageTileSize) {
-        for (size_t x = 0; x < width; x += imageTileSize) {
-            workQueue.put_work(WorkItem(x, y, imageTileSize, imageTileSize));
+    for (size_t y = 0; y < height; y += tileSize) {
+        for (size_t x = 0; x < width; x += tileSize) {
+            tiles.push_back(WorkItem(x, y, tileSize, tileSize, progressiveSamples));
         }
     }
+    tilesTotal = tiles.size();
+    queue_tiles(tiles);
       
   } else { // selected area
     int w = (cell_br-cell_tl).x;
     int h = (cell_br-cell_tl).y;
     int imTS = imageTileSize / 4;
+    tileSize = imTS;
     num_tiles_w = w / imTS + 1;
     num_tiles_h = h / imTS + 1;
     tilesTotal = num_tiles_w * num_tiles_h;
@@ -330,98 +372,280 @@ void RaytracedRenderer::start_raytracing() {
     // populate the tile work queue
     for (size_t y = cell_tl.y; y < cell_br.y; y += imTS) {
       for (size_t x = cell_tl.x; x < cell_br.x; x += imTS) {
-        workQueue.put_work(WorkItem(x, y, 
-          min(imTS, (int)(cell_br.x-x)), min(imTS, (int)(cell_br.y-y)) ));
+        tiles.push_back(WorkItem(x, y, 
+          min(imTS, (int)(cell_br.x-x)), min(imTS, (int)(cell_br.y-y)), progressiveSamples));
       }
     }
+    queue_tiles(tiles);
+  }
+
+  // the sample budget covers the pixels of the tiles, it only steers
+  // progressive passes
+  budgetSamples = 0;
+  if (sampleBudget > 0 && progressiveSamples > 0) {
+    for (const WorkItem& t : tiles) {
+      budgetSamples += sampleBudget * (min(t.tile_x + t.tile_w, (int)width) - t.tile_x) *
+                       (min(t.tile_y + t.tile_h, (int)height) - t.tile_y);
+    }
   }
 
   bvh->total_isects = 0; bvh->total_rays = 0;
   // launch threads
   fprintf(stdout, "[PathTracer] Rendering... "); fflush(stdout);
-  for (int i=0; i<numWorkerThreads; i++) {
-      workerThreads[i] = new std::thread(&RaytracedRenderer::worker_thread, this);
-  }
+  launch_workers();
 }
 void RaytracedRenderer::cd_autofocus() {
-    fprintf(stdout, "[PathTracer] Start autofocusing ");
-    float fd = -3;
-    float bestFocalDistance = fd;
-    float best_sharpness = 0;
-    size_t width = frameBuffer.w;
-    size_t height = frameBuffer.h;
-    
-    for(int i = -3; i < 4; i ++) {
-        
-        pt->camera->focalDistance = fd + 0.05 * i;
-        
-        unique_lock<std::mutex> lk(m_done);
-        
-        frameBuffer.clear();
-        num_tiles_w = width / imageTileSize + 1;
-        num_tiles_h = height / imageTileSize + 1;
-        tilesTotal = num_tiles_w * num_tiles_h;
-        tilesDone = 0;
-        tile_samples.resize(num_tiles_w * num_tiles_h);
-        memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
-
-        // populate the tile work queue
-        for (size_t y = height/5*2; y < height/5*3; y += imageTileSize) {
-            for (size_t x = width/5*2; x < width/5*3; x += imageTileSize) {
-                workQueue.put_work(WorkItem(x, y, imageTileSize, imageTileSize));
-            }
-        }
-        
-        bvh->total_isects = 0; bvh->total_rays = 0;
-        // launch threads
-        fprintf(stdout, "[PathTracer] Rendering... "); fflush(stdout);
-        for (int i=0; i<numWorkerThreads; i++) {
-            workerThreads[i] = new std::thread(&RaytracedRenderer::worker_thread, this);
-        }
-        
-        cv_done.wait(lk, [this]{ return state == DONE; });
-        lk.unlock();
-        
-        float max = 0;
-        float min = 100;
-        for (size_t y = height/5*2; y < height/5*3; y += imageTileSize) {
-            for (size_t x = width/5*2; x < width/5*3; x += imageTileSize) {
-                float value = frameBuffer.greyscale[x + y * frameBuffer.w];
-                fprintf(stdout, "value is  %g", value);
-                
-                if(value > max) max = value;
-                if(value < min) min = value;
-            }
-        }
-        fprintf(stdout, "max is  %g, min is %g", max, min);
-        float sharpness = (max - min) / (max + min);
-        fprintf(stdout, "[PathTracer] Sharpness of focalDistance is %g", sharpness);
+  if (!has_valid_configuration()) return;
+  if (camera->lensRadius <= 0) {
+    fprintf(stdout, "[PathTracer] Nothing to focus, the aperture is closed\n");
+    return;
+  }
+  fprintf(stdout, "[PathTracer] Autofocusing... "); fflush(stdout);
+  Timer focusTimer;
+  focusTimer.start();
 
-        if(sharpness > best_sharpness) {
-            bestFocalDistance = pt->camera->focalDistance;
-        }
+  // probes are rendered straight on the pool, outside of the tile queue,
+  // with direct lighting only, which shows the edges just as well
+  stop();
+  pt->bvh = bvh;
+  pt->lightSampler = lightSampler;
+  pt->camera = camera;
+  pt->scene = scene;
+  camera->place_zoom_lens();
+  update_focus_map();
+  const FocusCalibration& cal = camera->zoom_lens_focus_calibration();
+  double near_focus = cal.near_focus, far_focus = cal.far_focus;
+  size_t max_ray_depth = pt->max_ray_depth;
+  pt->max_ray_depth = min(max_ray_depth, AF_RAY_DEPTH);
+  // every probe takes all of its samples, whatever the render settings;
+  // a negative tolerance never passes the adaptive sampling test
+  size_t ns_aa = pt->ns_aa;
+  double max_tolerance = pt->maxTolerance;
+  pt->ns_aa = AF_SAMPLES;
+  pt->maxTolerance = -1;
+  double aperture = camera->lensRadius;
+
+  size_t x0, y0, x1, y1;
+  autofocus_patch(&x0, &y0, &x1, &y1);
+  size_t probes = 0;
+  auto sharpness = [&](double focal_distance) {
+    probes++;
+    return focus_probe(focal_distance, x0, y0, x1, y1);
+  };
+
+  // depths of the tiles of the focus map that the patch overlaps
+  const size_t tile = FocusMap::TILE_SIZE;
+  std::vector<double> depths;
+  double nearest = INF_D, farthest = 0;
+  for (size_t ty = y0 / tile; ty * tile < y1; ty++) {
+    for (size_t tx = x0 / tile; tx * tile < x1; tx++) {
+      size_t i = ty * focusMap.tiles_w + tx;
+      if (focusMap.nearest[i] == INF_D) continue;
+      depths.push_back(focusMap.depth[i]);
+      nearest = min(nearest, focusMap.nearest[i]);
+      farthest = max(farthest, focusMap.farthest[i]);
     }
-    
-    camera->focalDistance = bestFocalDistance;
-//    start_raytracing();
-    ////
-    num_tiles_w = width / imageTileSize + 1;
-    num_tiles_h = height / imageTileSize + 1;
-    tilesTotal = num_tiles_w * num_tiles_h;
-    tilesDone = 0;
-    tile_samples.resize(num_tiles_w * num_tiles_h);
-    memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
+  }
 
-    // populate the tile work queue
-    for (size_t y = 0; y < height; y += imageTileSize) {
-        for (size_t x = 0; x < width; x += imageTileSize) {
-            workQueue.put_work(WorkItem(x, y, imageTileSize, imageTileSize));
+  // x is the sharpest probe so far, w the second and v the third
+  // sharpest, within the bracket [a, b] of the sharpest focal distance
+  double x, w, v, fx, fw, fv, a, b;
+  size_t max_probes;
+  if (!depths.empty()) {
+    // the depths the patch sees bracket its focus, start from the median
+    // one and leave the rest to the refinement
+    std::nth_element(depths.begin(), depths.begin() + depths.size() / 2, depths.end());
+    a = max(cal.focus_for_depth(nearest) - AF_DEPTH_MARGIN, near_focus);
+    b = min(cal.focus_for_depth(farthest) + AF_DEPTH_MARGIN, far_focus);
+    x = w = v = cal.focus_for_depth(depths[depths.size() / 2]);
+    fx = fw = fv = sharpness(x);
+    max_probes = AF_REFINE_PROBES;
+  } else {
+    // nothing to go by, search coarse to fine. Stopping the lens down
+    // widens the peak of the sharpness, so first scan the whole range with
+    // the lens stopped down, then open it up step by step around the
+    // sharpest probe while halving the spacing of the probes. Sharpness is
+    // only compared between probes of the same aperture.
+    double step = (far_focus - near_focus) / (AF_COARSE_PROBES - 1);
+    camera->lensRadius = aperture / (1 << AF_APERTURE_STEPS);
+    double fs[AF_COARSE_PROBES];
+    size_t best = 0;
+    for (size_t i = 0; i < AF_COARSE_PROBES; i++) {
+      fs[i] = sharpness(near_focus + step * i);
+      if (fs[i] > fs[best]) best = i;
+    }
+    size_t left = best > 0 ? best - 1 : best, right = best + 1 < AF_COARSE_PROBES ? best + 1 : best;
+    x = near_focus + step * best; fx = fs[best];
+    double lo = near_focus + step * left, flo = fs[left];
+    double hi = near_focus + step * right, fhi = fs[right];
+
+    // x is the sharpest of the probes lo, x and hi, which are step apart
+    // unless at an end; w is the better and v the worse of its neighbors
+    for (int level = AF_APERTURE_STEPS; level >= 0; level--) {
+      if (level < AF_APERTURE_STEPS) {
+        camera->lensRadius = aperture / (1 << level);
+        step /= 2;
+        fx = sharpness(x);
+        lo = max(x - step, near_focus); flo = sharpness(lo);
+        hi = min(x + step, far_focus); fhi = sharpness(hi);
+      }
+
+      // follow the sharpness while it rises towards an end
+      while (probes < AF_MAX_PROBES && (flo > fx || fhi > fx)) {
+        if (flo > fx && lo > near_focus) {
+          hi = x; fhi = fx;
+          x = lo; fx = flo;
+          lo = max(x - step, near_focus); flo = sharpness(lo);
+        } else if (fhi > fx && hi < far_focus) {
+          lo = x; flo = fx;
+          x = hi; fx = fhi;
+          hi = min(x + step, far_focus); fhi = sharpness(hi);
+        } else {
+          break;
         }
+      }
+      if (flo > fx) {
+        std::swap(x, lo);
+        std::swap(fx, flo);
+      } else if (fhi > fx) {
+        std::swap(x, hi);
+        std::swap(fx, fhi);
+      }
+      w = flo >= fhi ? lo : hi;
+      fw = max(flo, fhi);
+      v = flo >= fhi ? hi : lo;
+      fv = min(flo, fhi);
     }
-    
+    a = min(x, min(w, v));
+    b = max(x, max(w, v));
+    max_probes = AF_MAX_PROBES;
+  }
+
+  // refine at full aperture by Brent's method: fit a parabola through the
+  // three sharpest probes so far, fall back to golden section steps when
+  // the fit lands badly or does not shrink the bracket
+  const double golden = 0.3819660, tol = 0.1 * AF_TOLERANCE;
+  double d = 0, e = b - a;
+  while (b - a > AF_TOLERANCE && probes < max_probes) {
+    double xm = 0.5 * (a + b);
+    bool parabolic = false;
+    if (fabs(e) > tol && x != w && x != v && w != v) {
+      double r = (x - w) * (fx - fv), q = (x - v) * (fx - fw);
+      double p = (x - v) * q - (x - w) * r;
+      q = 2 * (q - r);
+      if (q < 0) p = -p;
+      q = fabs(q);
+      double last = e;
+      if (fabs(p) < fabs(0.5 * q * last) && p > q * (a - x) && p < q * (b - x)) {
+        e = d;
+        d = p / q;
+        double u = x + d;
+        if (u - a < 2 * tol || b - u < 2 * tol) d = xm >= x ? tol : -tol;
+        parabolic = true;
+      }
+    }
+    if (!parabolic) {
+      e = x >= xm ? a - x : b - x;
+      d = golden * e;
+    }
+    double u = fabs(d) >= tol ? x + d : x + (d >= 0 ? tol : -tol);
+    double fu = sharpness(u);
+    if (fu >= fx) {
+      if (u >= x) a = x; else b = x;
+      v = w; fv = fw;
+      w = x; fw = fx;
+      x = u; fx = fu;
+    } else {
+      if (u < x) a = u; else b = u;
+      if (fu >= fw || w == x) {
+        v = w; fv = fw;
+        w = u; fw = fu;
+      } else if (fu >= fv || v == x || v == w) {
+        v = u; fv = fu;
+      }
+    }
+  }
+
+  // the probes traced the lens exactly, start_raytracing bakes for the
+  // final focus
+  camera->lensRadius = aperture;
+  camera->focalDistance = x;
+  camera->discard_zoom_lens_bake();
+  pt->max_ray_depth = max_ray_depth;
+  pt->ns_aa = ns_aa;
+  pt->maxTolerance = max_tolerance;
+  pt->reset_accumulation();
+
+  focusTimer.stop();
+  fprintf(stdout, "Done! (%.4f sec)\n", focusTimer.duration());
+  fprintf(stdout, "[PathTracer] Focal distance %g after %lu probes\n", x, probes);
 }
+
+void RaytracedRenderer::autofocus_patch(size_t *x0, size_t *y0, size_t *x1, size_t *y1) const {
+  size_t size = min(AF_PATCH_SIZE, min(frame_w, frame_h));
+  *x0 = (frame_w - size) / 2;
+  *y0 = (frame_h - size) / 2;
+  *x1 = *x0 + size;
+  *y1 = *y0 + size;
+}
+
+double RaytracedRenderer::focus_probe(double focal_distance,
+                                      size_t x0, size_t y0, size_t x1, size_t y1) {
+  camera->focalDistance = focal_distance;
+  camera->discard_zoom_lens_bake();
+
+  // illuminance of the patch from two independent halves of a few
+  // samples per pixel; a pixel draws the same numbers for every probe, so
+  // the noise barely changes between them
+  size_t w = x1 - x0, h = y1 - y0;
+  std::vector<double> lum[2] = {std::vector<double>(w * h), std::vector<double>(w * h)};
+  workerPool->parallel_for(y0, y1, h, [&](size_t begin, size_t end, size_t) {
+    for (size_t y = begin; y < end; y++) {
+      for (size_t x = x0; x < x1; x++) {
+        PixelAccumulator acc;
+        pt->add_pixel_samples(acc, x, y, AF_SAMPLES / 2);
+        Vector3D first = acc.radiance;
+        size_t half = acc.count - acc.blocked;
+        pt->add_pixel_samples(acc, x, y, AF_SAMPLES / 2);
+        size_t i = (y - y0) * w + x - x0;
+        size_t through = acc.count - acc.blocked;
+        lum[0][i] = half ? first.illum() / half : 0;
+        lum[1][i] = through > half ? (acc.radiance - first).illum() / (through - half) : 0;
+      }
+    }
+  });
+
+  double mean = 0;
+  for (size_t i = 0; i < w * h; i++) mean += lum[0][i] + lum[1][i];
+  mean /= 2 * w * h;
+  if (mean <= 0 || w < 3 || h < 3) return 0;
+
+  // gradient energy of the patch, after compressing the illuminance
+  // relative to its mean so the measure ignores exposure and fireflies.
+  // The noise of the halves is independent, so the product of their
+  // gradients estimates the squared gradient of the noise free patch; the
+  // square of either would be swamped by the noise of a defocused patch.
+  for (std::vector<double>& half : lum) {
+    for (double& l : half) l = l / (l + mean);
+  }
+  double energy = 0;
+  for (size_t y = 1; y + 1 < h; y++) {
+    for (size_t x = 1; x + 1 < w; x++) {
+      double g[2][2];
+      for (int k = 0; k < 2; k++) {
+        const std::vector<double>& l = lum[k];
+        g[k][0] = l[y * w + x + 1] - l[y * w + x - 1];
+        g[k][1] = l[(y + 1) * w + x] - l[(y - 1) * w + x];
+      }
+      energy += g[0][0] * g[1][0] + g[0][1] * g[1][1];
+    }
+  }
+  return energy / ((w - 2) * (h - 2));
+}
+
 void RaytracedRenderer::render_to_file(string filename, size_t x, size_t y, size_t dx, size_t dy) {
   if (x == -1) {
+    if (autoFocus) cd_autofocus();
     unique_lock<std::mutex> lk(m_done);
     start_raytracing();
     cv_done.wait(lk, [this]{ return state == DONE; });
@@ -446,7 +670,18 @@ void RaytracedRenderer::build_accel() {
   fprintf(stdout, "[PathTracer] Collecting primitives... "); fflush(stdout);
   timer.start();
   vector<Primitive *> primitives;
+  vector<const SceneObjects::Mesh *> meshes;
+  size_t num_triangles = 0, mesh_bytes = 0;
   for (SceneObject *obj : scene->objects) {
+    // meshes stay in their indexed triangle store, the BVH references
+    // their triangles by index rather than as Triangle primitives
+    const SceneObjects::Mesh *mesh = dynamic_cast<const SceneObjects::Mesh *>(obj);
+    if (mesh) {
+      meshes.push_back(mesh);
+      num_triangles += mesh->num_triangles();
+      mesh_bytes += mesh->get_memory_usage();
+      continue;
+    }
     const vector<Primitive *> &obj_prims = obj->get_primitives();
     primitives.reserve(primitives.size() + obj_prims.size());
     primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
@@ -455,12 +690,29 @@ void RaytracedRenderer::build_accel() {
   fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
 
   // build BVH //
-  fprintf(stdout, "[PathTracer] Building BVH from %lu primitives... ", primitives.size()); 
+  fprintf(stdout, "[PathTracer] Building BVH%d from %lu primitives on %lu threads... ",
+          (int)bvhWidth, primitives.size() + num_triangles, workerPool->size());
   fflush(stdout);
   timer.start();
-  bvh = new BVHAccel(primitives);
+  bvh = new BVHAccel(primitives, meshes, 4, SceneObjects::SPLIT_SAH, bvhWidth,
+                     workerPool, bvhCache);
+  focusMap = FocusMap();
   timer.stop();
-  fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+  fprintf(stdout, "Done! (%.4f sec%s)\n", timer.duration(),
+          bvh->loaded_from_cache() ? ", loaded from cache" : "");
+
+  if (num_triangles > 0) {
+    // shared vertex data and index triples, plus one BVH leaf reference
+    double bytes = mesh_bytes + num_triangles * sizeof(SceneObjects::BVHPrimitiveRef);
+    fprintf(stdout, "[PathTracer] Mesh storage: %lu triangles, %.1f bytes per triangle\n",
+            num_triangles, bytes / num_triangles);
+  }
+
+  // light sampler, over the bounds of the scene for the infinite lights //
+  BBox bounds = bvh->get_bbox();
+  lightSampler = new LightSampler(scene->lights, 0.5 * bounds.extent.norm());
+  fprintf(stdout, "[PathTracer] Sampling %lu lights by power%s\n", scene->lights.size(),
+          lightSampler->uses_bvh() ? " and a light BVH" : "");
 
   // initial visualization //
   selectionHistory.push(bvh->get_root());
@@ -616,14 +868,14 @@ void RaytracedRenderer::visualize_af() const {
   glDisable(GL_DEPTH_TEST);
   glDisable(GL_LIGHTING);
     glLineWidth(20);
-  // Draw the Red Rectangle.
+  // Draw the Red Rectangle around the probed patch.
+  size_t x0, y0, x1, y1;
+  autofocus_patch(&x0, &y0, &x1, &y1);
   glBegin(GL_LINE_LOOP);
-  float width_offset = abs(cell_tl.x - cell_br.x) / 5;
-  float height_offset = abs((frameBuffer.h-cell_br.y) - (frameBuffer.h-cell_tl.y)) / 5;
-    glVertex2f(width_offset*2, height_offset*3);
-    glVertex2f(width_offset*3, height_offset*3);
-    glVertex2f(width_offset*3, height_offset*2);
-    glVertex2f(width_offset*2, height_offset*2);
+  glVertex2f(x0, frameBuffer.h - y1);
+  glVertex2f(x1, frameBuffer.h - y1);
+  glVertex2f(x1, frameBuffer.h - y0);
+  glVertex2f(x0, frameBuffer.h - y0);
   glEnd();
 
   glMatrixMode(GL_PROJECTION);
@@ -759,8 +1011,8 @@ void RaytracedRenderer::key_press(int key) {
  * Raytrace a tile of the scene and update the frame buffer. Is run
  * in a worker thread.
  */
-void RaytracedRenderer::raytrace_tile(int tile_x, int tile_y,
-                               int tile_w, int tile_h) {
+bool RaytracedRenderer::raytrace_tile(int tile_x, int tile_y,
+                               int tile_w, int tile_h, int num_samples) {
   size_t w = frame_w;
   size_t h = frame_h;
 
@@ -770,20 +1022,32 @@ void RaytracedRenderer::raytrace_tile(int tile_x, int tile_y,
   size_t tile_end_x = std::min(tile_start_x + tile_w, w);
   size_t tile_end_y = std::min(tile_start_y + tile_h, h);
 
-  size_t tile_idx_x = tile_x / imageTileSize;
-  size_t tile_idx_y = tile_y / imageTileSize;
+  // tiles of a selected area start at its corner
+  size_t tile_idx_x = (tile_x - (render_cell ? (int)cell_tl.x : 0)) / tileSize;
+  size_t tile_idx_y = (tile_y - (render_cell ? (int)cell_tl.y : 0)) / tileSize;
   size_t num_samples_tile = tile_samples[tile_idx_x + tile_idx_y * num_tiles_w];
 
-  for (size_t y = tile_start_y; y < tile_end_y; y++) {
-    if (!continueRaytracing) return;
-    for (size_t x = tile_start_x; x < tile_end_x; x++) {
-      pt->raytrace_pixel(x, y);
+  bool active = false;
+  if (progressiveSamples > 0) {
+    if (!continueRaytracing) return false;
+    active = pt->raytrace_tile_progressive(tile_start_x, tile_start_y, tile_end_x, tile_end_y,
+                                           num_samples);
+  } else if (pt->wavefront) {
+    if (!continueRaytracing) return false;
+    pt->raytrace_tile_wavefront(tile_start_x, tile_start_y, tile_end_x, tile_end_y);
+  } else {
+    for (size_t y = tile_start_y; y < tile_end_y; y++) {
+      if (!continueRaytracing) return false;
+      for (size_t x = tile_start_x; x < tile_end_x; x++) {
+        pt->raytrace_pixel(x, y);
+      }
     }
   }
 
   tile_samples[tile_idx_x + tile_idx_y * num_tiles_w] += 1;
 
   pt->write_to_framebuffer(frameBuffer, tile_start_x, tile_start_y, tile_end_x, tile_end_y);
+  return active;
 }
 
 void RaytracedRenderer::raytrace_cell(ImageBuffer& buffer) {
@@ -816,7 +1080,62 @@ void RaytracedRenderer::raytrace_cell(ImageBuffer& buffer) {
 }
 
 void RaytracedRenderer::autofocus(Vector2D loc) {
-  pt->autofocus(loc);
+  if (!has_valid_configuration()) return;
+  Timer focusTimer;
+  focusTimer.start();
+
+  stop();
+  camera->place_zoom_lens();
+  update_focus_map();
+  size_t tile = FocusMap::TILE_SIZE;
+  size_t tx = min((size_t)max(loc.x, 0.) / tile, focusMap.tiles_w - 1);
+  size_t ty = min((size_t)max(loc.y, 0.) / tile, focusMap.tiles_h - 1);
+  double depth = focusMap.depth[ty * focusMap.tiles_w + tx];
+  camera->focalDistance = camera->zoom_lens_focus_calibration().focus_for_depth(depth);
+
+  focusTimer.stop();
+  fprintf(stdout, "[PathTracer] Focal distance %g for depth %g (%.1f usec)\n",
+          camera->focalDistance, depth, 1e6 * focusTimer.duration());
+}
+
+void RaytracedRenderer::update_focus_map() {
+  Vector3D pos = camera->position(), target = camera->view_point(), up = camera->up_dir();
+  double placement[13] = {pos.x, pos.y, pos.z, target.x, target.y, target.z,
+                          up.x, up.y, up.z, camera->v_fov(), camera->aspect_ratio(),
+                          (double)frame_w, (double)frame_h};
+  if (!focusMap.empty() && std::equal(placement, placement + 13, focusMap.placement)) return;
+
+  // a grid of pinhole rays per tile; the lens images the same view, and
+  // the depth along the view direction is what the lens focuses by
+  const size_t tile = FocusMap::TILE_SIZE, n = FocusMap::TILE_RAYS;
+  FocusMap &map = focusMap;
+  map.tiles_w = (frame_w + tile - 1) / tile;
+  map.tiles_h = (frame_h + tile - 1) / tile;
+  map.depth.assign(map.tiles_w * map.tiles_h, INF_D);
+  map.nearest.assign(map.tiles_w * map.tiles_h, INF_D);
+  map.farthest.assign(map.tiles_w * map.tiles_h, INF_D);
+  Vector3D forward = (target - pos).unit();
+  workerPool->parallel_for(0, map.tiles_h, map.tiles_h, [&](size_t begin, size_t end, size_t) {
+    double depths[n * n];
+    for (size_t ty = begin; ty < end; ty++) {
+      for (size_t tx = 0; tx < map.tiles_w; tx++) {
+        size_t x0 = tx * tile, y0 = ty * tile;
+        double w = min(tile, frame_w - x0), h = min(tile, frame_h - y0);
+        for (size_t k = 0; k < n * n; k++) {
+          Ray r = camera->generate_ray((x0 + (k % n + 0.5) * w / n) / frame_w,
+                                       (y0 + (k / n + 0.5) * h / n) / frame_h);
+          Intersection isect;
+          depths[k] = bvh->intersect(r, &isect) ? isect.t * dot(r.d, forward) : INF_D;
+        }
+        std::sort(depths, depths + n * n);
+        size_t i = ty * map.tiles_w + tx;
+        map.depth[i] = depths[n * n / 2];
+        map.nearest[i] = depths[0];
+        map.farthest[i] = depths[n * n - 1];
+      }
+    }
+  });
+  std::copy(placement, placement + 13, map.placement);
 }
 
 //double RaytracedRenderer::cd_autofocus(ImageBuffer &framebuffer, Vector2D tl, Vector2D br) {
@@ -824,21 +1143,179 @@ void RaytracedRenderer::autofocus(Vector2D loc) {
 //}
 
 
-void RaytracedRenderer::worker_thread() {
+void RaytracedRenderer::queue_tiles(vector<WorkItem>& tiles) {
+  if (tiles.empty()) {
+    workQueue.clear();
+    return;
+  }
+
+  double x0 = tiles[0].tile_x, y0 = tiles[0].tile_y, x1 = x0, y1 = y0;
+  for (const WorkItem& t : tiles) {
+    x0 = min(x0, (double)t.tile_x);
+    y0 = min(y0, (double)t.tile_y);
+    x1 = max(x1, (double)(t.tile_x + t.tile_w));
+    y1 = max(y1, (double)(t.tile_y + t.tile_h));
+  }
+  double cx = (x0 + x1) / 2, cy = (y0 + y1) / 2;
+  double size = max(tiles[0].tile_w, tiles[0].tile_h);
+
+  // ring of the tile around the center, then angle within the ring
+  auto spiral_key = [=](const WorkItem& t) {
+    double dx = t.tile_x + t.tile_w / 2.0 - cx;
+    double dy = t.tile_y + t.tile_h / 2.0 - cy;
+    int ring = (int)floor(max(fabs(dx), fabs(dy)) / size + 0.5);
+    return make_pair(ring, atan2(dy, dx));
+  };
+  stable_sort(tiles.begin(), tiles.end(),
+              [&](const WorkItem& a, const WorkItem& b) {
+                return spiral_key(a) < spiral_key(b);
+              });
+
+  workQueue.reset(numWorkerThreads, tiles);
+}
+
+bool RaytracedRenderer::next_pass() {
+  unique_lock<std::mutex> lk(m_done);
+  size_t pass = passesDone;
+  if (++workersWaiting < numWorkerThreads) {
+    cv_pass.wait(lk, [&]{ return passesDone != pass; });
+    return passContinues;
+  }
+
+  // last worker of the pass, nobody takes work from the queue right now
+  workersWaiting = 0;
+  passesDone++;
+  passTimer.stop();
+  passContinues = continueRaytracing && !activeTiles.empty() &&
+                  (timeBudget <= 0 || passTimer.duration() < timeBudget);
+  size_t queued = activeTiles.size();
+  if (passContinues && sampleBudget > 0) {
+    queued = budget_pass(activeTiles);
+    passContinues = queued > 0;
+  }
+  fprintf(stdout, "\r[PathTracer] Pass %lu done after %.2fs, %lu tiles need more samples\n",
+          passesDone, passTimer.duration(), passContinues ? queued : 0);
+  if (passContinues) {
+    // tiles left out of a budgeted pass wait for the next one
+    tilesDone = 0;
+    tilesTotal = queued;
+    vector<WorkItem> tiles(activeTiles.begin(), activeTiles.begin() + queued);
+    activeTiles.erase(activeTiles.begin(), activeTiles.begin() + queued);
+    queue_tiles(tiles);
+  } else if (sampleBudget > 0) {
+    size_t spent = 0;
+    for (int count : pt->sampleCountBuffer) spent += count;
+    fprintf(stdout, "[PathTracer] Spent %lu of a budget of %lu samples\n", spent, budgetSamples);
+  }
+  cv_pass.notify_all();
+  return passContinues;
+}
+
+size_t RaytracedRenderer::budget_pass(vector<WorkItem>& tiles) {
+  size_t spent = 0;
+  for (int count : pt->sampleCountBuffer) spent += count;
+  if (spent >= budgetSamples) return 0;
+
+  // spread of a pixel's samples on screen, half the range the tone curve
+  // maps one standard deviation either side of the mean to; it follows the
+  // slope of the curve without blowing up at black or past white
+  double exposure = sqrt(pow(2, pt->tm_level)), one_over_gamma = 1.0 / pt->tm_gamma;
+  auto tone = [&](double l) { return min(pow(exposure * max(l, 0.), one_over_gamma), 1.); };
+
+  // pixels of each tile that still need samples, with their mean sample
+  // count and mean squared on screen spread
+  struct TileError { double pixels, count, spread2; };
+  vector<TileError> errors(tiles.size());
+  double pixels = 0;
+  for (size_t t = 0; t < tiles.size(); t++) {
+    const WorkItem& tile = tiles[t];
+    TileError e = {0, 0, 0};
+    size_t x1 = min((size_t)(tile.tile_x + tile.tile_w), frame_w);
+    size_t y1 = min((size_t)(tile.tile_y + tile.tile_h), frame_h);
+    for (size_t y = tile.tile_y; y < y1; y++) {
+      for (size_t x = tile.tile_x; x < x1; x++) {
+        const PixelAccumulator& acc = pt->accumBuffer[x + y * frame_w];
+        if (acc.converged || acc.count >= pt->ns_aa) continue;
+        e.pixels++;
+        e.count += acc.count;
+        // without a variance yet, assume the widest spread there is
+        double spread = 0.5;
+        if (acc.count - acc.blocked >= 2) {
+          double n = acc.count - acc.blocked, mean = acc.s1 / n;
+          double sd = sqrt(max(0., (acc.s2 - acc.s1 * mean) / (n - 1)));
+          spread = 0.5 * (tone(mean + sd) - tone(mean - sd));
+        }
+        e.spread2 += spread * spread;
+      }
+    }
+    if (e.pixels > 0) {
+      e.count /= e.pixels;
+      e.spread2 /= e.pixels;
+    }
+    errors[t] = e;
+    pixels += e.pixels;
+  }
+
+  // a tile should end up with lambda * spread samples per pixel, at least
+  // what it has and at most ns_aa; find the lambda that spends the samples
+  // of the pass, progressiveSamples per pixel that needs any
+  double budget = min((double)(budgetSamples - spent), progressiveSamples * pixels);
+  auto target = [&](const TileError& e, double lambda) {
+    return max(e.count, min(lambda * sqrt(e.spread2), (double)pt->ns_aa));
+  };
+  auto spend = [&](double lambda) {
+    double total = 0;
+    for (const TileError& e : errors) total += e.pixels * (target(e, lambda) - e.count);
+    return total;
+  };
+  double lo = 0, hi = 1;
+  while (spend(hi) < budget && hi < 1e12) hi *= 2;
+  for (int i = 0; i < 60; i++) {
+    double mid = 0.5 * (lo + hi);
+    if (spend(mid) < budget) lo = mid; else hi = mid;
+  }
+  for (size_t t = 0; t < tiles.size(); t++) {
+    tiles[t].num_samples = (int)floor(target(errors[t], hi) - errors[t].count + 0.5);
+  }
+  return stable_partition(tiles.begin(), tiles.end(),
+                          [](const WorkItem& t) { return t.num_samples > 0; }) - tiles.begin();
+}
+
+void RaytracedRenderer::launch_workers() {
+  activeTiles.clear();
+  workersWaiting = 0;
+  passTimer.start();
+  for (size_t i = 0; i < numWorkerThreads; i++) {
+    workerJobs.push_back(workerPool->submit([this, i]() { worker_thread(i); }));
+  }
+}
+
+void RaytracedRenderer::wait_for_workers() {
+  for (std::future<void>& job : workerJobs) {
+    job.wait();
+  }
+  workerJobs.clear();
+}
+
+void RaytracedRenderer::worker_thread(size_t index) {
 
   Timer timer;
   timer.start();
 
   WorkItem work;
-  while (continueRaytracing && workQueue.try_get_work(&work)) {
-    raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h);
-    { 
-      lock_guard<std::mutex> lk(m_done);
-      ++tilesDone;
-      cout << "\r[PathTracer] Rendering... " << int((double)tilesDone/tilesTotal * 100) << '%';
-      cout.flush();
+  do {
+    while (continueRaytracing && workQueue.try_get_work(index, &work)) {
+      bool active = raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h,
+                                  work.num_samples);
+      { 
+        lock_guard<std::mutex> lk(m_done);
+        ++tilesDone;
+        if (active) activeTiles.push_back(work);
+        cout << "\r[PathTracer] Rendering... " << int((double)tilesDone/tilesTotal * 100) << '%';
+        cout.flush();
+      }
     }
-  }
+  } while (progressiveSamples > 0 && next_pass());
 
   workerDoneCount++;
   if (!continueRaytracing && workerDoneCount == numWorkerThreads) {
@@ -6,6 +6,7 @@
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <future>
 #include <vector>
 #include <algorithm>
 
@@ -15,7 +16,8 @@
 #include "pathtracer/camera.h"
 #include "pathtracer/sampler.h"
 #include "util/image.h"
-#include "util/work_queue.h"
+#include "util/thread_pool.h"
+#include "util/work_stealing_queue.h"
 #include "pathtracer/intersection.h"
 
 #include "application/renderer.h"
@@ -28,6 +30,7 @@ using CGL::SceneObjects::EnvironmentLight;
 
 using CGL::SceneObjects::BVHNode;
 using CGL::SceneObjects::BVHAccel;
+using CGL::SceneObjects::BVHWidth;
 
 #include "pathtracer.h"
 
@@ -38,16 +41,70 @@ struct WorkItem {
   // Default constructor.
   WorkItem() : WorkItem(0, 0, 0, 0) { }
 
-  WorkItem(int x, int y, int w, int h)
-      : tile_x(x), tile_y(y), tile_w(w), tile_h(h) {}
+  WorkItem(int x, int y, int w, int h, int num_samples = 0)
+      : tile_x(x), tile_y(y), tile_w(w), tile_h(h), num_samples(num_samples) {}
 
   int tile_x;
   int tile_y;
   int tile_w;
   int tile_h;
+  int num_samples;  ///< samples per pixel of a progressive pass
 
 };
 
+/**
+ * Depths of the scene over the frame in tiles, from a small grid of
+ * pinhole rays per tile. A depth is the distance along the view direction
+ * of the camera, INF where the rays miss. Made once per placement of the
+ * camera, see RaytracedRenderer::update_focus_map.
+ */
+struct FocusMap {
+
+  static const size_t TILE_SIZE = 16;  ///< pixels along a side of a tile
+  static const size_t TILE_RAYS = 4;   ///< rays along a side of a tile
+
+  bool empty() const { return depth.empty(); }
+
+  size_t tiles_w = 0;             ///< tiles along the width of the frame
+  size_t tiles_h = 0;             ///< tiles along the height of the frame
+  std::vector<double> depth;      ///< median depth of each tile, row by row
+  std::vector<double> nearest;    ///< closest depth of each tile
+  std::vector<double> farthest;   ///< farthest depth of each tile
+  double placement[13];           ///< camera placement and frame size the map was made for
+};
+
+/**
+ * Settings of a RaytracedRenderer, given to it as a whole so that they are
+ * set by name rather than by their position in a long argument list.
+ */
+struct RaytracedRendererOptions {
+  size_t ns_aa = 1;                     ///< camera rays per pixel
+  size_t max_ray_depth = 4;             ///< maximum ray depth
+  size_t ns_area_light = 1;             ///< light samples per shading point
+  size_t ns_diff = 1;                   ///< samples of diffuse surfaces
+  size_t ns_glsy = 1;                   ///< samples of glossy surfaces
+  size_t ns_refr = 1;                   ///< samples of refractive surfaces
+  size_t num_threads = 1;               ///< render threads
+  size_t samples_per_batch = 32;        ///< samples between adaptive sampling tests
+  float max_tolerance = 0.05f;          ///< adaptive sampling tolerance, 0 to turn it off
+  HDRImageBuffer* envmap = NULL;        ///< environment map, NULL for none
+  bool direct_hemisphere_sample = false; ///< sample direct light over the hemisphere
+  string filename = "";                 ///< name of the scene, for output files
+  double lensRadius = 0.25;             ///< aperture of the thin lens
+  double focalDistance = 4.7;           ///< focal distance of the thin lens
+  size_t bvh_width = 4;                 ///< BVH width, 2 or 4
+  bool wavefront = false;               ///< render with the wavefront integrator
+  string bvh_cache = "";                ///< BVH cache file, empty for none
+  size_t progressive_samples = 0;       ///< samples per pixel of a progressive pass, 0 for one pass
+  double time_budget = 0;               ///< seconds a progressive render may take, 0 for no limit
+  uint64_t seed = 0;                    ///< seed of the random numbers
+  SampleSequence sample_sequence = SEQUENCE_RANDOM; ///< sequence the samplers draw from
+  bool exact_lens = false;              ///< trace camera rays through the lens elements
+  string lens_file = "";                ///< lens prescription, empty for the built-in lens
+  bool autofocus = false;               ///< focus before rendering to a file
+  size_t sample_budget = 0;             ///< average samples per pixel of a progressive render, 0 for uniform passes
+};
+
 /**
  * A pathtracer with BVH accelerator and BVH visualization capabilities.
  * It is always in exactly one of the following states:
@@ -64,17 +121,7 @@ public:
    * Default constructor.
    * Creates a new pathtracer instance.
    */
-  RaytracedRenderer(size_t ns_aa = 1, 
-             size_t max_ray_depth = 4, size_t ns_area_light = 1,
-             size_t ns_diff = 1, size_t ns_glsy = 1, size_t ns_refr = 1,
-             size_t num_threads = 1,
-             size_t samples_per_batch = 32,
-             float max_tolerance = 0.05f,
-             HDRImageBuffer* envmap = NULL,
-             bool direct_hemisphere_sample = false,
-             string filename = "",
-             double lensRadius = 0.25,
-             double focalDistance = 4.7);
+  RaytracedRenderer(const RaytracedRendererOptions& options = RaytracedRendererOptions());
 
   /**
    * Destructor.
@@ -128,9 +175,23 @@ public:
   void clear();
 
   /**
-   * If the pathtracer is in RENDER, set the camera focal distance to the vector.
+   * Focus the camera on the depth of the scene at a pixel, looked up in the
+   * focus map and converted to a focal distance by the focus calibration
+   * of the lens. Only traces rays when the camera has moved since the map
+   * was made. Stops a running render, which has to be restarted with the
+   * new focus.
+   * \param loc pixel, from the bottom left of the frame
    */
   void autofocus(Vector2D loc);
+
+  /**
+   * Focus the camera on the center of the frame. The focus map gives the
+   * depths there, which bracket the focal distance; a few patches rendered
+   * at a few samples per pixel on the render pool then find the sharpest
+   * focal distance within the bracket by contrast. Without any depth there
+   * the contrast search covers the whole focus range, coarse to fine.
+   * Stops a running render, which has to be restarted with the new focus.
+   */
   void cd_autofocus();
   /**
    * If the pathtracer is in READY, transition to VISUALIZE.
@@ -181,16 +242,81 @@ public:
   void visualize_cell() const;
 
     void visualize_af() const;
+
+  /**
+   * Make the focus map for the current camera placement and frame size
+   * unless it already is.
+   */
+  void update_focus_map();
+
+  /**
+   * Pixels [x0, x1) x [y0, y1) that cd_autofocus probes.
+   */
+  void autofocus_patch(size_t *x0, size_t *y0, size_t *x1, size_t *y1) const;
+
+  /**
+   * Render the autofocus patch at a focal distance and measure its
+   * sharpness, see cd_autofocus.
+   * \return mean squared gradient of the patch's illuminance, compressed
+   *         relative to its mean, estimated from two independent halves of
+   *         the samples
+   */
+  double focus_probe(double focal_distance, size_t x0, size_t y0, size_t x1, size_t y1);
+
   /**
    * Raytrace a tile of the scene and update the frame buffer. Is run
    * in a worker thread.
+   * \param num_samples samples per pixel to add in a progressive pass
+   * \return true if the tile needs another progressive pass
+   */
+  bool raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h, int num_samples);
+
+  /**
+   * Called by every worker once the work queue of a progressive pass has
+   * run dry. The last worker to arrive queues the tiles that still need
+   * samples as the next pass, unless the render was canceled, every pixel
+   * is done or the time budget is used up, and releases the others.
+   * \return true if there is another pass to work on
    */
-  void raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h);
+  bool next_pass();
+
+  /**
+   * Hand the samples of the next pass of a progressive render with a
+   * sample budget to the tiles whose pixels have the highest estimated
+   * error. The error of a pixel is the variance of its samples, estimated
+   * from those it has so far and seen through the tone curve of the image,
+   * over their number. Giving each tile samples in proportion to the
+   * standard deviation of its samples minimizes the total error for the
+   * samples spent; the pass moves the tiles towards that as far as its
+   * samples go.
+   * \param tiles tiles that still need samples, those that get samples in
+   *              the next pass are moved to the front, with their num_samples
+   * \return the number of tiles that get samples
+   */
+  size_t budget_pass(std::vector<WorkItem>& tiles);
+
+  /**
+   * Order the tiles in a square spiral outwards from the center of the area
+   * they cover and hand them to the workers, so the center of the image is
+   * rendered first.
+   */
+  void queue_tiles(std::vector<WorkItem>& tiles);
+
+  /**
+   * Run worker_thread on every thread of the render pool.
+   */
+  void launch_workers();
+
+  /**
+   * Wait until the workers of the current render have returned.
+   */
+  void wait_for_workers();
 
   /**
    * Implementation of a ray tracer worker thread
+   * \param index index of the worker, selects its deque of the work queue
    */
-  void worker_thread();
+  void worker_thread(size_t index);
 
   enum State {
     INIT,               ///< to be initialized
@@ -213,15 +339,29 @@ public:
   vector<int> tile_samples; ///< current sample rate for tile
   size_t num_tiles_w;       ///< number of tiles along width of the image
   size_t num_tiles_h;       ///< number of tiles along height of the image
+  size_t tileSize;          ///< edge of the tiles of the current render
 
   size_t frame_w, frame_h;
 
   double lensRadius;
   double focalDistance;
+  bool exactLens;       ///< trace camera rays through the lens elements, see Camera::exact_lens
+  std::string lensFile; ///< lens prescription file, empty for the built-in zoom lens
+  bool autoFocus;       ///< render_to_file focuses with cd_autofocus first
+  FocusMap focusMap;    ///< depths over the frame for autofocus
+
+  BVHWidth bvhWidth;    ///< branching factor of the BVH used for rendering
+  std::string bvhCache; ///< file the BVH is cached in, empty for none
+
+  size_t progressiveSamples; ///< samples per pixel per pass, 0 renders tiles once
+  double timeBudget;         ///< seconds a progressive render may take, 0 for no limit
+  size_t sampleBudget;       ///< average samples per pixel of a progressive render, 0 for uniform passes
+  size_t budgetSamples;      ///< samples the current render may take in total, see sampleBudget
 
   // Components //
 
   BVHAccel* bvh;                 ///< BVH accelerator aggregate
+  LightSampler* lightSampler;    ///< chooses the lights of light samples
   ImageBuffer frameBuffer;       ///< frame buffer
   Timer timer;                   ///< performance test timer
 
@@ -233,14 +373,22 @@ public:
   size_t imageTileSize;
 
   bool continueRaytracing;                  ///< rendering should continue
-  std::vector<std::thread*> workerThreads;  ///< pool of worker threads
+  ThreadPool* workerPool;                   ///< render threads, created once
+  std::vector<std::future<void>> workerJobs; ///< worker_thread jobs running
   std::atomic<int> workerDoneCount;         ///< worker threads management
-  WorkQueue<WorkItem> workQueue;            ///< queue of work for the workers
+  WorkStealingQueue<WorkItem> workQueue;    ///< queue of work for the workers
   std::condition_variable cv_done;
   std::mutex m_done;
   size_t tilesDone;
   size_t tilesTotal;
 
+  std::vector<WorkItem> activeTiles;        ///< tiles that need another pass
+  size_t passesDone;                        ///< progressive passes completed
+  size_t workersWaiting;                    ///< workers done with the pass
+  bool passContinues;                       ///< the finished pass has a successor
+  std::condition_variable cv_pass;          ///< signals the end of a pass
+  Timer passTimer;                          ///< time since the render started
+
   // Visualizer Controls //
 
   std::stack<BVHNode*> selectionHistory;  ///< node selection history
@@ -1,13 +1,321 @@
 #include "sampler.h"
 
+#include <cfloat>
+#include <vector>
+
 namespace CGL {
 
+// Sample sequences //
+
+// Dimensions of the sample vector of a path: the camera takes the first
+// ones, every vertex then gets a block with room for its light sample and
+// its BSDF sample. Paths longer than MAX_SAMPLE_VERTICES draw random numbers.
+static const uint32_t CAMERA_DIMENSIONS = 4;
+static const uint32_t LIGHT_DIMENSIONS = 4;
+static const uint32_t BSDF_DIMENSIONS = 4;
+static const uint32_t VERTEX_DIMENSIONS = LIGHT_DIMENSIONS + BSDF_DIMENSIONS;
+static const uint32_t MAX_SAMPLE_VERTICES = 16;
+static const uint32_t MAX_SAMPLE_DIMENSIONS =
+    CAMERA_DIMENSIONS + MAX_SAMPLE_VERTICES * VERTEX_DIMENSIONS;
+
+static const int BLUE_NOISE_SIZE = 64;  ///< side of the blue noise mask, power of two
+
+bool parse_sample_sequence(const std::string& name, SampleSequence* sequence) {
+  static const struct { const char* name; SampleSequence sequence; } names[] = {
+    {"random", SEQUENCE_RANDOM},
+    {"stratified", SEQUENCE_STRATIFIED},
+    {"halton", SEQUENCE_HALTON},
+    {"sobol", SEQUENCE_SOBOL},
+    {"bluenoise", SEQUENCE_BLUE_NOISE},
+  };
+  for (const auto &n : names) {
+    if (name == n.name) {
+      *sequence = n.sequence;
+      return true;
+    }
+  }
+  return false;
+}
+
+void start_pixel_sample(SampleSequence sequence, uint64_t seed, size_t x, size_t y,
+                        size_t index, size_t count) {
+  SampleState &s = thread_sample_state();
+  s.sequence = sequence;
+  s.seed = seed;
+  s.x = x;
+  s.y = y;
+  s.index = index;
+  s.count = count;
+  set_sample_domain(0, SAMPLE_CAMERA);
+}
+
+void set_sample_domain(size_t vertex, SampleDomain domain,
+                       size_t sub_index, size_t sub_count) {
+  SampleState &s = thread_sample_state();
+  s.sub_index = sub_index;
+  s.sub_count = sub_count;
+  if (domain == SAMPLE_CAMERA) {
+    s.dimension = 0;
+    s.dimension_end = CAMERA_DIMENSIONS;
+  } else if (vertex >= MAX_SAMPLE_VERTICES) {
+    s.dimension = s.dimension_end = MAX_SAMPLE_DIMENSIONS;
+  } else {
+    s.dimension = CAMERA_DIMENSIONS + vertex * VERTEX_DIMENSIONS;
+    if (domain == SAMPLE_BSDF) s.dimension += LIGHT_DIMENSIONS;
+    s.dimension_end = s.dimension + (domain == SAMPLE_BSDF ? BSDF_DIMENSIONS : LIGHT_DIMENSIONS);
+  }
+}
+
+static inline uint32_t hash32(uint64_t a, uint64_t b, uint64_t c = 0) {
+  return (uint32_t) mix_bits(a ^ mix_bits(b ^ mix_bits(c)));
+}
+
+static inline double to_unit(uint32_t bits) {
+  return (bits + 0.5) * (1.0 / 4294967296.0);
+}
+
+static inline uint32_t reverse_bits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+  x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+  x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+  x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+  return x;
+}
+
+/**
+ * Owen scramble the bits of x, from the most significant bit down
+ * (Burley, Practical Hash-based Owen Scrambling, 2020).
+ */
+static inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverse_bits(x);
+}
+
+/**
+ * Second dimension of the Sobol sequence. Its generator matrix is Pascal's
+ * triangle mod 2, so the direction numbers follow from v ^= v >> 1.
+ */
+static inline uint32_t sobol_1(uint32_t index) {
+  uint32_t result = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+    if (index & 1) result ^= v;
+  }
+  return result;
+}
+
+/**
+ * Dimension d of an Owen scrambled and shuffled (0, 2) Sobol pair.
+ */
+static inline uint32_t sobol_pair(uint32_t index, uint32_t d, uint32_t seed) {
+  index = nested_uniform_scramble(index, hash32(seed, 0));
+  uint32_t v = d ? sobol_1(index) : reverse_bits(index);
+  return nested_uniform_scramble(v, hash32(seed, 1 + d));
+}
+
+/**
+ * Permutation of [0, n) selected by p, by cycle walking a hash on the next
+ * power of two (Kensler, Correlated Multi-Jittered Sampling, 2013).
+ */
+static inline uint32_t permute(uint32_t i, uint32_t n, uint32_t p) {
+  uint32_t w = n - 1;
+  w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+  do {
+    i ^= p; i *= 0xe170893d;
+    i ^= p >> 16;
+    i ^= (i & w) >> 4;
+    i ^= p >> 8; i *= 0x0929eb3f;
+    i ^= p >> 23;
+    i ^= (i & w) >> 1; i *= 1 | p >> 27;
+    i *= 0x6935fa69;
+    i ^= (i & w) >> 11; i *= 0x74dcb303;
+    i ^= (i & w) >> 2; i *= 0x9e501cc3;
+    i ^= (i & w) >> 2; i *= 0xc860a3df;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= n);
+  return (i + p) % n;
+}
+
+static const std::vector<uint32_t>& halton_primes() {
+  static const std::vector<uint32_t> primes = []() {
+    std::vector<uint32_t> p;
+    for (uint32_t n = 2; p.size() < MAX_SAMPLE_DIMENSIONS; n++) {
+      bool prime = true;
+      for (uint32_t q : p) {
+        if (q * q > n) break;
+        if (n % q == 0) { prime = false; break; }
+      }
+      if (prime) p.push_back(n);
+    }
+    return p;
+  }();
+  return primes;
+}
+
+/**
+ * Radical inverse of index in the given base with every digit position
+ * shuffled by its own random permutation. Without the scrambling the
+ * dimensions of large neighbouring primes are strongly correlated.
+ */
+static inline double scrambled_radical_inverse(uint32_t index, uint32_t base,
+                                               uint32_t seed) {
+  double inv_base = 1.0 / base, f = inv_base, result = 0;
+  // the digits past the last one of index are zeros, which scramble to
+  // nonzero digits as well, until they drop below double precision
+  for (uint32_t digit = 0; f > 1e-12; digit++, index /= base, f *= inv_base) {
+    result += permute(index % base, base, hash32(seed, digit)) * f;
+  }
+  return std::min(result, 1.0 - DBL_EPSILON);
+}
+
+/**
+ * Dither mask whose values are spread over the mask like blue noise,
+ * made with the void and cluster method (Ulichney 1993) on a torus.
+ * Holds the rank of every pixel, mapped to (0, 1).
+ */
+static std::vector<float> build_blue_noise_mask() {
+  const int size = BLUE_NOISE_SIZE, n = size * size, mask = size - 1;
+  const double sigma = 1.5;
+
+  std::vector<double> kernel(n);
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      int dx = std::min(x, size - x), dy = std::min(y, size - y);
+      kernel[y * size + x] = exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+    }
+  }
+
+  std::vector<char> pattern(n, 0);
+  std::vector<double> energy(n, 0);
+  auto splat = [&](int p, double sign) {
+    int px = p % size, py = p / size;
+    for (int q = 0; q < n; q++) {
+      int dx = (q % size - px) & mask, dy = (q / size - py) & mask;
+      energy[q] += sign * kernel[dy * size + dx];
+    }
+  };
+  // densest point of a pattern, or its emptiest spot
+  auto tightest_cluster = [&]() {
+    int best = -1;
+    for (int q = 0; q < n; q++) {
+      if (pattern[q] && (best < 0 || energy[q] > energy[best])) best = q;
+    }
+    return best;
+  };
+  auto largest_void = [&]() {
+    int best = -1;
+    for (int q = 0; q < n; q++) {
+      if (!pattern[q] && (best < 0 || energy[q] < energy[best])) best = q;
+    }
+    return best;
+  };
+
+  // random initial pattern, relaxed by moving points from clusters to voids
+  int ones = n / 10;
+  PCG32 rng;
+  for (int placed = 0; placed < ones;) {
+    int p = rng.next() % n;
+    if (pattern[p]) continue;
+    pattern[p] = 1;
+    splat(p, 1);
+    placed++;
+  }
+  while (true) {
+    int cluster = tightest_cluster();
+    pattern[cluster] = 0;
+    splat(cluster, -1);
+    int hole = largest_void();
+    pattern[hole] = 1;
+    splat(hole, 1);
+    if (hole == cluster) break;
+  }
+
+  std::vector<int> rank(n);
+  std::vector<char> initial_pattern = pattern;
+  std::vector<double> initial_energy = energy;
+  for (int r = ones - 1; r >= 0; r--) {
+    int cluster = tightest_cluster();
+    pattern[cluster] = 0;
+    splat(cluster, -1);
+    rank[cluster] = r;
+  }
+  pattern = initial_pattern;
+  energy = initial_energy;
+  for (int r = ones; r < n; r++) {
+    int hole = largest_void();
+    pattern[hole] = 1;
+    splat(hole, 1);
+    rank[hole] = r;
+  }
+
+  std::vector<float> values(n);
+  for (int q = 0; q < n; q++) values[q] = (rank[q] + 0.5f) / n;
+  return values;
+}
+
+static const std::vector<float>& blue_noise_mask() {
+  static const std::vector<float> values = build_blue_noise_mask();
+  return values;
+}
+
+double sample_1d() {
+  SampleState &s = thread_sample_state();
+  if (s.sequence == SEQUENCE_RANDOM || s.dimension >= s.dimension_end) {
+    return random_uniform();
+  }
+  uint32_t d = s.dimension++;
+  uint32_t index = s.index * s.sub_count + s.sub_index;
+  uint64_t pixel = ((uint64_t) s.y << 32) | s.x;
+
+  switch (s.sequence) {
+    case SEQUENCE_STRATIFIED: {
+      // jittered m x m strata per pair of dimensions, visited in a random order
+      uint32_t count = s.count * s.sub_count;
+      uint32_t m = std::max<uint32_t>(1, ceil(sqrt((double) count)));
+      uint32_t strata = m * m;
+      uint32_t pair_seed = hash32(s.seed, pixel, d >> 1);
+      uint32_t stratum = permute(index % strata, strata, hash32(pair_seed, index / strata));
+      uint32_t cell = (d & 1) ? stratum / m : stratum % m;
+      return (cell + to_unit(hash32(pair_seed, index, 1 + (d & 1)))) / m;
+    }
+    case SEQUENCE_HALTON: {
+      double u = scrambled_radical_inverse(index, halton_primes()[d], hash32(s.seed, pixel, d));
+      return u > 0 ? u : to_unit(0);
+    }
+    case SEQUENCE_SOBOL:
+      return to_unit(sobol_pair(index, d & 1, hash32(s.seed, pixel, d >> 1)));
+    case SEQUENCE_BLUE_NOISE: {
+      // all pixels share the sequence, neighbours are shifted apart by the
+      // mask, which is offset differently for every dimension
+      uint32_t offset = hash32(s.seed, d);
+      int mx = (s.x + offset) & (BLUE_NOISE_SIZE - 1);
+      int my = (s.y + (offset >> 16)) & (BLUE_NOISE_SIZE - 1);
+      double u = to_unit(sobol_pair(index, d & 1, hash32(s.seed, d >> 1)));
+      u += blue_noise_mask()[my * BLUE_NOISE_SIZE + mx];
+      return u < 1 ? u : u - 1;
+    }
+    default:
+      return random_uniform();
+  }
+}
+
+
+// Samplers //
+
 /**
  * A Sampler2D implementation with uniform distribution on unit square
  */
 Vector2D UniformGridSampler2D::get_sample() const {
 
-  return Vector2D(random_uniform(), random_uniform());
+  double Xi1 = sample_1d();
+  double Xi2 = sample_1d();
+  return Vector2D(Xi1, Xi2);
 
 }
 
@@ -15,10 +323,10 @@ Vector2D UniformGridSampler2D::get_sample() const {
 // Uniform Sphere Sampler3D Implementation //
 
 Vector3D UniformSphereSampler3D::get_sample() const {
-  double z = random_uniform() * 2 - 1;
+  double z = sample_1d() * 2 - 1;
   double sinTheta = sqrt(std::max(0.0, 1.0f - z * z));
 
-  double phi = 2.0f * PI * random_uniform();
+  double phi = 2.0f * PI * sample_1d();
 
   return Vector3D(cos(phi) * sinTheta, sin(phi) * sinTheta, z);
 }
@@ -29,8 +337,8 @@ Vector3D UniformSphereSampler3D::get_sample() const {
  */
 Vector3D UniformHemisphereSampler3D::get_sample() const {
 
-  double Xi1 = random_uniform();
-  double Xi2 = random_uniform();
+  double Xi1 = sample_1d();
+  double Xi2 = sample_1d();
 
   double theta = acos(Xi1);
   double phi = 2.0 * PI * Xi2;
@@ -58,8 +366,8 @@ Vector3D CosineWeightedHemisphereSampler3D::get_sample() const {
  */
 Vector3D CosineWeightedHemisphereSampler3D::get_sample(double *pdf) const {
 
-  double Xi1 = random_uniform();
-  double Xi2 = random_uniform();
+  double Xi1 = sample_1d();
+  double Xi2 = sample_1d();
 
   double r = sqrt(Xi1);
   double theta = 2. * PI * Xi2;
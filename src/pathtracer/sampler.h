@@ -6,8 +6,91 @@
 #include "CGL/misc.h"
 #include "util/random_util.h"
 
+#include <string>
+
 namespace CGL {
 
+/**
+ * Sequence the samplers draw their numbers from while rendering a pixel.
+ * Every number a path draws is one dimension of its sample vector; see
+ * start_pixel_sample and set_sample_domain for how dimensions are assigned.
+ */
+enum SampleSequence {
+  SEQUENCE_RANDOM,      ///< independent uniform random numbers
+  SEQUENCE_STRATIFIED,  ///< jittered strata per pair of dimensions, shuffled per pixel
+  SEQUENCE_HALTON,      ///< Halton sequence, randomly shifted per pixel
+  SEQUENCE_SOBOL,       ///< Owen scrambled Sobol pairs, shuffled per pixel
+  SEQUENCE_BLUE_NOISE   ///< one Sobol sequence for all pixels, shifted by a blue noise mask
+};
+
+/**
+ * Parse the name of a sample sequence: random, stratified, halton, sobol
+ * or bluenoise.
+ * \return false if the name is unknown
+ */
+bool parse_sample_sequence(const std::string& name, SampleSequence* sequence);
+
+/**
+ * Part of the sample vector that the following numbers are drawn for.
+ */
+enum SampleDomain {
+  SAMPLE_CAMERA,  ///< position on the pixel and on the lens
+  SAMPLE_LIGHT,   ///< light sample of a path vertex
+  SAMPLE_BSDF     ///< direction sampled from the BSDF of a path vertex
+};
+
+/**
+ * Sample of a pixel that the calling thread draws numbers for.
+ */
+struct SampleState {
+  SampleSequence sequence = SEQUENCE_RANDOM;
+  uint64_t seed = 0;          ///< seed of the render
+  uint32_t x = 0, y = 0;      ///< pixel
+  uint32_t index = 0;         ///< sample of the pixel
+  uint32_t count = 1;         ///< number of samples of the pixel
+  uint32_t sub_index = 0;     ///< sub-sample within the current domain
+  uint32_t sub_count = 1;     ///< number of sub-samples of the current domain
+  uint32_t dimension = 0;     ///< next dimension to draw
+  uint32_t dimension_end = 0; ///< end of the dimensions of the current domain
+};
+
+inline SampleState& thread_sample_state() {
+  static thread_local SampleState state;
+  return state;
+}
+
+/**
+ * Start drawing the numbers of a pixel sample on the calling thread, from
+ * the camera domain on.
+ * \param sequence sequence to draw from
+ * \param seed seed of the render
+ * \param x column of the pixel
+ * \param y row of the pixel
+ * \param index index of the sample in the pixel
+ * \param count number of samples of the pixel
+ */
+void start_pixel_sample(SampleSequence sequence, uint64_t seed, size_t x, size_t y,
+                        size_t index, size_t count);
+
+/**
+ * Move on to the dimensions of a domain of a path vertex. Domains that
+ * take several samples for one path sample, like the light samples of a
+ * vertex, pass the sub-sample so that those are stratified as well.
+ * \param vertex path vertex, 0 is the first hit of the camera ray
+ * \param domain what the numbers are drawn for
+ * \param sub_index sub-sample within the domain
+ * \param sub_count number of sub-samples of the domain
+ */
+void set_sample_domain(size_t vertex, SampleDomain domain,
+                       size_t sub_index = 0, size_t sub_count = 1);
+
+/**
+ * Draw the next dimension of the current sample, distributed over (0, 1).
+ * Falls back to random numbers once a domain is out of dimensions and on
+ * threads that are not rendering a pixel.
+ */
+double sample_1d();
+
 /**
  * Interface for generating 2D vector samples
  */
@@ -90,11 +173,6 @@ class CosineWeightedHemisphereSampler3D : public Sampler3D {
 
 }; // class UniformHemisphereSampler3D
 
-/**
- * TODO (extra credit) :
- * Jittered sampler implementations
- */
-
 } // namespace CGL
 
 #endif //CGL_SAMPLER_H
@@ -0,0 +1,294 @@
+#include "pathtracer.h"
+
+#include "scene/light.h"
+#include "util/random_util.h"
+
+#include <algorithm>
+#include <functional>
+
+using namespace CGL::SceneObjects;
+
+namespace CGL {
+
+/**
+ * A path in flight. The path throughput is folded into beta, so the radiance
+ * found at the current vertex is simply weighted by it.
+ */
+struct WavefrontPath {
+  WavefrontPath() : pixel(0), camera(true), after_delta(false), mis_pdf(0),
+                    hit(false), alive(false) { }
+
+  Ray ray;              ///< current segment of the path
+  PCG32 rng;            ///< random numbers of the path, see PathTracer::seed_pixel
+  SampleState sample;   ///< position of the path in the sample sequence
+  Vector3D beta;        ///< throughput of the path up to the current segment
+  Vector3D L;           ///< radiance gathered by the path so far
+  size_t pixel;         ///< pixel of the tile the path belongs to
+  bool camera;          ///< the current segment is the camera ray
+  bool after_delta;     ///< the previous vertex has a delta BSDF
+  double mis_pdf;       ///< BSDF density of the current segment if it adds the
+                        ///< lights it finds by MIS, otherwise 0
+  Vector3D mis_n;       ///< surface normal at the start of the current segment
+  bool hit;             ///< the current segment hit the scene
+  bool alive;           ///< the path continues after the current vertex
+  Intersection isect;   ///< closest hit of the current segment
+};
+
+/**
+ * A shadow ray towards a light sample, adding radiance to its path if the
+ * light is visible.
+ */
+struct WavefrontShadowRay {
+  Ray ray;
+  Vector3D L;           ///< contribution if unoccluded, beta included
+  size_t path;          ///< index of the path in the queue
+};
+
+/**
+ * Running sums of a pixel, matching the ones kept by raytrace_pixel.
+ */
+struct WavefrontPixel {
+  WavefrontPixel() : s1(0), s2(0), count(0), blocked(0), done(false) { }
+
+  Vector3D radiance;
+  double s1, s2;
+  size_t count;
+  size_t blocked;       ///< samples of count that found no way through the lens
+  bool done;
+};
+
+/**
+ * Sort key of a ray direction: the octant, then the direction within the
+ * octant quantized on a 16 x 16 grid. Rays with the same key take similar
+ * paths through the BVH.
+ */
+static inline uint32_t direction_key(const Vector3D &d) {
+  uint32_t key = (d.x < 0) << 2 | (d.y < 0) << 1 | (d.z < 0);
+  uint32_t qx = (uint32_t)std::min(fabs(d.x) * 16.0, 15.0);
+  uint32_t qy = (uint32_t)std::min(fabs(d.y) * 16.0, 15.0);
+  return key << 8 | qx << 4 | qy;
+}
+
+void PathTracer::raytrace_tile_wavefront(size_t x0, size_t y0,
+                                         size_t x1, size_t y1) {
+  size_t tile_w = x1 - x0;
+  std::vector<WavefrontPixel> pixels(tile_w * (y1 - y0));
+
+  std::vector<WavefrontPath> paths;
+  std::vector<WavefrontShadowRay> shadow_rays;
+  std::vector<uint64_t> keys;
+  std::vector<size_t> order;
+
+  bool pixels_left = true;
+  while (pixels_left) {
+
+    // generate: the camera rays of the next batch of every pixel that is
+    // still sampling, in pixel order, which keeps them coherent
+    paths.clear();
+    for (size_t p = 0; p < pixels.size(); p++) {
+      if (pixels[p].done) continue;
+      size_t n = std::min(samplesPerBatch, ns_aa - pixels[p].count);
+      size_t blocked = 0;
+      for (size_t s = 0; s < n; s++) {
+        // every path draws from its own stream, so the order the queue is
+        // shaded in does not change the random numbers of a path
+        WavefrontPath path;
+        seed_pixel(x0 + p % tile_w, y0 + p / tile_w, pixels[p].count + s);
+        start_sample(x0 + p % tile_w, y0 + p / tile_w, pixels[p].count + s);
+        path.ray = generate_camera_ray(x0 + p % tile_w, y0 + p / tile_w);
+        if (path.ray.d.norm() == 0) {
+          // no way through the lens, the sample is left out of the mean
+          blocked++;
+          continue;
+        }
+        path.rng = thread_rng();
+        path.sample = thread_sample_state();
+        path.beta = Vector3D(1, 1, 1);
+        path.pixel = p;
+        paths.push_back(path);
+      }
+      pixels[p].count += blocked;
+      pixels[p].blocked += blocked;
+    }
+
+    while (!paths.empty()) {
+
+      // intersect: bounce rays are sorted by direction first, then the queue
+      // is traced in packets of neighbouring rays
+      order.resize(paths.size());
+      if (paths[0].camera) {
+        for (size_t i = 0; i < paths.size(); i++) order[i] = i;
+      } else {
+        keys.resize(paths.size());
+        for (size_t i = 0; i < paths.size(); i++) {
+          keys[i] = (uint64_t)direction_key(paths[i].ray.d) << 32 | i;
+        }
+        std::sort(keys.begin(), keys.end());
+        for (size_t i = 0; i < paths.size(); i++) order[i] = (uint32_t)keys[i];
+      }
+      for (size_t first = 0; first < order.size(); first += RAY_PACKET_SIZE) {
+        RayPacket packet;
+        Intersection isects[RAY_PACKET_SIZE];
+        for (size_t i = first; i < order.size() && !packet.full(); i++) {
+          packet.add(paths[order[i]].ray);
+        }
+        uint32_t hits = bvh->intersect(packet, isects);
+        for (size_t l = 0; l < packet.size; l++) {
+          WavefrontPath &path = paths[order[first + l]];
+          path.hit = (hits & (1u << l)) != 0;
+          path.isect = isects[l];
+        }
+      }
+
+      // shade: grouped by material, gathers emission, queues the shadow rays
+      // of light sampling and samples the next segment of the path
+      std::sort(order.begin(), order.end(), [&paths](size_t a, size_t b) {
+        return std::less<const BSDF *>()(paths[a].isect.bsdf, paths[b].isect.bsdf);
+      });
+      shadow_rays.clear();
+      for (size_t i : order) {
+        WavefrontPath &path = paths[i];
+        thread_rng() = path.rng;
+        thread_sample_state() = path.sample;
+        path.alive = false;
+        if (path.mis_pdf > 0) {
+          path.L += path.beta * estimate_direct_lighting_bsdf(path.ray, path.hit ? path.isect.t : INF_D,
+                                                              path.mis_pdf, path.mis_n);
+        }
+        if (!path.hit) {
+          // only camera rays see the environment, bounces that miss add nothing
+          if (path.camera && envLight) path.L += envLight->sample_dir(path.ray);
+          continue;
+        }
+
+        const Intersection &isect = path.isect;
+        const Ray &r = path.ray;
+        if (path.camera || path.after_delta) {
+          path.L += path.beta * isect.bsdf->get_emission();
+        }
+        if (path.camera && max_ray_depth < 1) continue;
+
+        Matrix3x3 o2w;
+        make_coord_space(o2w, isect.n);
+        Matrix3x3 w2o = o2w.T();
+        Vector3D hit_p = r.o + r.d * isect.t;
+        Vector3D w_out = w2o * (-r.d);
+
+        if (!isect.bsdf->is_delta()) {
+          if (direct_hemisphere_sample) {
+            path.L += path.beta * estimate_direct_lighting_hemisphere(r, isect);
+          } else {
+            // same estimator as estimate_direct_lighting_importance
+            size_t num_samples = ns_area_light;
+            if (scene->lights.size() == 1 && scene->lights[0]->is_delta_light()) {
+              num_samples = 1;
+            }
+            bool mis = r.depth > 1;
+            for (size_t s = 0; s < num_samples; s++) {
+              set_sample_domain(path_vertex(r), SAMPLE_LIGHT, s, num_samples);
+              double pmf;
+              const SceneLight *light = lightSampler->sample(hit_p, isect.n, &pmf);
+              if (!light) continue;
+              Vector3D w_in;
+              double disToLight, pdf;
+              Vector3D emission = light->sample_L(hit_p, &w_in, &disToLight, &pdf);
+              if (pdf <= 0 || dot(w_in, isect.n) < 0) continue;
+              Vector3D w_in_o = w2o * w_in;
+              double weight = 1.0 / (num_samples * pmf);
+              if (mis) {
+                weight *= light_mis_weight(light, pmf, hit_p, w_in,
+                                           isect.bsdf->pdf(w_out, w_in_o));
+              }
+
+              WavefrontShadowRay shadow;
+              shadow.ray = Ray(hit_p, w_in);
+              shadow.ray.min_t = EPS_F;
+              shadow.ray.max_t = disToLight - EPS_F;
+              shadow.L = path.beta * isect.bsdf->f(w_out, w_in_o) * emission *
+                         cos_theta(w_in_o) / pdf * weight;
+              shadow.path = i;
+              shadow_rays.push_back(shadow);
+            }
+          }
+        }
+
+        // russian roulette on the throughput, as in at_least_one_bounce_radiance
+        double p = r.depth > 1 ? continue_probability(r, path.beta) : 0;
+        if (p > 0 && (p >= 1 || coin_flip(p))) {
+          Vector3D w_in;
+          double pdf;
+          set_sample_domain(path_vertex(r), SAMPLE_BSDF);
+          Vector3D f = isect.bsdf->sample_f(w_out, &w_in, &pdf);
+          if (pdf <= 0) continue;
+          path.beta = path.beta * f * (abs_cos_theta(w_in) / pdf / p);
+          path.after_delta = isect.bsdf->is_delta();
+          path.mis_pdf = direct_hemisphere_sample || path.after_delta ? 0 : pdf;
+          path.mis_n = isect.n;
+          path.camera = false;
+          path.ray = Ray(hit_p, (o2w * w_in).unit(), INF_D, r.depth - 1);
+          path.ray.min_t = EPS_F;
+          path.alive = true;
+          path.rng = thread_rng();
+          path.sample = thread_sample_state();
+        }
+      }
+
+      // shadow rays: the rays of one shading point are
+      // queued next to each other, so consecutive rays form the packets
+      for (size_t first = 0; first < shadow_rays.size(); first += RAY_PACKET_SIZE) {
+        RayPacket packet;
+        for (size_t i = first; i < shadow_rays.size() && !packet.full(); i++) {
+          packet.add(shadow_rays[i].ray);
+        }
+        uint32_t occluded = bvh->has_intersection(packet);
+        for (size_t l = 0; l < packet.size; l++) {
+          if (occluded & (1u << l)) continue;
+          const WavefrontShadowRay &shadow = shadow_rays[first + l];
+          paths[shadow.path].L += shadow.L;
+        }
+      }
+
+      // retire finished paths into their pixels and compact the queue
+      size_t alive = 0;
+      for (size_t i = 0; i < paths.size(); i++) {
+        if (paths[i].alive) {
+          if (alive != i) paths[alive] = paths[i];
+          alive++;
+          continue;
+        }
+        WavefrontPixel &pixel = pixels[paths[i].pixel];
+        double illum = paths[i].L.illum();
+        pixel.radiance += paths[i].L;
+        pixel.s1 += illum;
+        pixel.s2 += illum * illum;
+        pixel.count++;
+      }
+      paths.resize(alive);
+    }
+
+    // adaptive sampling test at the end of every full batch
+    pixels_left = false;
+    for (WavefrontPixel &pixel : pixels) {
+      if (pixel.done) continue;
+      size_t n = pixel.count - pixel.blocked;
+      if (pixel.count >= ns_aa) {
+        pixel.done = true;
+      } else if (pixel.count % samplesPerBatch == 0 && n >= 2) {
+        double mean = pixel.s1 / (double) n;
+        double sd = sqrt((1.0 / (double) (n - 1)) * (pixel.s2 - pixel.s1 * pixel.s1 / (double) n));
+        double I = 1.96 * sd / sqrt((double) n);
+        pixel.done = I <= maxTolerance * mean;
+      }
+      pixels_left = pixels_left || !pixel.done;
+    }
+  }
+
+  for (size_t p = 0; p < pixels.size(); p++) {
+    size_t x = x0 + p % tile_w, y = y0 + p / tile_w;
+    size_t n = pixels[p].count - pixels[p].blocked;
+    sampleBuffer.update_pixel(n > 0 ? pixels[p].radiance / n : Vector3D(), x, y);
+    sampleCountBuffer[x + y * sampleBuffer.w] = pixels[p].count;
+  }
+}
+
+} // namespace CGL
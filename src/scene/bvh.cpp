@@ -1,21 +1,313 @@
 #include "bvh.h"
 
 #include "CGL/CGL.h"
+#include "object.h"
 #include "triangle.h"
+#include "util/thread_pool.h"
 
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <stack>
 
+#ifdef _WIN32
+#include <fstream>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define BVH_USE_SSE
+#endif
+
 using namespace std;
 
 namespace CGL {
 namespace SceneObjects {
 
+// number of candidate bins per axis evaluated by the SAH builder
+static const int BVH_SAH_BINS = 16;
+
+// ranges of at least this many primitives gather bounds and SAH bins in
+// parallel chunks, this only pays off in the top levels of the tree
+static const size_t BVH_PARALLEL_BIN_SIZE = 1 << 15;
+
+// subtrees of at least this many primitives are built as separate tasks
+static const size_t BVH_PARALLEL_TASK_SIZE = 1 << 12;
+
+// maximum depth of the traversal stack
+static const int BVH_STACK_SIZE = 64;
+
+// a 4-wide node pushes up to three more entries than it pops
+static const int BVH4_STACK_SIZE = 3 * BVH_STACK_SIZE + 1;
+
+// past this depth the builder splits ranges at their median, which halves
+// them, so with 32 bit primitive indices no leaf is deeper than the stack
+static const int BVH_MAX_SPLIT_DEPTH = BVH_STACK_SIZE - 32;
+
+/**
+ * The primitive that blocked the last shadow ray of this thread, as an index
+ * into refs of the BVH it belongs to. Shadow rays from nearby points towards
+ * the same light tend to be blocked by the same primitive, so it is tested
+ * before the tree is traversed. The cache is cleared whenever a shadow ray
+ * gets through, so that unoccluded light samples, usually the bulk of them,
+ * do not pay for a test that is bound to miss. Any primitive of the BVH gives
+ * a correct answer, so the index only has to be in range to be usable.
+ */
+struct BVHOccluderCache {
+  const BVHAccel *bvh;
+  uint32_t ref;
+};
+static thread_local BVHOccluderCache occluder_cache = {NULL, 0};
+
+/**
+ * Order the children in mask far to near by their entry distance, so that
+ * pushing them in this order makes the nearest one be popped first.
+ * Returns the number of children written to order.
+ */
+static inline int sort_children(int mask, const float *t_entry, int *order) {
+  int n = 0;
+  for (int c = 0; c < 4; c++) {
+    if (!(mask & (1 << c))) continue;
+    int k = n++;
+    while (k > 0 && t_entry[order[k - 1]] < t_entry[c]) {
+      order[k] = order[k - 1];
+      k--;
+    }
+    order[k] = c;
+  }
+  return n;
+}
+
+// identifies BVH cache files, the version changes with the file layout or
+// with anything that changes the tree built from the same input
+static const uint32_t BVH_CACHE_MAGIC = 0x48564243; // "CBVH"
+static const uint32_t BVH_CACHE_VERSION = 1;
+
+// set in a cache node record if the node is a leaf
+static const uint32_t BVH_CACHE_LEAF = 0x80000000u;
+
+/**
+ * Layout of a BVH cache file: this header, then for every leaf slot the
+ * input index of its primitive (uint32_t), then one record per node in
+ * depth first order, holding the number of primitives below the node and
+ * BVH_CACHE_LEAF for leaves.
+ */
+struct BVHCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key;         ///< hash of the build input, see cache_key
+  uint64_t num_refs;    ///< number of primitives
+  uint64_t num_nodes;   ///< number of node records
+};
+
+static inline uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+/**
+ * FNV-1a hash of everything the built tree depends on: the bounds of the
+ * primitives in input order and the build parameters.
+ */
+static uint64_t cache_key(const std::vector<BVHBuildPrimitive> &build,
+                          size_t max_leaf_size, BVHSplitMethod split_method) {
+  uint64_t hash = 14695981039346656037ull;
+  uint64_t params[4] = {BVH_CACHE_VERSION, build.size(), max_leaf_size,
+                        (uint64_t)split_method};
+  hash = fnv1a(hash, params, sizeof(params));
+  for (const BVHBuildPrimitive &p : build) {
+    double bounds[6] = {p.bb.min.x, p.bb.min.y, p.bb.min.z,
+                        p.bb.max.x, p.bb.max.y, p.bb.max.z};
+    hash = fnv1a(hash, bounds, sizeof(bounds));
+  }
+  return hash;
+}
+
+/**
+ * Read only contents of a whole file, memory mapped where the platform
+ * supports it. data is NULL if the file could not be read.
+ */
+struct BVHCacheData {
+  BVHCacheData(const std::string &path) : data(NULL), size(0) {
+#ifdef _WIN32
+    std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!file) return;
+    buffer.resize((size_t)file.tellg());
+    file.seekg(0);
+    if (buffer.empty() || !file.read((char *)&buffer[0], buffer.size())) return;
+    data = &buffer[0];
+    size = buffer.size();
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        data = (const unsigned char *)map;
+        size = st.st_size;
+      }
+    }
+    close(fd);
+#endif
+  }
+
+  ~BVHCacheData() {
+#ifndef _WIN32
+    if (data) munmap((void *)data, size);
+#endif
+  }
+
+  const unsigned char *data;
+  size_t size;
+#ifdef _WIN32
+  std::vector<unsigned char> buffer;
+#endif
+};
+
+/**
+ * Recreate the node of the next record and its subtree over the primitives
+ * starting at build[start]. Bounds are merged exactly like construct_bvh
+ * does, so the nodes are the same as the ones of a fresh build.
+ * Returns NULL if the records do not describe a valid tree, or one deeper
+ * than the traversal stack holds.
+ */
+static BVHNode *cache_node(const uint32_t *records, size_t num_records,
+                           size_t &next, size_t start,
+                           const std::vector<BVHBuildPrimitive> &build,
+                           int depth = 0) {
+  if (next >= num_records || depth > BVH_STACK_SIZE) return NULL;
+  uint32_t record = records[next++];
+  size_t range = record & ~BVH_CACHE_LEAF;
+  if (range == 0 || start + range > build.size()) return NULL;
+
+  if (record & BVH_CACHE_LEAF) {
+    BBox bbox;
+    for (size_t i = start; i < start + range; i++) {
+      bbox.expand(build[i].bb);
+    }
+    BVHNode *node = new BVHNode(bbox);
+    node->start = start;
+    node->range = range;
+    return node;
+  }
+
+  BVHNode *l = cache_node(records, num_records, next, start, build, depth + 1);
+  if (!l) return NULL;
+  BVHNode *r = cache_node(records, num_records, next, start + l->range, build, depth + 1);
+  if (!r) {
+    delete l;
+    return NULL;
+  }
+  if (l->range + r->range != range) {
+    delete l;
+    delete r;
+    return NULL;
+  }
+  BBox bbox = l->bb;
+  bbox.expand(r->bb);
+  BVHNode *node = new BVHNode(bbox);
+  node->start = start;
+  node->range = range;
+  node->l = l;
+  node->r = r;
+  return node;
+}
+
+static void cache_records(const BVHNode *node, std::vector<uint32_t> &records) {
+  if (node->isLeaf()) {
+    records.push_back((uint32_t)node->range | BVH_CACHE_LEAF);
+    return;
+  }
+  records.push_back((uint32_t)node->range);
+  cache_records(node->l, records);
+  cache_records(node->r, records);
+}
+
+static int longest_axis(const BBox &bb) {
+  Vector3D extent = bb.max - bb.min;
+  if (extent.x >= extent.y && extent.x >= extent.z) return 0;
+  return extent.y >= extent.z ? 1 : 2;
+}
+
 BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
-                   size_t max_leaf_size) {
+                   const std::vector<const Mesh *> &_meshes,
+                   size_t max_leaf_size, BVHSplitMethod split_method,
+                   BVHWidth width, ThreadPool *build_pool,
+                   const std::string &cache_file)
+    : total_rays(0), total_isects(0), primitives(_primitives),
+      meshes(_meshes), width(width), split_method(split_method),
+      cached(false) {
+
+  std::vector<BVHPrimitiveRef> input;
+  for (size_t i = 0; i < primitives.size(); i++) {
+    BVHPrimitiveRef ref = {BVH_NO_MESH, (uint32_t)i};
+    input.push_back(ref);
+  }
+  for (size_t m = 0; m < meshes.size(); m++) {
+    for (size_t t = 0; t < meshes[m]->num_triangles(); t++) {
+      BVHPrimitiveRef ref = {(uint32_t)m, (uint32_t)t};
+      input.push_back(ref);
+    }
+  }
+
+  // a pool of one thread starts no workers and runs every task in place
+  ThreadPool serial_pool(1);
+  ThreadPool &pool = build_pool ? *build_pool : serial_pool;
 
-  primitives = std::vector<Primitive *>(_primitives);
-  root = construct_bvh(primitives.begin(), primitives.end(), max_leaf_size);
+  // cache the bounds and centroid of every primitive once, the builder only
+  // ever works on this array and reorders the references at the very end
+  std::vector<BVHBuildPrimitive> build(input.size());
+  pool.parallel_for(0, input.size(), pool.size() * 4,
+                    [&](size_t begin, size_t end, size_t) {
+    for (size_t i = begin; i < end; i++) {
+      if (input[i].mesh == BVH_NO_MESH) {
+        build[i].bb = primitives[input[i].index]->get_bbox();
+      } else {
+        build[i].bb = meshes[input[i].mesh]->get_triangle_bbox(input[i].index);
+      }
+      build[i].centroid = build[i].bb.centroid();
+      build[i].index = i;
+    }
+  });
+
+  root = NULL;
+  uint64_t key = 0;
+  if (!cache_file.empty() && !build.empty()) {
+    key = cache_key(build, max_leaf_size, split_method);
+    root = load_cache(cache_file, key, build);
+    cached = root != NULL;
+  }
+  if (!root) {
+    root = construct_bvh(build, 0, build.size(), max_leaf_size, pool);
+    if (!cache_file.empty() && !build.empty()) {
+      save_cache(cache_file, key, build);
+    }
+  }
+
+  refs.resize(build.size());
+  for (size_t i = 0; i < build.size(); i++) {
+    refs[i] = input[build[i].index];
+  }
+
+  // an empty scene keeps no nodes, traversal misses right away
+  if (build.empty()) return;
+  if (width == BVH4) {
+    collapse(root);
+  } else {
+    flatten(root);
+  }
 }
 
 BVHAccel::~BVHAccel() {
@@ -26,10 +318,87 @@ BVHAccel::~BVHAccel() {
 
 BBox BVHAccel::get_bbox() const { return root->bb; }
 
+BVHNode *BVHAccel::load_cache(const std::string &path, uint64_t key,
+                              std::vector<BVHBuildPrimitive> &build) const {
+  BVHCacheData file(path);
+  if (!file.data || file.size < sizeof(BVHCacheHeader)) return NULL;
+
+  BVHCacheHeader header;
+  memcpy(&header, file.data, sizeof(header));
+  if (header.magic != BVH_CACHE_MAGIC || header.version != BVH_CACHE_VERSION ||
+      header.key != key || header.num_refs != build.size() ||
+      file.size != sizeof(header) + (header.num_refs + header.num_nodes) * sizeof(uint32_t)) {
+    return NULL;
+  }
+
+  // put the primitives into leaf order, every input index exactly once
+  const uint32_t *order = (const uint32_t *)(file.data + sizeof(header));
+  std::vector<BVHBuildPrimitive> sorted(build.size());
+  std::vector<bool> seen(build.size(), false);
+  for (size_t i = 0; i < build.size(); i++) {
+    if (order[i] >= build.size() || seen[order[i]]) return NULL;
+    seen[order[i]] = true;
+    sorted[i] = build[order[i]];
+  }
+
+  size_t next = 0;
+  BVHNode *node = cache_node(order + header.num_refs, header.num_nodes, next, 0, sorted);
+  if (!node || next != header.num_nodes || node->range != build.size()) {
+    delete node;
+    return NULL;
+  }
+  build.swap(sorted);
+  return node;
+}
+
+void BVHAccel::save_cache(const std::string &path, uint64_t key,
+                          const std::vector<BVHBuildPrimitive> &build) const {
+  std::vector<uint32_t> order(build.size());
+  for (size_t i = 0; i < build.size(); i++) {
+    order[i] = (uint32_t)build[i].index;
+  }
+  std::vector<uint32_t> records;
+  cache_records(root, records);
+
+  BVHCacheHeader header;
+  header.magic = BVH_CACHE_MAGIC;
+  header.version = BVH_CACHE_VERSION;
+  header.key = key;
+  header.num_refs = order.size();
+  header.num_nodes = records.size();
+
+  // another run may have the cache mapped, so the file is written under a
+  // name of this process and only renamed over the cache once complete
+  std::string temp = path + "." + std::to_string(getpid()) + ".tmp";
+  FILE *file = fopen(temp.c_str(), "wb");
+  if (!file) {
+    fprintf(stderr, "[PathTracer] Could not write BVH cache %s\n", path.c_str());
+    return;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(&order[0], sizeof(uint32_t), order.size(), file) == order.size() &&
+            fwrite(&records[0], sizeof(uint32_t), records.size(), file) == records.size();
+  ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+  // rename does not replace an existing file here
+  if (ok) remove(path.c_str());
+#endif
+  ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+  if (!ok) {
+    // never leave a truncated file behind
+    fprintf(stderr, "[PathTracer] Could not write BVH cache %s\n", path.c_str());
+    remove(temp.c_str());
+  }
+}
+
 void BVHAccel::draw(BVHNode *node, const Color &c, float alpha) const {
   if (node->isLeaf()) {
-    for (auto p = node->start; p != node->end; p++) {
-      (*p)->draw(c, alpha);
+    for (size_t p = node->start; p < node->start + node->range; p++) {
+      if (refs[p].mesh == BVH_NO_MESH) {
+        primitives[refs[p].index]->draw(c, alpha);
+      } else {
+        meshes[refs[p].mesh]->draw_triangle(refs[p].index, c, alpha);
+      }
     }
   } else {
     draw(node->l, c, alpha);
@@ -39,8 +408,12 @@ void BVHAccel::draw(BVHNode *node, const Color &c, float alpha) const {
 
 void BVHAccel::drawOutline(BVHNode *node, const Color &c, float alpha) const {
   if (node->isLeaf()) {
-    for (auto p = node->start; p != node->end; p++) {
-      (*p)->drawOutline(c, alpha);
+    for (size_t p = node->start; p < node->start + node->range; p++) {
+      if (refs[p].mesh == BVH_NO_MESH) {
+        primitives[refs[p].index]->drawOutline(c, alpha);
+      } else {
+        meshes[refs[p].mesh]->draw_triangle_outline(refs[p].index, c, alpha);
+      }
     }
   } else {
     drawOutline(node->l, c, alpha);
@@ -48,142 +421,957 @@ void BVHAccel::drawOutline(BVHNode *node, const Color &c, float alpha) const {
   }
 }
 
-BVHNode *BVHAccel::construct_bvh(std::vector<Primitive *>::iterator start,
-                                 std::vector<Primitive *>::iterator end,
-                                 size_t max_leaf_size) {
+/**
+ * Number of chunks a range of primitives is split into for parallel binning,
+ * 1 if it is too small to be worth it.
+ */
+static size_t bin_chunks(size_t size, const ThreadPool &pool) {
+  if (pool.size() == 1 || size < BVH_PARALLEL_BIN_SIZE) return 1;
+  return std::min(pool.size() * 4, size / (BVH_PARALLEL_BIN_SIZE / 4));
+}
 
-  // TODO (Part 2.1):
-  // Construct a BVH from the given vector of primitives and maximum leaf
-  // size configuration. The starter code build a BVH aggregate with a
-  // single leaf node (which is also the root) that encloses all the
-  // primitives.
+BVHNode *BVHAccel::construct_bvh(std::vector<BVHBuildPrimitive> &build,
+                                 size_t start, size_t end,
+                                 size_t max_leaf_size, ThreadPool &pool,
+                                 int depth) {
 
+  // bounds are merged with min / max only, so the chunks give the same
+  // result as a single pass
+  BBox bbox, centroid_bbox;
+  size_t chunks = bin_chunks(end - start, pool);
+  if (chunks == 1) {
+    for (size_t i = start; i < end; i++) {
+      bbox.expand(build[i].bb);
+      centroid_bbox.expand(build[i].centroid);
+    }
+  } else {
+    std::vector<BBox> chunk_bbox(chunks), chunk_centroid_bbox(chunks);
+    pool.parallel_for(start, end, chunks, [&](size_t first, size_t last, size_t c) {
+      for (size_t i = first; i < last; i++) {
+        chunk_bbox[c].expand(build[i].bb);
+        chunk_centroid_bbox[c].expand(build[i].centroid);
+      }
+    });
+    for (size_t c = 0; c < chunks; c++) {
+      bbox.expand(chunk_bbox[c]);
+      centroid_bbox.expand(chunk_centroid_bbox[c]);
+    }
+  }
+  BVHNode *node = new BVHNode(bbox);
+  node->start = start;
+  node->range = end - start;
 
-//  BBox bbox;
-//
-//  for (auto p = start; p != end; p++) {
-//    BBox bb = (*p)->get_bbox();
-//    bbox.expand(bb);
-//  }
-//
-//  BVHNode *node = new BVHNode(bbox);
-//  node->start = start;
-//  node->end = end;
-//
-//  return node;
+  // base case, is a leaf node
+  if (end - start <= max_leaf_size) {
+    return node;
+  }
 
-    BBox bbox;
+  size_t split = start;
+  if (depth >= BVH_MAX_SPLIT_DEPTH) {
+    // lopsided splits got the tree this deep, only halve the range from here
+  } else if (split_method == SPLIT_SAH) {
+    split = split_sah(build, start, end, centroid_bbox, pool);
+  } else {
+    split = split_mean(build, start, end, centroid_bbox);
+  }
+
+  // all centroids ended up on one side (e.g. coincident centroids), fall back
+  // to an equal count split along the longest axis so the recursion ends
+  if (split == start || split == end) {
+    int axis = longest_axis(centroid_bbox);
+    split = start + (end - start) / 2;
+    std::nth_element(build.begin() + start, build.begin() + split,
+                     build.begin() + end,
+                     [axis](const BVHBuildPrimitive &a, const BVHBuildPrimitive &b) {
+                       return a.centroid[axis] < b.centroid[axis];
+                     });
+  }
+
+  // recurse, the children work on disjoint ranges of build so a large left
+  // subtree is handed to another thread while this one builds the right
+  if (split - start >= BVH_PARALLEL_TASK_SIZE && end - split >= BVH_PARALLEL_TASK_SIZE) {
+    std::atomic<size_t> pending(0);
+    pool.run([&]() {
+      node->l = construct_bvh(build, start, split, max_leaf_size, pool, depth + 1);
+    }, pending);
+    node->r = construct_bvh(build, split, end, max_leaf_size, pool, depth + 1);
+    pool.wait(pending);
+  } else {
+    node->l = construct_bvh(build, start, split, max_leaf_size, pool, depth + 1);
+    node->r = construct_bvh(build, split, end, max_leaf_size, pool, depth + 1);
+  }
+
+  return node;
+}
+
+size_t BVHAccel::split_mean(std::vector<BVHBuildPrimitive> &build,
+                            size_t start, size_t end,
+                            const BBox &centroid_bb) const {
+
+  // split the longest axis at the mean centroid
+  int axis = longest_axis(centroid_bb);
+  double split_point = 0;
+  for (size_t i = start; i < end; i++) {
+    split_point += build[i].centroid[axis];
+  }
+  split_point /= (double)(end - start);
+
+  auto split = std::partition(build.begin() + start, build.begin() + end,
+                              [axis, split_point](const BVHBuildPrimitive &p) {
+                                return p.centroid[axis] <= split_point;
+                              });
+  return split - build.begin();
+}
+
+size_t BVHAccel::split_sah(std::vector<BVHBuildPrimitive> &build,
+                           size_t start, size_t end,
+                           const BBox &centroid_bb, ThreadPool &pool) const {
+
+  struct Bin {
+    BBox bb;
     size_t count = 0;
-    for (auto p = start; p != end; p++) {
-        BBox bb = (*p)->get_bbox();
-        bbox.expand(bb);
-        count++;
+  };
+
+  double cmin[3], scale[3];
+  for (int axis = 0; axis < 3; axis++) {
+    cmin[axis] = centroid_bb.min[axis];
+    double extent = centroid_bb.max[axis] - cmin[axis];
+    scale[axis] = extent > 0 ? BVH_SAH_BINS / extent : 0;
+  }
+
+  // bin primitives by centroid on all axes at once, chunks bin separately
+  // and are merged in order, which gives the same bins as a single pass
+  size_t chunks = bin_chunks(end - start, pool);
+  Bin local_bins[3 * BVH_SAH_BINS];
+  std::vector<Bin> chunk_bins(chunks > 1 ? chunks * 3 * BVH_SAH_BINS : 0);
+  Bin *all_bins = chunks > 1 ? &chunk_bins[0] : local_bins;
+  auto bin_range = [&](size_t first, size_t last, size_t c) {
+    Bin *bins = all_bins + c * 3 * BVH_SAH_BINS;
+    for (size_t i = first; i < last; i++) {
+      for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0) continue;
+        int b = std::min((int)((build[i].centroid[axis] - cmin[axis]) * scale[axis]),
+                         BVH_SAH_BINS - 1);
+        bins[axis * BVH_SAH_BINS + b].count++;
+        bins[axis * BVH_SAH_BINS + b].bb.expand(build[i].bb);
+      }
     }
-    BVHNode *node = new BVHNode(bbox);
+  };
+  if (chunks == 1) {
+    bin_range(start, end, 0);
+  } else {
+    pool.parallel_for(start, end, chunks, bin_range);
+    for (size_t c = 1; c < chunks; c++) {
+      for (int b = 0; b < 3 * BVH_SAH_BINS; b++) {
+        all_bins[b].count += all_bins[c * 3 * BVH_SAH_BINS + b].count;
+        all_bins[b].bb.expand(all_bins[c * 3 * BVH_SAH_BINS + b].bb);
+      }
+    }
+  }
+
+  double best_cost = INF_D;
+  int best_axis = -1;
+  int best_bin = -1;
 
-    // base case, is a leaf node
-    if (count <= max_leaf_size) {
-        node->start = start;
-        node->end = end;
-        return node;
+  for (int axis = 0; axis < 3; axis++) {
+    if (scale[axis] == 0) continue;
+    const Bin *bins = all_bins + axis * BVH_SAH_BINS;
+
+    // sweep from the right to get the area and count right of every plane
+    double right_area[BVH_SAH_BINS];
+    size_t right_count[BVH_SAH_BINS];
+    BBox acc;
+    size_t count = 0;
+    for (int b = BVH_SAH_BINS - 1; b > 0; b--) {
+      acc.expand(bins[b].bb);
+      count += bins[b].count;
+      right_area[b] = acc.surface_area();
+      right_count[b] = count;
+    }
+
+    // sweep from the left and evaluate the plane between bins b - 1 and b
+    acc = BBox();
+    count = 0;
+    for (int b = 1; b < BVH_SAH_BINS; b++) {
+      acc.expand(bins[b - 1].bb);
+      count += bins[b - 1].count;
+      if (count == 0 || right_count[b] == 0) continue;
+      double cost = acc.surface_area() * count + right_area[b] * right_count[b];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = b;
+      }
     }
+  }
+
+  if (best_axis < 0) {
+    return start;
+  }
+
+  int axis = best_axis, split_bin = best_bin;
+  double axis_min = cmin[axis], axis_scale = scale[axis];
+  auto split = std::partition(build.begin() + start, build.begin() + end,
+                              [=](const BVHBuildPrimitive &p) {
+                                int b = std::min((int)((p.centroid[axis] - axis_min) * axis_scale),
+                                                 BVH_SAH_BINS - 1);
+                                return b < split_bin;
+                              });
+  return split - build.begin();
+}
+
+static inline float round_down(double x) {
+  float f = (float)x;
+  return (double)f > x ? std::nextafter(f, -INF_F) : f;
+}
+
+static inline float round_up(double x) {
+  float f = (float)x;
+  return (double)f < x ? std::nextafter(f, INF_F) : f;
+}
+
+uint32_t BVHAccel::flatten(const BVHNode *node) {
+  uint32_t index = nodes.size();
+  nodes.push_back(BVHFlatNode());
+  for (int a = 0; a < 3; a++) {
+    nodes[index].min[a] = round_down(node->bb.min[a]);
+    nodes[index].max[a] = round_up(node->bb.max[a]);
+  }
 
-    // find longest axis of bbox
-    Vector3D bbox_range = bbox.max - bbox.min;
-    int axis;
-    for (int i = 0; i < 3; i++) {
-        if (bbox_range[i] == max({bbox_range[0], bbox_range[1], bbox_range[2]})) {
-            axis = i;
+  if (node->isLeaf()) {
+    nodes[index].offset = node->start;
+    nodes[index].count = node->range;
+  } else {
+    // the left child is always stored right after its parent
+    flatten(node->l);
+    uint32_t right = flatten(node->r);
+    nodes[index].offset = right;
+    nodes[index].count = 0;
+  }
+  return index;
+}
+
+int32_t BVHAccel::collapse(const BVHNode *node) {
+  // open the interior child with the largest surface area until there are
+  // four children, this pulls the nodes most likely to be hit up the tree
+  const BVHNode *children[4] = {node, NULL, NULL, NULL};
+  int n = 1;
+  while (n < 4) {
+    int best = -1;
+    double best_area = -1;
+    for (int c = 0; c < n; c++) {
+      double area = children[c]->bb.surface_area();
+      if (!children[c]->isLeaf() && area > best_area) {
+        best = c;
+        best_area = area;
+      }
+    }
+    if (best < 0) break;
+    const BVHNode *open = children[best];
+    children[best] = open->l;
+    children[n++] = open->r;
+  }
+
+  int32_t index = nodes4.size();
+  nodes4.push_back(BVH4Node());
+  for (int c = 0; c < 4; c++) {
+    const BVHNode *child = c < n ? children[c] : NULL;
+    if (!child || (child->isLeaf() && child->range == 0)) {
+      // an empty box, every slab test against it fails
+      for (int a = 0; a < 3; a++) {
+        nodes4[index].min[a][c] = INF_F;
+        nodes4[index].max[a][c] = -INF_F;
+      }
+      nodes4[index].child[c] = -1;
+      nodes4[index].count[c] = 0;
+      continue;
+    }
+
+    for (int a = 0; a < 3; a++) {
+      nodes4[index].min[a][c] = round_down(child->bb.min[a]);
+      nodes4[index].max[a][c] = round_up(child->bb.max[a]);
+    }
+    if (child->isLeaf()) {
+      nodes4[index].child[c] = child->start;
+      nodes4[index].count[c] = child->range;
+    } else {
+      // collapse may grow nodes4, so do not hold a reference across it
+      int32_t child_index = collapse(child);
+      nodes4[index].child[c] = child_index;
+      nodes4[index].count[c] = 0;
+    }
+  }
+  return index;
+}
+
+inline bool BVHAccel::has_intersection(const BVHPrimitiveRef &ref,
+                                       const Ray &r) const {
+  if (ref.mesh == BVH_NO_MESH) return primitives[ref.index]->has_intersection(r);
+  return meshes[ref.mesh]->has_intersection(ref.index, r);
+}
+
+inline bool BVHAccel::intersect(const BVHPrimitiveRef &ref, const Ray &r,
+                                Intersection *i) const {
+  if (ref.mesh == BVH_NO_MESH) return primitives[ref.index]->intersect(r, i);
+  return meshes[ref.mesh]->intersect(ref.index, r, i);
+}
+
+/**
+ * Single precision ray data shared by all node tests of one traversal.
+ */
+struct BVHTraversalRay {
+  BVHTraversalRay(const Ray &r) {
+    for (int a = 0; a < 3; a++) {
+      o[a] = (float)r.o[a];
+      inv_d[a] = 1.0f / (float)r.d[a];
+    }
+  }
+
+  float o[3];
+  float inv_d[3];
+};
+
+/**
+ * Slab test of a flattened node against the interval [t_min, t_max]. On a
+ * hit, t_entry is set to the parametric distance at which the ray enters the
+ * node. The comparisons are written so that a NaN from a ray parallel to an
+ * axis and starting on one of its slab planes leaves the interval untouched.
+ */
+static inline bool intersect_node(const BVHFlatNode &node,
+                                  const BVHTraversalRay &r, float t_min,
+                                  float t_max, float *t_entry) {
+  for (int a = 0; a < 3; a++) {
+    float t0 = (node.min[a] - r.o[a]) * r.inv_d[a];
+    float t1 = (node.max[a] - r.o[a]) * r.inv_d[a];
+    if (t0 > t1) std::swap(t0, t1);
+    t_min = t0 > t_min ? t0 : t_min;
+    t_max = t1 < t_max ? t1 : t_max;
+  }
+
+  // make up for the rounding error of the single precision slab distances
+  *t_entry = t_min;
+  return t_min <= t_max * 1.0000004f;
+}
+
+/**
+ * Ray data for the 4-wide node test. The sign of every direction component
+ * picks which of the two slab planes is entered first, and the origin and
+ * inverse direction are broadcast once per traversal for the SIMD test.
+ */
+struct BVH4TraversalRay : public BVHTraversalRay {
+  BVH4TraversalRay(const Ray &r) : BVHTraversalRay(r) {
+    for (int a = 0; a < 3; a++) {
+      neg[a] = inv_d[a] < 0;
+#ifdef BVH_USE_SSE
+      o4[a] = _mm_set1_ps(o[a]);
+      inv_d4[a] = _mm_set1_ps(inv_d[a]);
+#endif
+    }
+  }
+
+  int neg[3];
+#ifdef BVH_USE_SSE
+  __m128 o4[3];
+  __m128 inv_d4[3];
+#endif
+};
+
+/**
+ * Slab test of all four children of a node against [t_min, t_max]. Returns a
+ * mask with bit c set if child c is hit and writes the entry distances to
+ * t_entry. Like intersect_node, a NaN slab distance leaves the interval as it
+ * is; the SSE max/min return their second operand if either one is NaN.
+ */
+static inline int intersect_node4(const BVH4Node &node,
+                                  const BVH4TraversalRay &r, float t_min,
+                                  float t_max, float *t_entry) {
+#ifdef BVH_USE_SSE
+  __m128 t_near = _mm_set1_ps(t_min);
+  __m128 t_far = _mm_set1_ps(t_max);
+  for (int a = 0; a < 3; a++) {
+    const float *lo = r.neg[a] ? node.max[a] : node.min[a];
+    const float *hi = r.neg[a] ? node.min[a] : node.max[a];
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(lo), r.o4[a]), r.inv_d4[a]);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(hi), r.o4[a]), r.inv_d4[a]);
+    t_near = _mm_max_ps(t0, t_near);
+    t_far = _mm_min_ps(t1, t_far);
+  }
+  _mm_storeu_ps(t_entry, t_near);
+  t_far = _mm_mul_ps(t_far, _mm_set1_ps(1.0000004f));
+  return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+  int mask = 0;
+  for (int c = 0; c < 4; c++) {
+    float t_near = t_min, t_far = t_max;
+    for (int a = 0; a < 3; a++) {
+      float lo = r.neg[a] ? node.max[a][c] : node.min[a][c];
+      float hi = r.neg[a] ? node.min[a][c] : node.max[a][c];
+      float t0 = (lo - r.o[a]) * r.inv_d[a];
+      float t1 = (hi - r.o[a]) * r.inv_d[a];
+      t_near = t0 > t_near ? t0 : t_near;
+      t_far = t1 < t_far ? t1 : t_far;
+    }
+    t_entry[c] = t_near;
+    if (t_near <= t_far * 1.0000004f) mask |= 1 << c;
+  }
+  return mask;
+#endif
+}
+
+bool BVHAccel::has_intersection(const Ray &ray) const {
+  if (occluder_cache.bvh == this && occluder_cache.ref < refs.size()) {
+    total_isects++;
+    if (has_intersection(refs[occluder_cache.ref], ray)) {
+      ++total_rays;
+      return true;
+    }
+  }
+
+  if (width == BVH4) {
+    if (has_intersection4(ray)) return true;
+    occluder_cache.bvh = NULL;
+    return false;
+  }
+  ++total_rays;
+
+  BVHTraversalRay tr(ray);
+  float t;
+  if (nodes.empty() ||
+      !intersect_node(nodes[0], tr, ray.min_t, ray.max_t, &t)) {
+    return false;
+  }
+
+  uint32_t stack[BVH_STACK_SIZE];
+  int sp = 0;
+  uint32_t index = 0;
+  while (true) {
+    const BVHFlatNode &node = nodes[index];
+    if (node.count > 0) {
+      for (uint32_t p = node.offset; p < node.offset + node.count; p++) {
+        total_isects++;
+        if (has_intersection(refs[p], ray)) {
+          occluder_cache.bvh = this;
+          occluder_cache.ref = p;
+          return true;
         }
+      }
+    } else {
+      uint32_t near = index + 1, far = node.offset;
+      float t_near, t_far;
+      bool hit_near = intersect_node(nodes[near], tr, ray.min_t, ray.max_t, &t_near);
+      bool hit_far = intersect_node(nodes[far], tr, ray.min_t, ray.max_t, &t_far);
+      if (hit_near && hit_far) {
+        if (t_far < t_near) std::swap(near, far);
+        stack[sp++] = far;
+        index = near;
+        continue;
+      } else if (hit_near || hit_far) {
+        index = hit_near ? near : far;
+        continue;
+      }
     }
 
-    // compute  split point along the axis
-    double split_point = 0;
-    for (auto p = start; p != end; p++) {
-        Vector3D centroid = (*p)->get_bbox().centroid();
-        split_point += centroid[axis] / count;
+    if (sp == 0) break;
+    index = stack[--sp];
+  }
+  occluder_cache.bvh = NULL;
+  return false;
+}
+
+bool BVHAccel::intersect(const Ray &ray, Intersection *i) const {
+  if (width == BVH4) return intersect4(ray, i);
+  ++total_rays;
+
+  BVHTraversalRay tr(ray);
+  float t;
+  if (nodes.empty() ||
+      !intersect_node(nodes[0], tr, ray.min_t, ray.max_t, &t)) {
+    return false;
+  }
+
+  // every stack entry remembers where the ray enters the subtree, so that
+  // subtrees behind the closest hit found so far can be skipped
+  struct StackEntry {
+    uint32_t index;
+    float t;
+  };
+  StackEntry stack[BVH_STACK_SIZE];
+  int sp = 0;
+
+  bool hit = false;
+  uint32_t index = 0;
+  while (true) {
+    const BVHFlatNode &node = nodes[index];
+    if (node.count > 0) {
+      for (uint32_t p = node.offset; p < node.offset + node.count; p++) {
+        total_isects++;
+        hit = intersect(refs[p], ray, i) || hit;
+      }
+    } else {
+      // primitives shrink ray.max_t on every hit
+      uint32_t near = index + 1, far = node.offset;
+      float t_near, t_far;
+      bool hit_near = intersect_node(nodes[near], tr, ray.min_t, ray.max_t, &t_near);
+      bool hit_far = intersect_node(nodes[far], tr, ray.min_t, ray.max_t, &t_far);
+      if (hit_near && hit_far) {
+        if (t_far < t_near) {
+          std::swap(near, far);
+          std::swap(t_near, t_far);
+        }
+        stack[sp].index = far;
+        stack[sp].t = t_far;
+        sp++;
+        index = near;
+        continue;
+      } else if (hit_near || hit_far) {
+        index = hit_near ? near : far;
+        continue;
+      }
     }
 
-    // split
-    auto split = std::partition(start, end, [axis, split_point](Primitive* p){return p->get_bbox().centroid()[axis] <= split_point;});
+    // pop the next subtree that may still hold a closer hit
+    while (sp > 0 && stack[sp - 1].t > ray.max_t) sp--;
+    if (sp == 0) break;
+    index = stack[--sp].index;
+  }
+  return hit;
+}
 
-    // recurse
-    node->l = construct_bvh(start, split, max_leaf_size);
-    node->r = construct_bvh(split, end, max_leaf_size);
+bool BVHAccel::has_intersection4(const Ray &ray) const {
+  ++total_rays;
+  if (nodes4.empty()) return false;
 
-    return node;
-    
-}
-
-bool BVHAccel::has_intersection(const Ray &ray, BVHNode *node) const {
-  // TODO (Part 2.3):
-  // Fill in the intersect function.
-  // Take note that this function has a short-circuit that the
-  // Intersection version cannot, since it returns as soon as it finds
-  // a hit, it doesn't actually have to find the closest hit.
-    
-//    for (auto p : primitives) {
-//        total_isects++;
-//        if (p->has_intersection(ray))
-//          return true;
-//    }
-//    return false;
-    
-    // stop if no intersection
-    double t0 = ray.min_t;
-    double t1 = ray.max_t;
-    if (!node->bb.intersect(ray, t0, t1)) {
-        return false;
-    }
-
-    // leaf base case
-    if (node->isLeaf()) {
-        for (auto p = node->start; p != node->end; p++) {
-            total_isects++;
-            if ((*p)->has_intersection(ray)) {
-                return true;
-            }
+  BVH4TraversalRay tr(ray);
+
+  // leaves are children of a node rather than nodes of their own, so a stack
+  // entry is a (child, count) pair just like the node slots
+  struct StackEntry {
+    int32_t child;
+    uint32_t count;
+  };
+  StackEntry stack[BVH4_STACK_SIZE];
+  stack[0].child = 0;
+  stack[0].count = 0;
+  int sp = 1;
+
+  while (sp > 0) {
+    StackEntry e = stack[--sp];
+    if (e.count > 0) {
+      for (uint32_t p = e.child; p < e.child + e.count; p++) {
+        total_isects++;
+        if (has_intersection(refs[p], ray)) {
+          occluder_cache.bvh = this;
+          occluder_cache.ref = p;
+          return true;
         }
-        return false;
+      }
+      continue;
     }
 
-    // recurse on l and r children
-    return has_intersection(ray, node->l) || has_intersection(ray, node->r);
+    const BVH4Node &node = nodes4[e.child];
+    float t_entry[4];
+    int mask = intersect_node4(node, tr, ray.min_t, ray.max_t, t_entry);
+
+    // nearest child first, it is the most likely to hold an occluder
+    int order[4];
+    int n = sort_children(mask, t_entry, order);
+    for (int k = 0; k < n; k++) {
+      int c = order[k];
+      stack[sp].child = node.child[c];
+      stack[sp].count = node.count[c];
+      sp++;
+    }
+  }
+  return false;
 }
 
-bool BVHAccel::intersect(const Ray &ray, Intersection *i, BVHNode *node) const {
-  // TODO (Part 2.3):
-  // Fill in the intersect function.
+bool BVHAccel::intersect4(const Ray &ray, Intersection *i) const {
+  ++total_rays;
+  if (nodes4.empty()) return false;
+
+  BVH4TraversalRay tr(ray);
+
+  struct StackEntry {
+    int32_t child;
+    uint32_t count;
+    float t;
+  };
+  StackEntry stack[BVH4_STACK_SIZE];
+  stack[0].child = 0;
+  stack[0].count = 0;
+  stack[0].t = -INF_F;
+  int sp = 1;
 
-//  bool hit = false;
-//  for (auto p : primitives) {
-//    total_isects++;
-//    hit = p->intersect(ray, i) || hit;
-//  }
-//  return hit;
-    
-    // stop if no intersection
-    double t0 = ray.min_t;
-    double t1 = ray.max_t;
-    if (!node->bb.intersect(ray, t0, t1)) {
-        return false;
+  bool hit = false;
+  while (sp > 0) {
+    // primitives shrink ray.max_t on every hit, skip what lies behind it
+    StackEntry e = stack[--sp];
+    if (e.t > ray.max_t) continue;
+
+    if (e.count > 0) {
+      for (uint32_t p = e.child; p < e.child + e.count; p++) {
+        total_isects++;
+        hit = intersect(refs[p], ray, i) || hit;
+      }
+      continue;
+    }
+
+    const BVH4Node &node = nodes4[e.child];
+    float t_entry[4];
+    int mask = intersect_node4(node, tr, ray.min_t, ray.max_t, t_entry);
+
+    int order[4];
+    int n = sort_children(mask, t_entry, order);
+    for (int k = 0; k < n; k++) {
+      int c = order[k];
+      stack[sp].child = node.child[c];
+      stack[sp].count = node.count[c];
+      stack[sp].t = t_entry[c];
+      sp++;
+    }
+  }
+  return hit;
+}
+
+/**
+ * Structure of arrays copy of a ray packet plus the per-lane results. The
+ * node and triangle kernels loop over the lanes in use (rounded up to four)
+ * without branches so that the compiler can vectorize them, lanes outside
+ * the mask are simply ignored. One-lane packets use the scalar traversal.
+ */
+struct BVHPacketState {
+  BVHPacketState(const RayPacket &packet)
+      : width((packet.size + 3) & ~(size_t)3), live(packet.lanes()), hit(0) {
+    for (size_t l = 0; l < width; l++) {
+      const Ray &r = packet.rays[l < packet.size ? l : 0];
+      for (int a = 0; a < 3; a++) {
+        o[a][l] = (float)r.o[a];
+        inv_d[a][l] = 1.0f / (float)r.d[a];
+        od[a][l] = r.o[a];
+        dd[a][l] = r.d[a];
+      }
+      t_min[l] = r.min_t;
+      t_max[l] = r.max_t;
+      dt_min[l] = r.min_t;
+      dt_max[l] = r.max_t;
+      hit_mesh[l] = BVH_NO_MESH;
+    }
+  }
+
+  /**
+   * Shrink the interval of a lane after it found a closer hit.
+   */
+  void set_max_t(size_t l, double t) {
+    dt_max[l] = t;
+    t_max[l] = (float)t;
+  }
+
+  // single precision copy for the node tests
+  float o[3][RAY_PACKET_SIZE];
+  float inv_d[3][RAY_PACKET_SIZE];
+  float t_min[RAY_PACKET_SIZE];
+  float t_max[RAY_PACKET_SIZE];
+
+  // double precision copy for the triangle tests
+  double od[3][RAY_PACKET_SIZE];
+  double dd[3][RAY_PACKET_SIZE];
+  double dt_min[RAY_PACKET_SIZE];
+  double dt_max[RAY_PACKET_SIZE];
+
+  // closest mesh triangle hit so far, the intersection info of these is only
+  // filled in once traversal is done
+  uint32_t hit_mesh[RAY_PACKET_SIZE];
+  uint32_t hit_tri[RAY_PACKET_SIZE];
+  double hit_u[RAY_PACKET_SIZE];
+  double hit_v[RAY_PACKET_SIZE];
+
+  size_t width;   ///< lanes the kernels run over, a multiple of 4
+  uint32_t live;  ///< lanes that are still traversing
+  uint32_t hit;   ///< lanes that hit something
+};
+
+static inline int count_lanes(uint32_t mask) {
+  int n = 0;
+  for (; mask; mask &= mask - 1) n++;
+  return n;
+}
+
+static inline int first_lane(uint32_t mask) {
+  int l = 0;
+  while (!(mask & (1u << l))) l++;
+  return l;
+}
+
+/**
+ * Slab test of one box against all lanes of a packet. Returns the lanes of
+ * mask that hit the box and the entry distance of every lane. Written like
+ * intersect_node, so a NaN slab distance leaves the interval untouched.
+ */
+static inline uint32_t intersect_box_packet(const float *bmin,
+                                            const float *bmax,
+                                            const BVHPacketState &p,
+                                            uint32_t mask, float *t_entry) {
+  int hit[RAY_PACKET_SIZE];
+  for (size_t l = 0; l < p.width; l++) {
+    float t_near = p.t_min[l], t_far = p.t_max[l];
+    for (int a = 0; a < 3; a++) {
+      float t0 = (bmin[a] - p.o[a][l]) * p.inv_d[a][l];
+      float t1 = (bmax[a] - p.o[a][l]) * p.inv_d[a][l];
+      float lo = t0 > t1 ? t1 : t0;
+      float hi = t0 > t1 ? t0 : t1;
+      t_near = lo > t_near ? lo : t_near;
+      t_far = hi < t_far ? hi : t_far;
+    }
+    t_entry[l] = t_near;
+    hit[l] = t_near <= t_far * 1.0000004f;
+  }
+
+  uint32_t result = 0;
+  for (size_t l = 0; l < p.width; l++) {
+    result |= (uint32_t)hit[l] << l;
+  }
+  return result & mask;
+}
+
+/**
+ * Moller-Trumbore test of one triangle against all lanes of a packet, the
+ * lane-parallel form of intersect_triangle. Returns the lanes of mask that
+ * hit and their distances and barycentrics.
+ */
+static inline uint32_t intersect_triangle_packet(const BVHPacketState &p,
+                                                 uint32_t mask,
+                                                 const Vector3D &p1,
+                                                 const Vector3D &e1,
+                                                 const Vector3D &e2,
+                                                 double *t, double *u,
+                                                 double *v) {
+  int hit[RAY_PACKET_SIZE];
+  for (size_t l = 0; l < p.width; l++) {
+    double dx = p.dd[0][l], dy = p.dd[1][l], dz = p.dd[2][l];
+    double px = dy * e2.z - dz * e2.y;
+    double py = dz * e2.x - dx * e2.z;
+    double pz = dx * e2.y - dy * e2.x;
+    double inv_det = 1.0 / (e1.x * px + e1.y * py + e1.z * pz);
+    double tx = p.od[0][l] - p1.x, ty = p.od[1][l] - p1.y, tz = p.od[2][l] - p1.z;
+    double qx = ty * e1.z - tz * e1.y;
+    double qy = tz * e1.x - tx * e1.z;
+    double qz = tx * e1.y - ty * e1.x;
+    u[l] = (tx * px + ty * py + tz * pz) * inv_det;
+    v[l] = (dx * qx + dy * qy + dz * qz) * inv_det;
+    t[l] = (e2.x * qx + e2.y * qy + e2.z * qz) * inv_det;
+    hit[l] = (u[l] >= 0) & (v[l] >= 0) & (u[l] + v[l] <= 1) &
+             (t[l] >= p.dt_min[l]) & (t[l] <= p.dt_max[l]);
+  }
+
+  uint32_t result = 0;
+  for (size_t l = 0; l < p.width; l++) {
+    result |= (uint32_t)hit[l] << l;
+  }
+  return result & mask;
+}
+
+void BVHAccel::intersect_leaf(const RayPacket &packet, BVHPacketState &state,
+                              uint32_t first, uint32_t count, uint32_t mask,
+                              bool any_hit, Intersection *isects) const {
+  for (uint32_t p = first; p < first + count && mask; p++) {
+    const BVHPrimitiveRef &ref = refs[p];
+    total_isects += count_lanes(mask);
+
+    if (ref.mesh != BVH_NO_MESH) {
+      Vector3D p1, p2, p3;
+      meshes[ref.mesh]->get_triangle(ref.index, &p1, &p2, &p3);
+      double t[RAY_PACKET_SIZE], u[RAY_PACKET_SIZE], v[RAY_PACKET_SIZE];
+      uint32_t hits = intersect_triangle_packet(state, mask, p1, p2 - p1,
+                                                p3 - p1, t, u, v);
+      state.hit |= hits;
+      if (any_hit) {
+        if (hits) {
+          occluder_cache.bvh = this;
+          occluder_cache.ref = p;
+        }
+        state.live &= ~hits;
+        mask &= ~hits;
+        continue;
+      }
+      for (size_t l = 0; hits; l++, hits >>= 1) {
+        if (!(hits & 1)) continue;
+        state.set_max_t(l, t[l]);
+        packet.rays[l].max_t = t[l];
+        state.hit_mesh[l] = ref.mesh;
+        state.hit_tri[l] = ref.index;
+        state.hit_u[l] = u[l];
+        state.hit_v[l] = v[l];
+      }
+      continue;
+    }
+
+    // other primitives are tested lane by lane
+    const Primitive *prim = primitives[ref.index];
+    for (size_t l = 0; l < packet.size; l++) {
+      if (!(mask & (1u << l))) continue;
+      const Ray &r = packet.rays[l];
+      if (any_hit) {
+        if (prim->has_intersection(r)) {
+          occluder_cache.bvh = this;
+          occluder_cache.ref = p;
+          state.hit |= 1u << l;
+          state.live &= ~(1u << l);
+          mask &= ~(1u << l);
+        }
+      } else if (prim->intersect(r, &isects[l])) {
+        state.hit |= 1u << l;
+        state.set_max_t(l, r.max_t);
+        state.hit_mesh[l] = BVH_NO_MESH;
+      }
+    }
+  }
+}
+
+uint32_t BVHAccel::trace_packet(const RayPacket &packet, BVHPacketState &state,
+                                bool any_hit, Intersection *isects) const {
+  total_rays += packet.size;
+  if (packet.size == 0 || (width == BVH4 ? nodes4.empty() : nodes.empty())) {
+    return 0;
+  }
+
+  // as in intersect4, an entry is a node (count 0) or a leaf; in the binary
+  // tree leaves are nodes as well and entries always refer to nodes
+  struct StackEntry {
+    uint32_t child;
+    uint32_t count;
+    uint32_t mask;
+  };
+  StackEntry stack[BVH4_STACK_SIZE];
+  int sp = 0;
+
+  float t_entry[RAY_PACKET_SIZE];
+  if (width == BVH4) {
+    stack[0].child = 0;
+    stack[0].count = 0;
+    stack[0].mask = state.live;
+    sp = 1;
+  } else {
+    uint32_t mask = intersect_box_packet(nodes[0].min, nodes[0].max, state,
+                                         state.live, t_entry);
+    if (mask) {
+      stack[0].child = 0;
+      stack[0].count = 0;
+      stack[0].mask = mask;
+      sp = 1;
     }
+  }
+
+  while (sp > 0) {
+    StackEntry e = stack[--sp];
+    uint32_t mask = e.mask & state.live;
+    if (!mask) continue;
 
-    // leaf base case
-    if (node->isLeaf()) {
-        bool hit = false;
-        for (auto p = node->start; p != node->end; p++) {
-            total_isects++;
-            hit = (*p)->intersect(ray, i) || hit;
+    if (width == BVH4) {
+      if (e.count > 0) {
+        intersect_leaf(packet, state, e.child, e.count, mask, any_hit, isects);
+        continue;
+      }
+
+      // push the hit children far to near, ordered by the entry distance of
+      // the first lane that hits each of them
+      const BVH4Node &node = nodes4[e.child];
+      StackEntry children[4];
+      float t_first[4];
+      int n = 0;
+      for (int c = 0; c < 4; c++) {
+        if (node.child[c] < 0) continue;
+        float bmin[3] = {node.min[0][c], node.min[1][c], node.min[2][c]};
+        float bmax[3] = {node.max[0][c], node.max[1][c], node.max[2][c]};
+        uint32_t child_mask = intersect_box_packet(bmin, bmax, state, mask, t_entry);
+        if (!child_mask) continue;
+        int k = n++;
+        float t = t_entry[first_lane(child_mask)];
+        while (k > 0 && t_first[k - 1] < t) {
+          children[k] = children[k - 1];
+          t_first[k] = t_first[k - 1];
+          k--;
         }
-        return hit;
+        children[k].child = node.child[c];
+        children[k].count = node.count[c];
+        children[k].mask = child_mask;
+        t_first[k] = t;
+      }
+      for (int k = 0; k < n; k++) {
+        stack[sp++] = children[k];
+      }
+    } else {
+      const BVHFlatNode &node = nodes[e.child];
+      if (node.count > 0) {
+        intersect_leaf(packet, state, node.offset, node.count, mask, any_hit,
+                       isects);
+        continue;
+      }
+
+      uint32_t near = e.child + 1, far = node.offset;
+      uint32_t near_mask = intersect_box_packet(nodes[near].min, nodes[near].max,
+                                                state, mask, t_entry);
+      float t_near = near_mask ? t_entry[first_lane(near_mask)] : INF_F;
+      uint32_t far_mask = intersect_box_packet(nodes[far].min, nodes[far].max,
+                                               state, mask, t_entry);
+      float t_far = far_mask ? t_entry[first_lane(far_mask)] : INF_F;
+      if (t_far < t_near) {
+        std::swap(near, far);
+        std::swap(near_mask, far_mask);
+      }
+      if (far_mask) {
+        stack[sp].child = far;
+        stack[sp].count = 0;
+        stack[sp].mask = far_mask;
+        sp++;
+      }
+      if (near_mask) {
+        stack[sp].child = near;
+        stack[sp].count = 0;
+        stack[sp].mask = near_mask;
+        sp++;
+      }
     }
+  }
+  return state.hit;
+}
+
+uint32_t BVHAccel::intersect(const RayPacket &packet,
+                             Intersection *isects) const {
+  if (packet.size == 1) {
+    return intersect(packet.rays[0], &isects[0]) ? 1 : 0;
+  }
 
-    // recurse on l and r children
-    bool hit_l = intersect(ray, i, node->l);
-    bool hit_r = intersect(ray, i, node->r);
-    return hit_l || hit_r;
+  BVHPacketState state(packet);
+  uint32_t hit = trace_packet(packet, state, false, isects);
 
+  // fill in the intersection info of the lanes whose closest hit is a mesh
+  // triangle, once per lane rather than once per hit found on the way
+  for (size_t l = 0; l < packet.size; l++) {
+    if (!(hit & (1u << l)) || state.hit_mesh[l] == BVH_NO_MESH) continue;
+    const Mesh *mesh = meshes[state.hit_mesh[l]];
+    isects[l].t = state.dt_max[l];
+    isects[l].n = mesh->get_normal(state.hit_tri[l], state.hit_u[l],
+                                   state.hit_v[l]);
+    isects[l].primitive = NULL;
+    isects[l].bsdf = mesh->get_bsdf();
+  }
+  return hit;
+}
+
+uint32_t BVHAccel::has_intersection(const RayPacket &packet) const {
+  if (packet.size == 1) {
+    return has_intersection(packet.rays[0]) ? 1 : 0;
+  }
+
+  BVHPacketState state(packet);
+
+  // lanes blocked by the last occluder of this thread skip the traversal
+  if (occluder_cache.bvh == this && occluder_cache.ref < refs.size()) {
+    intersect_leaf(packet, state, occluder_cache.ref, 1, state.live, true, NULL);
+  }
+  uint32_t hit = trace_packet(packet, state, true, NULL);
+  if (hit != packet.lanes()) occluder_cache.bvh = NULL;
+  return hit;
 }
 
 } // namespace SceneObjects
@@ -3,11 +3,55 @@
 
 #include "scene.h"
 #include "aggregate.h"
+#include "pathtracer/ray_packet.h"
 
 #include <vector>
+#include <cstdint>
+#include <string>
 
-namespace CGL { namespace SceneObjects {
+namespace CGL {
 
+class ThreadPool;
+
+namespace SceneObjects {
+
+class Mesh;
+struct BVHPacketState;
+
+/**
+ * Strategy used to split a node while building the BVH.
+ * SPLIT_MEAN partitions the longest axis of the node at the mean primitive
+ * centroid. SPLIT_SAH evaluates a fixed number of binned candidate planes
+ * on every axis with the surface area heuristic and keeps the cheapest one.
+ */
+enum BVHSplitMethod {
+  SPLIT_MEAN,
+  SPLIT_SAH
+};
+
+/**
+ * Per-primitive data cached for BVH construction, so that the bounding box
+ * and centroid of every primitive are only computed once per build.
+ */
+struct BVHBuildPrimitive {
+  BBox bb;           ///< bounding box of the primitive
+  Vector3D centroid; ///< centroid of the bounding box
+  size_t index;      ///< index of the primitive in the input references
+};
+
+// mesh index of a reference to a standalone primitive
+static const uint32_t BVH_NO_MESH = 0xffffffffu;
+
+/**
+ * Reference to one primitive stored in the leaves of the BVH.
+ * Mesh triangles are referenced by their index in the triangle store of the
+ * mesh instead of through a heap allocated Triangle each, all other
+ * primitives (mesh is BVH_NO_MESH) by their index in the primitive vector.
+ */
+struct BVHPrimitiveRef {
+  uint32_t mesh;   ///< index of the mesh, or BVH_NO_MESH
+  uint32_t index;  ///< triangle of the mesh, or index of the primitive
+};
 
 /**
  * A node in the BVH accelerator aggregate.
@@ -21,7 +65,7 @@ namespace CGL { namespace SceneObjects {
  */
 struct BVHNode {
 
-  BVHNode(BBox bb): bb(bb), l(NULL), r(NULL) { }
+  BVHNode(BBox bb): bb(bb), l(NULL), r(NULL), start(0), range(0) { }
 
   ~BVHNode() {
     if (l) delete l;
@@ -34,8 +78,46 @@ struct BVHNode {
   BVHNode* l;     ///< left child node
   BVHNode* r;     ///< right child node
 
-  std::vector<Primitive*>::const_iterator start;
-  std::vector<Primitive*>::const_iterator end;
+  size_t start;   ///< index of the first primitive in the node
+  size_t range;   ///< number of primitives in the node
+};
+
+/**
+ * A node of the flattened BVH that is used for ray traversal.
+ * Nodes are stored depth first in one contiguous array, so the left child of
+ * an interior node always directly follows its parent and only the index of
+ * the right child needs to be stored. Bounds are kept in single precision and
+ * rounded outwards, which keeps a node at 32 bytes (two per cache line).
+ */
+struct BVHFlatNode {
+  float min[3];     ///< min corner of the bounding box
+  float max[3];     ///< max corner of the bounding box
+  uint32_t offset;  ///< leaf: first primitive, interior: index of right child
+  uint32_t count;   ///< number of primitives, 0 for interior nodes
+};
+
+/**
+ * A node of the 4-wide BVH.
+ * The binary tree is collapsed so that every node holds up to four children
+ * whose bounds are stored as structure of arrays, which lets one SIMD slab
+ * test check all four children at once. A child is either an interior node
+ * (count is 0 and child is its node index) or a leaf (child is the first
+ * primitive and count the number of primitives). Unused slots have count 0,
+ * child -1 and an empty box that no ray can hit.
+ */
+struct BVH4Node {
+  float min[3][4];    ///< min[a][c] is the min corner of child c along axis a
+  float max[3][4];    ///< max[a][c] is the max corner of child c along axis a
+  int32_t child[4];   ///< node index or first primitive
+  uint32_t count[4];  ///< number of primitives of leaves
+};
+
+/**
+ * Branching factor of the tree that is used for traversal.
+ */
+enum BVHWidth {
+  BVH2 = 2,
+  BVH4 = 4
 };
 
 /**
@@ -52,13 +134,26 @@ class BVHAccel : public Aggregate {
 
   /**
    * Parameterized Constructor.
-   * Create BVH from a list of primitives. Note that the BVHAccel Aggregate
-   * stores pointers to the primitives and thus the primitives need be kept
-   * in memory for the aggregate to function properly.
+   * Create BVH from a list of primitives and the triangles of a list of
+   * meshes. Note that the BVHAccel Aggregate stores pointers to the
+   * primitives and meshes and thus they need be kept in memory for the
+   * aggregate to function properly.
    * \param primitives primitives to build from
+   * \param meshes meshes whose triangles are added to the primitives
    * \param max_leaf_size maximum number of primitives to be stored in leaves
+   * \param split_method strategy used to split interior nodes
+   * \param width branching factor of the tree used for traversal
+   * \param pool threads to build the tree on, NULL builds it on the calling
+   *        thread alone
+   * \param cache_file file the built tree is cached in, if not empty. The
+   *        tree is loaded from it instead of being built when it was built
+   *        from the same primitive bounds and parameters before.
    */
-  BVHAccel(const std::vector<Primitive*>& primitives, size_t max_leaf_size = 4);
+  BVHAccel(const std::vector<Primitive*>& primitives,
+           const std::vector<const Mesh*>& meshes = std::vector<const Mesh*>(),
+           size_t max_leaf_size = 4, BVHSplitMethod split_method = SPLIT_SAH,
+           BVHWidth width = BVH2, ThreadPool* pool = NULL,
+           const std::string& cache_file = "");
 
   /**
    * Destructor.
@@ -81,12 +176,7 @@ class BVHAccel : public Aggregate {
    * \return true if the given ray intersects with the aggregate,
              false otherwise
    */
-  bool has_intersection(const Ray& r) const {
-    ++total_rays;
-    return has_intersection(r, root);
-  }
-
-  bool has_intersection(const Ray& r, BVHNode *node) const;
+  bool has_intersection(const Ray& r) const;
 
   /**
    * Ray - Aggregate intersection 2.
@@ -101,12 +191,27 @@ class BVHAccel : public Aggregate {
    * \return true if the given ray intersects with the aggregate,
              false otherwise
    */
-  bool intersect(const Ray& r, Intersection* i) const {
-    ++total_rays;
-    return intersect(r, i, root);
-  }
+  bool intersect(const Ray& r, Intersection* i) const;
 
-  bool intersect(const Ray& r, Intersection* i, BVHNode *node) const;
+  /**
+   * Ray packet - Aggregate intersection.
+   * Trace all rays of a packet through one shared traversal of the tree.
+   * Every node and every mesh triangle is tested against all active lanes at
+   * once, and a lane drops out of a subtree as soon as it misses its box.
+   * Meant for coherent rays, incoherent rays are faster one by one.
+   * \param packet rays to trace, max_t of every lane that hits is updated
+   * \param isects intersection info of the lanes, packet.size entries
+   * \return mask with bit l set if lane l hit the aggregate
+   */
+  uint32_t intersect(const RayPacket& packet, Intersection* isects) const;
+
+  /**
+   * Ray packet - Aggregate intersection test, see above. A lane stops
+   * traversing at its first hit.
+   * \param packet rays to test
+   * \return mask with bit l set if lane l hit the aggregate
+   */
+  uint32_t has_intersection(const RayPacket& packet) const;
 
   /**
    * Get BSDF of the surface material
@@ -117,7 +222,9 @@ class BVHAccel : public Aggregate {
   BSDF* get_bsdf() const { return NULL; }
 
   /**
-   * Get entry point (root) - used in visualizer
+   * Get entry point (root) of the pointer tree - used in visualizer.
+   * Ray traversal never touches the pointer tree, it uses the flattened
+   * node array built from it.
    */
   BVHNode* get_root() const { return root; }
 
@@ -133,12 +240,102 @@ class BVHAccel : public Aggregate {
   void drawOutline(const Color& c, float alpha) const { }
   void drawOutline(BVHNode *node, const Color& c, float alpha) const;
 
+  /**
+   * Memory used by the leaf references, in bytes.
+   */
+  size_t ref_bytes() const { return refs.size() * sizeof(BVHPrimitiveRef); }
+
+  /**
+   * Whether the tree was loaded from the cache file rather than built.
+   */
+  bool loaded_from_cache() const { return cached; }
+
   mutable unsigned long long total_rays, total_isects;
 
 private:
-  std::vector<Primitive*> primitives;
+  std::vector<Primitive*> primitives;  ///< standalone primitives
+  std::vector<const Mesh*> meshes;     ///< meshes referenced by triangle
+  std::vector<BVHPrimitiveRef> refs;   ///< leaf contents, in tree order
   BVHNode* root; ///< root node of the BVH
-  BVHNode *construct_bvh(std::vector<Primitive*>::iterator start, std::vector<Primitive*>::iterator end, size_t max_leaf_size);
+  BVHWidth width;                 ///< which of the trees below is used
+  std::vector<BVHFlatNode> nodes; ///< flattened binary tree (BVH2)
+  std::vector<BVH4Node> nodes4;   ///< collapsed 4-wide tree (BVH4)
+  BVHSplitMethod split_method; ///< split strategy used by construct_bvh
+  bool cached;                 ///< tree was loaded from the cache file
+
+  /**
+   * Build the subtree over build[start, end). Large ranges are split up
+   * among the threads of pool: bounds and SAH bins are gathered in
+   * parallel chunks and the two children are built concurrently. The tree
+   * is the same for any number of threads.
+   * \param depth depth of the subtree root, below BVH_MAX_SPLIT_DEPTH the
+   *              ranges are split at their median so that the tree stays
+   *              within the traversal stack
+   */
+  BVHNode *construct_bvh(std::vector<BVHBuildPrimitive>& build,
+                         size_t start, size_t end, size_t max_leaf_size,
+                         ThreadPool& pool, int depth = 0);
+
+  /**
+   * Load the tree built over build from a cache file written by save_cache.
+   * On success build is put into the order of the leaves and the root is
+   * returned, NULL if the file is missing, invalid or was written for
+   * another key.
+   */
+  BVHNode *load_cache(const std::string& path, uint64_t key,
+                      std::vector<BVHBuildPrimitive>& build) const;
+
+  /**
+   * Write the tree over build to a cache file: the order of the leaves and
+   * the shape of the tree. Bounds are recomputed from build on loading.
+   */
+  void save_cache(const std::string& path, uint64_t key,
+                  const std::vector<BVHBuildPrimitive>& build) const;
+
+  /**
+   * Choose the split of build[start, end) and partition it accordingly.
+   * Returns the index of the first primitive of the right child.
+   */
+  size_t split_mean(std::vector<BVHBuildPrimitive>& build, size_t start,
+                    size_t end, const BBox& centroid_bb) const;
+
+  size_t split_sah(std::vector<BVHBuildPrimitive>& build, size_t start,
+                   size_t end, const BBox& centroid_bb,
+                   ThreadPool& pool) const;
+
+  /**
+   * Append node and its subtree to the flattened node array in depth first
+   * order and return the index of node in the array.
+   */
+  uint32_t flatten(const BVHNode* node);
+
+  /**
+   * Collapse the subtree below the interior node into 4-wide nodes appended
+   * to nodes4 and return the index of the node created for it.
+   */
+  int32_t collapse(const BVHNode* node);
+
+  inline bool has_intersection(const BVHPrimitiveRef& ref, const Ray& r) const;
+  inline bool intersect(const BVHPrimitiveRef& ref, const Ray& r,
+                        Intersection* i) const;
+
+  bool has_intersection4(const Ray& r) const;
+  bool intersect4(const Ray& r, Intersection* i) const;
+
+  /**
+   * Shared packet traversal of either tree. With any_hit a lane leaves the
+   * packet at its first hit, otherwise the closest hit of every lane is
+   * recorded in state and isects.
+   */
+  uint32_t trace_packet(const RayPacket& packet, BVHPacketState& state,
+                        bool any_hit, Intersection* isects) const;
+
+  /**
+   * Test the lanes in mask against the primitives of a leaf.
+   */
+  void intersect_leaf(const RayPacket& packet, BVHPacketState& state,
+                      uint32_t first, uint32_t count, uint32_t mask,
+                      bool any_hit, Intersection* isects) const;
 };
 
 } // namespace SceneObjects
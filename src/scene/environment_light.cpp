@@ -46,6 +46,12 @@ namespace CGL { namespace SceneObjects {
     std::cout << "done." << std::endl;
   }
 
+  double EnvironmentLight::power(double sceneRadius) const {
+    // sample_L does not return the radiance of the map yet, samples sent
+    // here would be wasted
+    return 0;
+  }
+
   // Helper functions
 
   void EnvironmentLight::save_probability_debug() {
@@ -42,6 +42,11 @@ public:
     *   environment map horizontally? What about vertically?).
     */
   Vector3D sample_dir(const Ray& r) const;
+  /**
+    * Power of the light. 0 for as long as sample_L returns no radiance, so
+    * that the light sampler sends no samples here.
+    */
+  double power(double sceneRadius) const;
 
 private:
   const HDRImageBuffer* envMap;
@@ -2,7 +2,9 @@
 
 #include <iostream>
 
+#include "pathtracer/bsdf.h"
 #include "pathtracer/sampler.h"
+#include "triangle.h"
 
 namespace CGL { namespace SceneObjects {
 
@@ -22,6 +24,10 @@ Vector3D DirectionalLight::sample_L(const Vector3D p, Vector3D* wi,
   return radiance;
 }
 
+double DirectionalLight::power(double sceneRadius) const {
+  return PI * sceneRadius * sceneRadius * radiance.illum();
+}
+
 // Infinite Hemisphere Light //
 
 InfiniteHemisphereLight::InfiniteHemisphereLight(const Vector3D rad)
@@ -41,6 +47,10 @@ Vector3D InfiniteHemisphereLight::sample_L(const Vector3D p, Vector3D* wi,
   return radiance;
 }
 
+double InfiniteHemisphereLight::power(double sceneRadius) const {
+  return 2.0 * PI * PI * sceneRadius * sceneRadius * radiance.illum();
+}
+
 // Point Light //
 
 PointLight::PointLight(const Vector3D rad, const Vector3D pos) : 
@@ -56,6 +66,20 @@ Vector3D PointLight::sample_L(const Vector3D p, Vector3D* wi,
   return radiance;
 }
 
+double PointLight::power(double sceneRadius) const {
+  return 4.0 * PI * radiance.illum();
+}
+
+bool PointLight::bounds(LightBounds* b) const {
+  b->bounds = BBox(position);
+  b->phi = power(0);
+  b->axis = Vector3D(0, 0, 1);
+  b->cos_theta_o = -1;
+  b->cos_theta_e = 0;
+  b->two_sided = false;
+  return true;
+}
+
 
 // Spot Light //
 
@@ -83,37 +107,248 @@ Vector3D AreaLight::sample_L(const Vector3D p, Vector3D* wi,
 
   Vector2D sample = sampler.get_sample() - Vector2D(0.5f, 0.5f);
   Vector3D d = position + sample.x * dim_x + sample.y * dim_y - p;
-  double cosTheta = dot(d, direction);
   double sqDist = d.norm2();
   double dist = sqrt(sqDist);
   *wi = d / dist;
   *distToLight = dist;
+  double cosTheta = dot(*wi, direction);
   *pdf = sqDist / (area * fabs(cosTheta));
   return cosTheta < 0 ? radiance : Vector3D();
 };
 
+Vector3D AreaLight::eval_L(const Vector3D p, const Vector3D wi,
+                           double* distToLight, double* pdf) const {
+  // only the front of the light emits, sample_L gives nothing behind it
+  *pdf = 0;
+  double cosTheta = dot(wi, direction);
+  if (cosTheta >= 0) return Vector3D();
+  double t = dot(position - p, direction) / cosTheta;
+  if (t <= 0) return Vector3D();
+  Vector3D q = p + t * wi - position;
+  if (fabs(dot(q, dim_x)) > 0.5 * dim_x.norm2() ||
+      fabs(dot(q, dim_y)) > 0.5 * dim_y.norm2()) {
+    return Vector3D();
+  }
+  *distToLight = t;
+  *pdf = t * t / (area * -cosTheta);
+  return radiance;
+}
 
-// Sphere Light //
+double AreaLight::power(double sceneRadius) const {
+  return PI * area * radiance.illum();
+}
 
-SphereLight::SphereLight(const Vector3D rad, const SphereObject* sphere) {
+bool AreaLight::bounds(LightBounds* b) const {
+  b->bounds = BBox(position + 0.5 * (dim_x + dim_y));
+  b->bounds.expand(position + 0.5 * (dim_x - dim_y));
+  b->bounds.expand(position - 0.5 * (dim_x + dim_y));
+  b->bounds.expand(position - 0.5 * (dim_x - dim_y));
+  b->phi = power(0);
+  b->axis = direction;
+  b->cos_theta_o = 1;
+  b->cos_theta_e = 0;
+  b->two_sided = false;
+  return true;
+}
+
+
+// Sphere Light //
 
+SphereLight::SphereLight(const Vector3D rad, const SphereObject* sphere)
+  : sphere(sphere), radiance(rad) { }
+
+/**
+ * Distance from p along the unit direction wi to the near side of a sphere,
+ * or a negative number if wi misses it.
+ */
+static double sphere_distance(const Vector3D& p, const Vector3D& wi,
+                              const Vector3D& o, double r) {
+  Vector3D op = p - o;
+  double b = dot(wi, op);
+  double disc = b * b - (op.norm2() - r * r);
+  if (disc < 0) return -1;
+  return -b - sqrt(disc);
 }
 
 Vector3D SphereLight::sample_L(const Vector3D p, Vector3D* wi, 
                                double* distToLight, double* pdf) const {
+  // the sphere is seen within theta_max of the direction to its center;
+  // 1 - cos is computed from sin^2 so that small spheres keep their digits
+  Vector3D d = sphere->o - p;
+  double dist2 = d.norm2(), r2 = sphere->r * sphere->r;
+  if (dist2 <= r2) {
+    *pdf = 0;
+    return Vector3D();
+  }
+  double sin2_max = r2 / dist2;
+  double cos_max = sqrt(1 - sin2_max);
+  double one_minus_cos_max = sin2_max / (1 + cos_max);
+
+  Vector2D sample = sampler.get_sample();
+  double cos_theta = 1 - sample.x * one_minus_cos_max;
+  double sin_theta = sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+  double phi = 2.0 * PI * sample.y;
+  Matrix3x3 o2w;
+  make_coord_space(o2w, d);
+  *wi = (o2w * Vector3D(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta)).unit();
+
+  // a direction at the rim may just miss the sphere by rounding, it is then
+  // taken to graze it
+  double t = sphere_distance(p, *wi, sphere->o, sphere->r);
+  *distToLight = t > 0 ? t : sqrt(dist2 - r2);
+  *pdf = 1.0 / (2.0 * PI * one_minus_cos_max);
+  return radiance;
+}
 
-  return Vector3D();
+Vector3D SphereLight::eval_L(const Vector3D p, const Vector3D wi,
+                             double* distToLight, double* pdf) const {
+  *pdf = 0;
+  double dist2 = (sphere->o - p).norm2(), r2 = sphere->r * sphere->r;
+  if (dist2 <= r2) return Vector3D();
+  double t = sphere_distance(p, wi, sphere->o, sphere->r);
+  if (t <= 0) return Vector3D();
+  double sin2_max = r2 / dist2;
+  *distToLight = t;
+  *pdf = 1.0 / (2.0 * PI * sin2_max / (1 + sqrt(1 - sin2_max)));
+  return radiance;
 }
 
-// Mesh Light
+double SphereLight::power(double sceneRadius) const {
+  return 4.0 * PI * PI * sphere->r * sphere->r * radiance.illum();
+}
 
-MeshLight::MeshLight(const Vector3D rad, const Mesh* mesh) {
+bool SphereLight::bounds(LightBounds* b) const {
+  Vector3D r(sphere->r, sphere->r, sphere->r);
+  b->bounds = BBox(sphere->o - r, sphere->o + r);
+  b->phi = power(0);
+  b->axis = Vector3D(0, 0, 1);
+  b->cos_theta_o = -1;
+  b->cos_theta_e = 0;
+  b->two_sided = false;
+  return true;
+}
+
+// Mesh Light
 
+MeshLight::MeshLight(const Vector3D rad, const Mesh* mesh, size_t tri)
+  : mesh(mesh), radiance(rad) {
+  Vector3D p2, p3;
+  mesh->get_triangle(tri, &p1, &p2, &p3);
+  e1 = p2 - p1;
+  e2 = p3 - p1;
+  Vector3D n = cross(e1, e2);
+  area = 0.5 * n.norm();
+  normal = n.unit();
 }
 
 Vector3D MeshLight::sample_L(const Vector3D p, Vector3D* wi, 
                              double* distToLight, double* pdf) const {
-  return Vector3D();
+  // uniform on the triangle, folding the far half of the parallelogram back
+  Vector2D sample = sampler.get_sample();
+  if (sample.x + sample.y > 1) sample = Vector2D(1 - sample.x, 1 - sample.y);
+  Vector3D d = p1 + sample.x * e1 + sample.y * e2 - p;
+  double sqDist = d.norm2();
+  double dist = sqrt(sqDist);
+  *wi = d / dist;
+  *distToLight = dist;
+  *pdf = sqDist / (area * fabs(dot(*wi, normal)));
+  return radiance;
+}
+
+Vector3D MeshLight::eval_L(const Vector3D p, const Vector3D wi,
+                           double* distToLight, double* pdf) const {
+  double t, u, v;
+  *pdf = 0;
+  if (!intersect_triangle(Ray(p, wi), p1, e1, e2, &t, &u, &v) || t <= 0) {
+    return Vector3D();
+  }
+  *distToLight = t;
+  *pdf = t * t / (area * fabs(dot(wi, normal)));
+  return radiance;
+}
+
+double MeshLight::power(double sceneRadius) const {
+  return 2.0 * PI * area * radiance.illum();
+}
+
+bool MeshLight::bounds(LightBounds* b) const {
+  b->bounds = BBox(p1);
+  b->bounds.expand(p1 + e1);
+  b->bounds.expand(p1 + e2);
+  b->phi = power(0);
+  b->axis = normal;
+  b->cos_theta_o = 1;
+  b->cos_theta_e = 0;
+  b->two_sided = true;
+  return true;
+}
+
+// Emissive objects //
+
+// how far, relative to its size, a mesh may lie off the rectangle of an
+// area light and still be taken for that light's surface
+static const double AREA_LIGHT_PLANE_TOLERANCE = 0.01;
+
+/**
+ * If all of the mesh lies on the rectangle of the area light. Scenes
+ * exported with an area light carry its visible quad as such a mesh, at
+ * times with the sides of the light the other way round, so the rectangle
+ * is tried both ways.
+ */
+static bool lies_on_light(const Mesh* mesh, const AreaLight* light) {
+  double size_x = light->dim_x.norm(), size_y = light->dim_y.norm();
+  if (size_x <= 0 || size_y <= 0) return false;
+  double tolerance = AREA_LIGHT_PLANE_TOLERANCE * std::max(size_x, size_y);
+  Vector3D axis_x = light->dim_x / size_x, axis_y = light->dim_y / size_y;
+  bool along = true, across = true;
+  for (size_t i = 0; i < mesh->num_vertices; i++) {
+    Vector3D d = mesh->positions[i] - light->position;
+    if (fabs(dot(d, light->direction)) > tolerance) return false;
+    double x = fabs(dot(d, axis_x)), y = fabs(dot(d, axis_y));
+    along = along && x <= 0.5 * size_x + tolerance && y <= 0.5 * size_y + tolerance;
+    across = across && x <= 0.5 * size_y + tolerance && y <= 0.5 * size_x + tolerance;
+  }
+  return along || across;
+}
+
+Scene::~Scene() {
+  for (SceneLight* light : emissive_lights) delete light;
+}
+
+void Scene::add_emissive_lights() {
+  std::vector<const AreaLight*> area_lights;
+  for (SceneLight* light : lights) {
+    const AreaLight* area_light = dynamic_cast<const AreaLight*>(light);
+    if (area_light) area_lights.push_back(area_light);
+  }
+
+  for (SceneObject* obj : objects) {
+    BSDF* bsdf = obj->get_bsdf();
+    Vector3D radiance = bsdf ? bsdf->get_emission() : Vector3D();
+    if (radiance.illum() <= 0) continue;
+
+    const Mesh* mesh = dynamic_cast<const Mesh*>(obj);
+    if (mesh) {
+      bool surface_of_light = false;
+      for (const AreaLight* area_light : area_lights) {
+        surface_of_light = surface_of_light || lies_on_light(mesh, area_light);
+      }
+      if (surface_of_light) continue;
+      for (size_t tri = 0; tri < mesh->num_triangles(); tri++) {
+        // degenerate triangles give off no light
+        Vector3D p1, p2, p3;
+        mesh->get_triangle(tri, &p1, &p2, &p3);
+        if (cross(p2 - p1, p3 - p1).norm2() <= 0) continue;
+        emissive_lights.push_back(new MeshLight(radiance, mesh, tri));
+      }
+    }
+
+    const SphereObject* sphere = dynamic_cast<const SphereObject*>(obj);
+    if (sphere) {
+      emissive_lights.push_back(new SphereLight(radiance, sphere));
+    }
+  }
+  lights.insert(lights.end(), emissive_lights.begin(), emissive_lights.end());
 }
 
 } // namespace SceneObjects
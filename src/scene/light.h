@@ -19,6 +19,7 @@ class DirectionalLight : public SceneLight {
   Vector3D sample_L(const Vector3D p, Vector3D* wi, double* distToLight,
                     double* pdf) const;
   bool is_delta_light() const { return true; }
+  double power(double sceneRadius) const;
 
  private:
   Vector3D radiance;
@@ -34,6 +35,7 @@ class InfiniteHemisphereLight : public SceneLight {
   Vector3D sample_L(const Vector3D p, Vector3D* wi, double* distToLight,
                     double* pdf) const;
   bool is_delta_light() const { return false; }
+  double power(double sceneRadius) const;
 
   Vector3D radiance;
   Matrix3x3 sampleToWorld;
@@ -50,6 +52,8 @@ class PointLight : public SceneLight {
   Vector3D sample_L(const Vector3D p, Vector3D* wi, double* distToLight,
                     double* pdf) const;
   bool is_delta_light() const { return true; }
+  double power(double sceneRadius) const;
+  bool bounds(LightBounds* b) const;
 
   Vector3D radiance;
   Vector3D position;
@@ -65,6 +69,7 @@ class SpotLight : public SceneLight {
   Vector3D sample_L(const Vector3D p, Vector3D* wi, double* distToLight,
                     double* pdf) const;
   bool is_delta_light() const { return true; }
+  double power(double sceneRadius) const { return 0; } // gives no light yet
 
   Vector3D radiance;
   Vector3D position;
@@ -82,7 +87,11 @@ class AreaLight : public SceneLight {
             const Vector3D dim_x, const Vector3D dim_y);
   Vector3D sample_L(const Vector3D p, Vector3D* wi, double* distToLight,
                     double* pdf) const;
+  Vector3D eval_L(const Vector3D p, const Vector3D wi, double* distToLight,
+                  double* pdf) const;
   bool is_delta_light() const { return false; }
+  double power(double sceneRadius) const;
+  bool bounds(LightBounds* b) const;
 
   Vector3D radiance;
   Vector3D position;
@@ -96,30 +105,47 @@ class AreaLight : public SceneLight {
 
 // Sphere Light //
 
+// Samples the cone of directions in which the sphere is seen from the
+// shading point, which is all of the sphere that can light it.
 class SphereLight : public SceneLight {
  public:
   SphereLight(const Vector3D rad, const SphereObject* sphere);
   Vector3D sample_L(const Vector3D p, Vector3D* wi, double* distToLight,
                     double* pdf) const;
+  Vector3D eval_L(const Vector3D p, const Vector3D wi, double* distToLight,
+                  double* pdf) const;
   bool is_delta_light() const { return false; }
+  double power(double sceneRadius) const;
+  bool bounds(LightBounds* b) const;
 
   const SphereObject* sphere;
   Vector3D radiance;
-  UniformHemisphereSampler3D sampler;
+  UniformGridSampler2D sampler;
 
 }; // class SphereLight
 
 // Mesh Light
 
+// One triangle of an emissive mesh. Emission BSDFs shine on both sides, so
+// does the light; a mesh gives one light per triangle so that the light
+// sampler can choose between its parts.
 class MeshLight : public SceneLight {
  public:
-  MeshLight(const Vector3D rad, const Mesh* mesh);
+  MeshLight(const Vector3D rad, const Mesh* mesh, size_t tri);
   Vector3D sample_L(const Vector3D p, Vector3D* wi, double* distToLight,
                     double* pdf) const;
+  Vector3D eval_L(const Vector3D p, const Vector3D wi, double* distToLight,
+                  double* pdf) const;
   bool is_delta_light() const { return false; }
+  double power(double sceneRadius) const;
+  bool bounds(LightBounds* b) const;
 
   const Mesh* mesh;
   Vector3D radiance;
+  Vector3D p1, e1, e2;  ///< first corner and the edges leaving it
+  Vector3D normal;
+  double area;
+  UniformGridSampler2D sampler;
 
 }; // class MeshLight
 
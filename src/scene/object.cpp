@@ -2,6 +2,8 @@
 #include "sphere.h"
 #include "triangle.h"
 
+#include "GL/glew.h"
+
 #include <vector>
 #include <iostream>
 #include <unordered_map>
@@ -26,6 +28,7 @@ Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
     vertexI++;
   }
 
+  num_vertices = vertexI;
   positions = new Vector3D[vertexI];
   normals   = new Vector3D[vertexI];
   for (int i = 0; i < vertexI; i++) {
@@ -33,11 +36,15 @@ Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
     normals[i]   = verts[i]->normal;
   }
 
+  size_t num_faces = mesh.nFaces();
+  tri_v1.reserve(num_faces);
+  tri_v2.reserve(num_faces);
+  tri_v3.reserve(num_faces);
   for (FaceCIter f = mesh.facesBegin(); f != mesh.facesEnd(); f++) {
     HalfedgeCIter h = f->halfedge();
-    indices.push_back(vertexLabels[&*h->vertex()]);
-    indices.push_back(vertexLabels[&*h->next()->vertex()]);
-    indices.push_back(vertexLabels[&*h->next()->next()->vertex()]);
+    tri_v1.push_back(vertexLabels[&*h->vertex()]);
+    tri_v2.push_back(vertexLabels[&*h->next()->vertex()]);
+    tri_v3.push_back(vertexLabels[&*h->next()->next()->vertex()]);
   }
 
   this->bsdf = bsdf;
@@ -47,16 +54,74 @@ Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
 vector<Primitive*> Mesh::get_primitives() const {
 
   vector<Primitive*> primitives;
-  size_t num_triangles = indices.size() / 3;
-  for (size_t i = 0; i < num_triangles; ++i) {
-    Triangle* tri = new Triangle(this, indices[i * 3],
-                                       indices[i * 3 + 1],
-                                       indices[i * 3 + 2]);
+  for (size_t i = 0; i < num_triangles(); ++i) {
+    Triangle* tri = new Triangle(this, tri_v1[i], tri_v2[i], tri_v3[i]);
     primitives.push_back(tri);
   }
   return primitives;
 }
 
+BBox Mesh::get_triangle_bbox(size_t tri) const {
+  BBox bbox(positions[tri_v1[tri]]);
+  bbox.expand(positions[tri_v2[tri]]);
+  bbox.expand(positions[tri_v3[tri]]);
+  return bbox;
+}
+
+bool Mesh::has_intersection(size_t tri, const Ray &r) const {
+  const Vector3D &p1 = positions[tri_v1[tri]];
+  return has_intersection_triangle(r, p1, positions[tri_v2[tri]] - p1,
+                                   positions[tri_v3[tri]] - p1);
+}
+
+bool Mesh::intersect(size_t tri, const Ray &r, Intersection *isect) const {
+  const Vector3D &p1 = positions[tri_v1[tri]];
+  double t, u, v;
+  if (!intersect_triangle(r, p1, positions[tri_v2[tri]] - p1,
+                          positions[tri_v3[tri]] - p1, &t, &u, &v)) {
+    return false;
+  }
+
+  r.max_t = t;
+  if (isect != NULL) {
+    isect->t = t;
+    isect->n = get_normal(tri, u, v);
+    isect->primitive = NULL;
+    isect->bsdf = bsdf;
+  }
+  return true;
+}
+
+void Mesh::draw_triangle(size_t tri, const Color &c, float alpha) const {
+  const Vector3D &p1 = positions[tri_v1[tri]];
+  const Vector3D &p2 = positions[tri_v2[tri]];
+  const Vector3D &p3 = positions[tri_v3[tri]];
+  glColor4f(c.r, c.g, c.b, alpha);
+  glBegin(GL_TRIANGLES);
+  glVertex3d(p1.x, p1.y, p1.z);
+  glVertex3d(p2.x, p2.y, p2.z);
+  glVertex3d(p3.x, p3.y, p3.z);
+  glEnd();
+}
+
+void Mesh::draw_triangle_outline(size_t tri, const Color &c,
+                                 float alpha) const {
+  const Vector3D &p1 = positions[tri_v1[tri]];
+  const Vector3D &p2 = positions[tri_v2[tri]];
+  const Vector3D &p3 = positions[tri_v3[tri]];
+  glColor4f(c.r, c.g, c.b, alpha);
+  glBegin(GL_LINE_LOOP);
+  glVertex3d(p1.x, p1.y, p1.z);
+  glVertex3d(p2.x, p2.y, p2.z);
+  glVertex3d(p3.x, p3.y, p3.z);
+  glEnd();
+}
+
+size_t Mesh::get_memory_usage() const {
+  return num_vertices * 2 * sizeof(Vector3D) +
+         num_triangles() * 3 * sizeof(uint32_t);
+}
+
 BSDF* Mesh::get_bsdf() const {
   return bsdf;
 }
@@ -15,18 +15,82 @@ class Mesh : public SceneObject {
   /**
    * Constructor.
    * Construct a static mesh for rendering from halfedge mesh used in editing.
-   * Note that this converts the input halfedge mesh into a collection of
-   * world-space triangle primitives.
+   * Note that this converts the input halfedge mesh into an indexed triangle
+   * store: shared world-space vertex and normal arrays plus one array of
+   * vertex indices per triangle corner.
    */
   Mesh(const HalfedgeMesh& mesh, BSDF* bsdf);
 
   /**
    * Get all the primitives (Triangle) in the mesh.
-   * Note that Triangle reference the mesh for the actual data.
+   * Note that this allocates a Triangle per face that copies the vertex
+   * data. The BVH does not use it, it references the triangle store below
+   * by index instead.
    * \return all the primitives in the mesh
    */
   vector<Primitive*> get_primitives() const;
 
+  /**
+   * Get the number of triangles in the mesh.
+   */
+  size_t num_triangles() const { return tri_v1.size(); }
+
+  /**
+   * Get the world space corners of a triangle.
+   * \param tri index of the triangle
+   */
+  void get_triangle(size_t tri, Vector3D* p1, Vector3D* p2, Vector3D* p3) const {
+    *p1 = positions[tri_v1[tri]];
+    *p2 = positions[tri_v2[tri]];
+    *p3 = positions[tri_v3[tri]];
+  }
+
+  /**
+   * Interpolate the vertex normals of a triangle.
+   * \param tri index of the triangle
+   * \param u barycentric weight of the second corner
+   * \param v barycentric weight of the third corner
+   */
+  Vector3D get_normal(size_t tri, double u, double v) const {
+    return (1 - u - v) * normals[tri_v1[tri]] +
+           u * normals[tri_v2[tri]] + v * normals[tri_v3[tri]];
+  }
+
+  /**
+   * Get the world space bounding box of a triangle.
+   * \param tri index of the triangle
+   */
+  BBox get_triangle_bbox(size_t tri) const;
+
+  /**
+   * Ray - Triangle intersection against a triangle of the store, see
+   * Triangle::has_intersection.
+   * \param tri index of the triangle
+   * \param r ray to test intersection with
+   */
+  bool has_intersection(size_t tri, const Ray& r) const;
+
+  /**
+   * Ray - Triangle intersection 2 against a triangle of the store, see
+   * Triangle::intersect. The intersected primitive is left NULL since mesh
+   * triangles are not Primitive objects.
+   * \param tri index of the triangle
+   * \param r ray to test intersection with
+   * \param i address to store intersection info
+   */
+  bool intersect(size_t tri, const Ray& r, Intersection* i) const;
+
+  /**
+   * Draw a triangle (or its outline) with OpenGL (for visualizer)
+   */
+  void draw_triangle(size_t tri, const Color& c, float alpha) const;
+  void draw_triangle_outline(size_t tri, const Color& c, float alpha) const;
+
+  /**
+   * Get the memory used by the vertex, normal and index arrays, in bytes.
+   */
+  size_t get_memory_usage() const;
+
   /**
    * Get the BSDF of the surface material of the mesh.
    * \return BSDF of the surface material of the mesh
@@ -35,12 +99,16 @@ class Mesh : public SceneObject {
 
   Vector3D *positions;  ///< position array
   Vector3D *normals;    ///< normal array
+  size_t num_vertices;  ///< number of entries of positions and normals
 
  private:
 
   BSDF* bsdf; ///< BSDF of surface material
 
-  vector<size_t> indices;  ///< triangles defined by indices
+  // triangles defined by indices, tri_vk[i] is corner k of triangle i
+  vector<uint32_t> tri_v1;
+  vector<uint32_t> tri_v2;
+  vector<uint32_t> tri_v3;
 
 };
 
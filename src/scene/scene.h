@@ -29,15 +29,57 @@ class SceneObject {
 };
 
 
+/**
+ * Where a light is and which way it shines, for the light BVH. The light
+ * emits from inside bounds, in directions within cos_theta_e of the normals
+ * of its surface, which lie within cos_theta_o of axis.
+ */
+struct LightBounds {
+  BBox bounds;          ///< world space box around the emitters
+  double phi;           ///< power, see SceneLight::power
+  Vector3D axis;        ///< center of the cone of surface normals
+  double cos_theta_o;   ///< cosine of the half angle of the normal cone
+  double cos_theta_e;   ///< cosine of the angle of emission around a normal
+  bool two_sided;       ///< also emits on the back of the surface
+};
+
 /**
  * Interface for lights in the scene.
  */
 class SceneLight {
  public:
+  virtual ~SceneLight() { }
+
   virtual Vector3D sample_L(const Vector3D p, Vector3D* wi,
                             double* distToLight, double* pdf) const = 0;
   virtual bool is_delta_light() const = 0;
 
+  /**
+   * Power of the light, in the luminance of its radiance, which the light
+   * sampler picks lights by. Lights that have no position give the power
+   * falling onto a scene of the given bounding radius.
+   */
+  virtual double power(double sceneRadius) const = 0;
+
+  /**
+   * Bounds of the light for the light BVH, false for lights that have no
+   * position and shine onto every point alike.
+   */
+  virtual bool bounds(LightBounds* b) const { return false; }
+
+  /**
+   * The radiance arriving at p from the light along the direction wi, the
+   * counterpart of sample_L for a direction chosen elsewhere. pdf is the
+   * density with which sample_L picks wi, or 0 if wi misses the light. Lights
+   * that a ray in a sampled direction cannot find (delta and environment
+   * lights) keep the default of 0.
+   */
+  virtual Vector3D eval_L(const Vector3D p, const Vector3D wi,
+                          double* distToLight, double* pdf) const {
+    *pdf = 0;
+    return Vector3D();
+  }
+
 };
 
 
@@ -50,6 +92,11 @@ struct Scene {
         const std::vector<SceneLight *>& lights)
     : objects(objects), lights(lights) { }
 
+  /**
+   * Frees the lights that add_emissive_lights made.
+   */
+  ~Scene();
+
   // kept to make sure they don't get deleted, in case the
   //  primitives depend on them (e.g. Mesh Triangles).
   std::vector<SceneObject*> objects;
@@ -57,22 +104,17 @@ struct Scene {
   // for sake of consistency of the scene object Interface
   std::vector<SceneLight*> lights;
 
-  // TODO (sky) :
-  // Adding object with emission BSDFs as mesh lights and sphere lights so 
-  // that light sampling configurations also applies to mesh lights. 
-//  for (SceneObjects *obj : objects) {
-//    if (obj->get_material().emit != Vector3D()) {
-//      
-//      // mesh light
-//      if (dynamic_cast<Mesh*>(obj)) {
-//        staticLights.push_back()
-//      }
-//      
-//      // sphere light
-//      if (dynamic_cast<Sphere*>(obj)) {
-//
-//      }
-//  }
+  /**
+   * Add the objects with emission BSDFs to the lights, so that light
+   * sampling finds them too: a MeshLight per triangle of an emissive mesh
+   * and a SphereLight per emissive sphere. A mesh lying inside the
+   * rectangle of an area light is the visible surface of that light and is
+   * left out.
+   */
+  void add_emissive_lights();
+
+  // lights made by add_emissive_lights, owned by the scene
+  std::vector<SceneLight*> emissive_lights;
 
 };
 
@@ -36,7 +36,12 @@ bool Sphere::has_intersection(const Ray &r) const {
   // TODO (Part 1.4):
   // Implement ray - sphere intersection.
   // Note that you might want to use the the Sphere::test helper here.
-    return intersect(r, NULL);
+    // only the interval test, no normal and no update of r.max_t
+    double t1, t2;
+    if (!test(r, t1, t2)) {
+        return false;
+    }
+    return (t1 >= r.min_t && t1 <= r.max_t) || (t2 >= r.min_t && t2 <= r.max_t);
 }
 
 bool Sphere::intersect(const Ray &r, Intersection *i) const {
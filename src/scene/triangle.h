@@ -6,6 +6,56 @@
 
 namespace CGL { namespace SceneObjects {
 
+/**
+ * Möller–Trumbore ray - triangle intersection against a triangle given by its
+ * first vertex and the two edges leaving it. All tests are folded into one
+ * condition and the edge tests are inclusive. The test is not watertight:
+ * rounding can still let a ray slip through an edge shared by two triangles.
+ * \param r ray to test intersection with, only [r.min_t, r.max_t] is searched
+ * \param p1 first vertex of the triangle
+ * \param e1 edge from the first to the second vertex
+ * \param e2 edge from the first to the third vertex
+ * \param t set to the parametric distance of the hit
+ * \param u set to the barycentric weight of the second vertex
+ * \param v set to the barycentric weight of the third vertex
+ * \return true if the ray hits the triangle within its interval
+ */
+inline bool intersect_triangle(const Ray& r, const Vector3D& p1,
+                               const Vector3D& e1, const Vector3D& e2,
+                               double* t, double* u, double* v) {
+  Vector3D pvec = cross(r.d, e2);
+  double inv_det = 1.0 / dot(e1, pvec);
+  Vector3D tvec = r.o - p1;
+  Vector3D qvec = cross(tvec, e1);
+  *u = dot(tvec, pvec) * inv_det;
+  *v = dot(r.d, qvec) * inv_det;
+  *t = dot(e2, qvec) * inv_det;
+
+  // a ray parallel to the triangle gets an infinite inv_det, which turns the
+  // barycentrics into inf or NaN and fails the comparisons below
+  return *u >= 0 && *v >= 0 && *u + *v <= 1 &&
+         *t >= r.min_t && *t <= r.max_t;
+}
+
+/**
+ * Any-hit form of intersect_triangle for shadow rays. It computes the same
+ * quantities in the same order, so both agree on every ray, but returns as
+ * soon as one of the tests fails and never reports where the hit is.
+ */
+inline bool has_intersection_triangle(const Ray& r, const Vector3D& p1,
+                                      const Vector3D& e1, const Vector3D& e2) {
+  Vector3D pvec = cross(r.d, e2);
+  double inv_det = 1.0 / dot(e1, pvec);
+  Vector3D tvec = r.o - p1;
+  double u = dot(tvec, pvec) * inv_det;
+  if (!(u >= 0 && u <= 1)) return false;
+  Vector3D qvec = cross(tvec, e1);
+  double v = dot(r.d, qvec) * inv_det;
+  if (!(v >= 0 && u + v <= 1)) return false;
+  double t = dot(e2, qvec) * inv_det;
+  return t >= r.min_t && t <= r.max_t;
+}
+
 /**
  * A single triangle from a mesh.
  * To save space, it holds a pointer back to the data in the original mesh
@@ -75,6 +125,8 @@ public:
 
   Vector3D p1, p2, p3;
   Vector3D n1, n2, n3;
+
+  Vector3D e1, e2;  ///< edges p2 - p1 and p3 - p1, cached for intersection
   
   BSDF* bsdf;
 
@@ -1,24 +1,70 @@
 #ifndef CGL_RANDOMUTIL_H
 #define CGL_RANDOMUTIL_H
 
-#include <random>
-
-// #define XORSHIFT_RAND
+#include <cstdint>
 
 namespace CGL {
 
-static std::mersenne_twister_engine<std::uint_fast32_t, 32, 624, 397, 31, 0x9908b0df,
-                             11, 0xffffffff, 7, 0x9d2c5680, 15, 0xefc60000, 18,
-                             1812433253> minstd_engine;
+/**
+ * PCG32 random number generator: a 64 bit linear congruential generator
+ * whose state is permuted into 32 bit outputs (XSH RR). Every increment
+ * selects an independent stream, so streams can be handed out per pixel.
+ */
+struct PCG32 {
+
+  /**
+   * Restart the generator.
+   * \param initstate starting point within the stream
+   * \param initseq selects the stream
+   */
+  void seed(uint64_t initstate, uint64_t initseq) {
+    state = 0;
+    inc = (initseq << 1u) | 1u;
+    next();
+    state += initstate;
+    next();
+  }
+
+  uint32_t next() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ull + inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = (uint32_t)(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+  }
+
+  uint64_t state = 0x853c49e6748fea9bull;
+  uint64_t inc = 0xda3e39cb94b95bdbull;
+};
 
-static double rmax = 1.0 / (minstd_engine.max() - minstd_engine.min());
+/**
+ * Generator of the calling thread, all random numbers are drawn from it.
+ * Render threads reseed it for every pixel (PathTracer::seed_pixel), which
+ * makes a render independent of the number of threads and tile order.
+ */
+inline PCG32& thread_rng() {
+  static thread_local PCG32 rng;
+  return rng;
+}
 
+/**
+ * Hash a 64 bit value (splitmix64 finalizer), so that consecutive seeds
+ * give unrelated generator states.
+ */
+inline uint64_t mix_bits(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
 
 /**
- * Returns a number distributed uniformly over [0, 1].
+ * Returns a number distributed uniformly over (0, 1).
  */
 inline double random_uniform() {
-  return clamp(double(minstd_engine() - minstd_engine.min()) * rmax, 0.0000001, 0.99999999);
+  return (thread_rng().next() + 0.5) * (1.0 / 4294967296.0);
 }
 
 /**
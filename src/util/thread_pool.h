@@ -0,0 +1,162 @@
+#ifndef CGL_THREAD_POOL_H
+#define CGL_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace CGL {
+
+/**
+ * A small pool of threads for fork-join style work, e.g. building
+ * acceleration structures, and for long running jobs like render workers.
+ * A pool of n threads counts the calling thread as one of them and starts
+ * n - 1 workers. Tasks are grouped by an atomic counter of pending tasks:
+ * run() increments it and the task decrements it once it is done, wait()
+ * returns when it reaches zero. A thread that waits keeps running queued
+ * tasks meanwhile, so tasks may themselves spawn and wait for tasks without
+ * blocking the pool. With a single thread every task runs immediately.
+ * Jobs queued with submit() report their completion through a future
+ * instead, the submitting thread does not take part in running them.
+ */
+class ThreadPool {
+ public:
+
+  explicit ThreadPool(size_t num_threads) : stopping(false) {
+    for (size_t i = 1; i < num_threads; i++) {
+      workers.push_back(std::thread(&ThreadPool::worker_loop, this));
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (std::thread &t : workers) t.join();
+  }
+
+  /**
+   * Number of threads working on tasks, the calling thread included.
+   */
+  size_t size() const { return workers.size() + 1; }
+
+  /**
+   * Queue a task.
+   * \param task function to run on any thread of the pool
+   * \param pending counter of the group of the task
+   */
+  void run(const std::function<void()> &task, std::atomic<size_t> &pending) {
+    if (workers.empty()) {
+      task();
+      return;
+    }
+    pending++;
+    push([task, &pending]() {
+      task();
+      pending--;
+    });
+  }
+
+  /**
+   * Queue a job for the workers.
+   * \param job function to run on a worker thread
+   * \return future that becomes ready once the job has run
+   */
+  std::future<void> submit(const std::function<void()> &job) {
+    std::shared_ptr<std::packaged_task<void()>> task(new std::packaged_task<void()>(job));
+    std::future<void> done = task->get_future();
+    if (workers.empty()) {
+      (*task)();
+    } else {
+      push([task]() { (*task)(); });
+    }
+    return done;
+  }
+
+  /**
+   * Run queued tasks until all tasks of a group are done.
+   * \param pending counter of the group
+   */
+  void wait(std::atomic<size_t> &pending) {
+    while (pending > 0) {
+      if (!run_one()) std::this_thread::yield();
+    }
+  }
+
+  /**
+   * Call f(begin, end) on consecutive chunks of [begin, end) in parallel and
+   * wait for all of them. Chunks are numbered in order by their third
+   * argument, so per chunk results can be combined deterministically.
+   * \param begin first index
+   * \param end one past the last index
+   * \param chunks number of chunks to split the range into
+   * \param f function of (chunk begin, chunk end, chunk number)
+   */
+  void parallel_for(size_t begin, size_t end, size_t chunks,
+                    const std::function<void(size_t, size_t, size_t)> &f) {
+    chunks = std::max<size_t>(1, std::min(chunks, end - begin));
+    size_t step = (end - begin + chunks - 1) / chunks;
+    std::atomic<size_t> pending(0);
+    for (size_t c = 0; c < chunks; c++) {
+      size_t b = begin + c * step, e = std::min(end, b + step);
+      if (b >= e) break;
+      run([&f, b, e, c]() { f(b, e, c); }, pending);
+    }
+    wait(pending);
+  }
+
+ private:
+
+  void push(const std::function<void()> &task) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      tasks.push_back(task);
+    }
+    cv.notify_one();
+  }
+
+  bool run_one() {
+    std::function<void()> task;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (tasks.empty()) return false;
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+    return true;
+  }
+
+  void worker_loop() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard, [this]() { return stopping || !tasks.empty(); });
+        if (tasks.empty()) return;
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread> workers;             ///< threads besides the caller
+  std::deque<std::function<void()>> tasks;      ///< queued tasks, oldest first
+  std::mutex lock;
+  std::condition_variable cv;                   ///< signals new tasks or stop
+  bool stopping;                                ///< set when the pool shuts down
+};
+
+} // namespace CGL
+
+#endif // CGL_THREAD_POOL_H
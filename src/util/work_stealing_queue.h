@@ -0,0 +1,127 @@
+#ifndef CGL_WORK_STEALING_QUEUE_H
+#define CGL_WORK_STEALING_QUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * Lock free work queue with one deque per worker thread.
+ * A batch of work is handed out with reset() before the workers start,
+ * round robin over the deques in the given order. Every worker takes work
+ * from the front of its own deque, so each one starts with the first items
+ * of the batch, and once it runs dry steals from the back of the deques of
+ * the other workers. Taking and stealing are Chase-Lev deque operations,
+ * two atomic loads and at most one compare and swap, so fetching work never
+ * takes a lock and stays O(1) however many workers there are.
+ * Like WorkQueue, no work can be added while the workers run.
+ */
+template <class T>
+class WorkStealingQueue {
+ private:
+
+  /**
+   * Chase-Lev deque over a fixed array. The owner takes from the bottom,
+   * thieves steal from the top. Items are stored last first, so the bottom
+   * holds the first item of the batch. Since nothing is pushed while the
+   * deque is in use, slots are never overwritten and no resizing is needed.
+   */
+  struct Deque {
+    Deque() : top(0), bottom(0) { }
+
+    std::atomic<int64_t> top;
+    char pad[64];                 ///< keeps thieves off the owner's line
+    std::atomic<int64_t> bottom;
+    std::vector<T> items;
+  };
+
+  std::vector<std::unique_ptr<Deque>> deques;
+
+ public:
+
+  WorkStealingQueue() {}
+
+  /**
+   * Replace the work of the queue. Must not be called while workers run.
+   * \param num_threads number of workers that take work from the queue,
+   *                    at least one deque is made if it is 0
+   * \param work items in the order they should be worked on
+   */
+  void reset(size_t num_threads, const std::vector<T>& work) {
+    if (num_threads == 0) num_threads = 1;
+    deques.clear();
+    for (size_t i = 0; i < num_threads; i++) {
+      deques.push_back(std::unique_ptr<Deque>(new Deque()));
+    }
+    for (size_t i = work.size(); i-- > 0;) {
+      deques[i % num_threads]->items.push_back(work[i]);
+    }
+    for (auto &d : deques) {
+      d->top.store(0, std::memory_order_relaxed);
+      d->bottom.store(d->items.size(), std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  /**
+   * Take work from the own deque, or steal it from another worker.
+   * \param thread index of the calling worker
+   * \param outPtr address to store the work in
+   * \return false if there is no work left in any deque
+   */
+  bool try_get_work(size_t thread, T *outPtr) {
+    if (deques.empty()) return false;
+    if (take(*deques[thread % deques.size()], outPtr)) return true;
+    for (size_t i = 1; i < deques.size(); i++) {
+      Deque &victim = *deques[(thread + i) % deques.size()];
+      while (victim.top.load(std::memory_order_acquire) <
+             victim.bottom.load(std::memory_order_acquire)) {
+        if (steal(victim, outPtr)) return true;
+      }
+    }
+    return false;
+  }
+
+  void clear() {
+    deques.clear();
+  }
+
+ private:
+
+  static bool take(Deque &d, T *outPtr) {
+    int64_t b = d.bottom.load(std::memory_order_relaxed) - 1;
+    d.bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = d.top.load(std::memory_order_relaxed);
+    if (t > b) {
+      d.bottom.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+    *outPtr = d.items[b];
+    if (t == b) {
+      // last item, race the thieves for it
+      bool won = d.top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                               std::memory_order_relaxed);
+      d.bottom.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  static bool steal(Deque &d, T *outPtr) {
+    int64_t t = d.top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = d.bottom.load(std::memory_order_acquire);
+    if (t >= b) return false;
+    T item = d.items[t];
+    if (!d.top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+      return false;
+    }
+    *outPtr = item;
+    return true;
+  }
+};
+
+#endif  // CGL_WORK_STEALING_QUEUE_H